@@ -13,9 +13,11 @@
 
 #include <cassert>
 #include <cstddef>
+#include <cstring>
 #include <cuda.h>
 #include <cuda_runtime_api.h>
 #include <list>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -110,6 +112,9 @@ struct KernelTy {
 /// List that contains all the kernels.
 /// FIXME: we may need this to be per device and per library.
 std::list<KernelTy> KernelsList;
+/// Guards KernelsList and DeviceInfo.Modules, as images may be loaded on
+/// several devices at once.
+std::mutex KernelsListMtx;
 
 /// Class containing all the device information.
 class RTLDeviceInfoTy {
@@ -421,7 +426,9 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
   }
 
   DP("CUDA module successfully loaded!\n");
+  KernelsListMtx.lock();
   DeviceInfo.Modules.push_back(cumod);
+  KernelsListMtx.unlock();
 
   // Find the symbols in the module by name.
   __tgt_offload_entry *HostBegin = image->EntriesBegin;
@@ -521,10 +528,11 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
       CUDA_ERR_STRING(err);
     }
 
-    KernelsList.push_back(KernelTy(fun, CP));
-
     __tgt_offload_entry entry = *e;
+    KernelsListMtx.lock();
+    KernelsList.push_back(KernelTy(fun, CP));
     entry.addr = (void *)&KernelsList.back();
+    KernelsListMtx.unlock();
     DeviceInfo.addOffloadEntry(device_id, entry);
   }
 
@@ -626,6 +634,73 @@ int32_t __tgt_rtl_data_submit(int32_t device_id, void *tgt_ptr, void *hst_ptr,
   return OFFLOAD_SUCCESS;
 }
 
+// Pinned host buffer the batched copies of one thread are staged in.
+struct StagingBufferTy {
+  void *Ptr;
+  size_t Size;
+  StagingBufferTy() : Ptr(NULL), Size(0) {}
+  ~StagingBufferTy() {
+    if (Ptr)
+      cuMemFreeHost(Ptr);
+  }
+};
+static thread_local StagingBufferTy StagingBuffer;
+
+int32_t __tgt_rtl_data_submit_batch(int32_t device_id, int32_t num,
+    void **tgt_ptrs, void **hst_ptrs, int64_t *sizes,
+    __tgt_async_info *async_info) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  size_t total = 0;
+  for (int32_t i = 0; i < num; ++i)
+    total += sizes[i];
+  if (total > StagingBuffer.Size) {
+    if (StagingBuffer.Ptr)
+      cuMemFreeHost(StagingBuffer.Ptr);
+    StagingBuffer.Size = 0;
+    err = cuMemHostAlloc(&StagingBuffer.Ptr, total,
+        CU_MEMHOSTALLOC_PORTABLE);
+    if (err != CUDA_SUCCESS) {
+      DP("Error when allocating a staging buffer of %zu bytes\n", total);
+      CUDA_ERR_STRING(err);
+      StagingBuffer.Ptr = NULL;
+      return OFFLOAD_FAIL;
+    }
+    StagingBuffer.Size = total;
+  }
+
+  // Copies out of pinned memory are queued without blocking, so the whole
+  // batch costs a single wait.
+  char *src = (char *)StagingBuffer.Ptr;
+  for (int32_t i = 0; i < num; ++i) {
+    memcpy(src, hst_ptrs[i], sizes[i]);
+    err = cuMemcpyHtoDAsync((CUdeviceptr)tgt_ptrs[i], src, sizes[i], 0);
+    if (err != CUDA_SUCCESS) {
+      DP("Error when copying data from host to device. Pointers: host = "
+         DPxMOD ", device = " DPxMOD ", size = %" PRId64 "\n",
+         DPxPTR(hst_ptrs[i]), DPxPTR(tgt_ptrs[i]), sizes[i]);
+      CUDA_ERR_STRING(err);
+      cuStreamSynchronize(0);
+      return OFFLOAD_FAIL;
+    }
+    src += sizes[i];
+  }
+
+  err = cuStreamSynchronize(0);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when waiting for batched copies to the device\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_retrieve(int32_t device_id, void *hst_ptr, void *tgt_ptr,
     int64_t size) {
   // Set the context we are using.
@@ -647,6 +722,53 @@ int32_t __tgt_rtl_data_retrieve(int32_t device_id, void *hst_ptr, void *tgt_ptr,
   return OFFLOAD_SUCCESS;
 }
 
+int32_t __tgt_rtl_data_exchange(int32_t src_dev_id, void *src_ptr,
+    int32_t dst_dev_id, void *dst_ptr, int64_t size) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[src_dev_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  // The driver copies directly if peer access is possible and stages the
+  // data itself otherwise.
+  err = cuMemcpyPeer((CUdeviceptr)dst_ptr, DeviceInfo.Contexts[dst_dev_id],
+      (CUdeviceptr)src_ptr, DeviceInfo.Contexts[src_dev_id], size);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when copying data from device %d to device %d. Pointers: "
+        "src = " DPxMOD ", dst = " DPxMOD ", size = %" PRId64 "\n",
+        src_dev_id, dst_dev_id, DPxPTR(src_ptr), DPxPTR(dst_ptr), size);
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_get_mem_info(int32_t device_id, int64_t *free_size,
+    int64_t *total_size) {
+  // Set the context we are using.
+  CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when setting CUDA context\n");
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+
+  size_t Free, Total;
+  err = cuMemGetInfo(&Free, &Total);
+  if (err != CUDA_SUCCESS) {
+    DP("Error when querying the memory of device %d\n", device_id);
+    CUDA_ERR_STRING(err);
+    return OFFLOAD_FAIL;
+  }
+  DP("Device %d has %zu of %zu bytes free\n", device_id, Free, Total);
+  *free_size = Free;
+  *total_size = Total;
+  return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_delete(int32_t device_id, void *tgt_ptr) {
   // Set the context we are using.
   CUresult err = cuCtxSetCurrent(DeviceInfo.Contexts[device_id]);
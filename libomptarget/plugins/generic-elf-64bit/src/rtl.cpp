@@ -11,16 +11,30 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdio>
 #include <cstring>
 #include <cstdlib>
+#include <deque>
 #include <dlfcn.h>
 #include <ffi.h>
+#include <fstream>
+#include <functional>
 #include <gelf.h>
 #include <link.h>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <sched.h>
 #include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 #include "omptargetplugin.h"
@@ -50,13 +64,40 @@ static int DebugLevel = 0;
 
 #include "../../common/elf_common.c"
 
+#ifndef NUMBER_OF_DEVICES
 #define NUMBER_OF_DEVICES 4
+#endif
 #define OFFLOADSECTIONNAME ".omp_offloading.entries"
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 1U
+#endif
+
+// From <numaif.h>, to bind device memory without depending on libnuma.
+#define NUMA_MPOL_BIND 2
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+// Allocations from this size on are placed on the device's NUMA node.
+#define NUMA_BIND_MIN_SIZE (64 * 1024)
+
+#ifdef TARGET_SIM
+#include "../../sim/src/sim.h"
+
+/// Cost model of the devices, when built as the simulated device plugin.
+static SimTy Sim;
+#endif
+
 /// Array of Dynamic libraries loaded for this target.
 struct DynLibTy {
-  char *FileName;
   void *Handle;
+  // In-memory file the library was loaded from, or -1. It stays open as long
+  // as the library is loaded: the dynamic loader recognizes libraries by
+  // path, and /proc/self/fd/N must not name another image meanwhile.
+  int Fd;
+  // Content hash and size of the image, to share the library between the
+  // devices and loads of an image without global data.
+  uint64_t Hash;
+  size_t Size;
+  bool Shared;
 };
 
 /// Keep entries table per device.
@@ -64,12 +105,84 @@ struct FuncOrGblEntryTy {
   __tgt_target_table Table;
 };
 
+/// A NUMA node exposed as a device.
+struct NumaNodeTy {
+  int Node;
+  cpu_set_t Cpus;
+  int NumCpus;
+};
+
+/// Parse Str, e.g. the value of an environment variable, as a decimal integer.
+/// Malformed or out of range values leave Value unchanged and return false.
+static bool parseInt(const char *Str, long &Value) {
+  char *End;
+  errno = 0;
+  long V = strtol(Str, &End, 10);
+  if (End == Str || *End || errno == ERANGE)
+    return false;
+  Value = V;
+  return true;
+}
+
+/// Parse a sysfs cpu list such as "0-3,8-11", empty for a memory-only node.
+/// Returns false if the list is malformed.
+static bool parseCpuList(const std::string &List, cpu_set_t &Cpus) {
+  CPU_ZERO(&Cpus);
+  const char *Pos = List.c_str();
+  while (*Pos) {
+    char *End;
+    errno = 0;
+    long First = strtol(Pos, &End, 10);
+    if (End == Pos || errno == ERANGE || First < 0)
+      return false;
+    long Last = First;
+    if (*End == '-') {
+      Pos = End + 1;
+      Last = strtol(Pos, &End, 10);
+      if (End == Pos || errno == ERANGE || Last < First)
+        return false;
+    }
+    for (long c = First; c <= Last && c < CPU_SETSIZE; ++c)
+      CPU_SET(c, &Cpus);
+    if (*End == ',')
+      ++End;
+    else if (*End)
+      return false;
+    Pos = End;
+  }
+  return true;
+}
+
 /// Class containing all the device information.
 class RTLDeviceInfoTy {
   std::vector<FuncOrGblEntryTy> FuncGblEntries;
 
 public:
+  int32_t NumDevices;
+  // With LIBOMPTARGET_NUMA_DEVICES=1, device i is the i-th NUMA node with
+  // cpus: its memory is bound to the node and its regions run there.
+  std::vector<NumaNodeTy> NumaNodes;
+  // Device memory allocated with mmap for NUMA binding, with its size.
+  std::unordered_map<void *, size_t> NumaAllocs;
+  std::mutex NumaAllocsMtx;
+
   std::list<DynLibTy> DynLibs;
+  // Images may be loaded on several devices at once.
+  std::mutex DynLibsMtx;
+
+  // Teams of a region are run by the host OpenMP runtime; these entry points
+  // let us size the league before it is forked, and bind its threads on NUMA
+  // devices. NULL if libomp is not there.
+  int32_t (*GlobalThreadNum)(void *);
+  void (*PushNumTeams)(void *, int32_t, int32_t, int32_t);
+  void (*PushNumThreads)(void *, int32_t, int32_t);
+  void (*ForkCall)(void *, int32_t, void (*)(int32_t *, int32_t *, ...), ...);
+  // Number of teams for a region that does not ask for a number.
+  int32_t NumTeams;
+  // Device memory reported with LIBOMPTARGET_DEVICE_MEMORY=<MB>, so that the
+  // placement of libomptarget can be run out of room without a device; 0
+  // when the device does not report any.
+  int64_t FakeMemSize;
 
   // Record entry point associated with device.
   void createOffloadTable(int32_t device_id, __tgt_offload_entry *begin,
@@ -113,22 +226,211 @@ public:
     }
 #endif // OMPTARGET_DEBUG
 
+    char *envStr = getenv("LIBOMPTARGET_NUMA_DEVICES");
+    long NumaDevices = 0;
+    if (envStr && !parseInt(envStr, NumaDevices))
+      DP("Ignoring LIBOMPTARGET_NUMA_DEVICES=%s\n", envStr);
+    if (NumaDevices != 0) {
+      for (int Node = 0; ; ++Node) {
+        std::ifstream CpuList("/sys/devices/system/node/node" +
+            std::to_string(Node) + "/cpulist");
+        std::string List;
+        if (!CpuList || !std::getline(CpuList, List))
+          break;
+        NumaNodeTy N;
+        N.Node = Node;
+        if (!parseCpuList(List, N.Cpus)) {
+          DP("Ignoring NUMA node %d, malformed cpu list '%s'\n", Node,
+              List.c_str());
+          continue;
+        }
+        if (CPU_COUNT(&N.Cpus) == 0)
+          continue; // memory-only node
+        N.NumCpus = CPU_COUNT(&N.Cpus);
+        DP("Device %zu is NUMA node %d with %d cpus\n", NumaNodes.size(),
+            Node, N.NumCpus);
+        NumaNodes.push_back(N);
+      }
+      if (NumaNodes.empty())
+        DP("No NUMA nodes found, using %d devices\n", num_devices);
+      else
+        num_devices = NumaNodes.size();
+    }
+#ifdef TARGET_SIM
+    // Simulated devices exist only when asked for, so that the host plugin
+    // keeps the images otherwise.
+    NumaNodes.clear();
+    num_devices = Sim.init();
+#endif
+    NumDevices = num_devices;
     FuncGblEntries.resize(num_devices);
+
+    *((void **)&GlobalThreadNum) = dlsym(RTLD_DEFAULT,
+        "__kmpc_global_thread_num");
+    *((void **)&PushNumTeams) = dlsym(RTLD_DEFAULT, "__kmpc_push_num_teams");
+    *((void **)&PushNumThreads) = dlsym(RTLD_DEFAULT,
+        "__kmpc_push_num_threads");
+    *((void **)&ForkCall) = dlsym(RTLD_DEFAULT, "__kmpc_fork_call");
+    if (!GlobalThreadNum || !PushNumTeams || !PushNumThreads || !ForkCall) {
+      DP("OpenMP runtime not found, teams regions run as a single team\n");
+      GlobalThreadNum = NULL;
+      PushNumTeams = NULL;
+      PushNumThreads = NULL;
+      ForkCall = NULL;
+    }
+
+    long Value;
+    NumTeams = std::thread::hardware_concurrency();
+    if ((envStr = getenv("OMP_NUM_TEAMS"))) {
+      if (parseInt(envStr, Value) && Value <= INT32_MAX) {
+        NumTeams = Value;
+        DP("Parsed OMP_NUM_TEAMS=%d\n", NumTeams);
+      } else {
+        DP("Ignoring OMP_NUM_TEAMS=%s\n", envStr);
+      }
+    }
+    if (NumTeams < 1)
+      NumTeams = 1;
+
+    FakeMemSize = 0;
+    if ((envStr = getenv("LIBOMPTARGET_DEVICE_MEMORY"))) {
+      if (parseInt(envStr, Value) && Value >= 0 &&
+          Value <= INT64_MAX / (1024 * 1024)) {
+        FakeMemSize = Value * 1024 * 1024;
+        DP("Parsed LIBOMPTARGET_DEVICE_MEMORY=%s MB\n", envStr);
+      } else {
+        DP("Ignoring LIBOMPTARGET_DEVICE_MEMORY=%s\n", envStr);
+      }
+    }
+  }
+
+  // Return the shared library already loaded for an image, if any. The hash
+  // only narrows the search: a library is reused only if the in-memory file
+  // it was loaded from holds the same bytes as the image.
+  DynLibTy *findSharedDynLib(uint64_t Hash, const void *Image, size_t Size) {
+    for (auto &lib : DynLibs) {
+      if (!lib.Shared || lib.Hash != Hash || lib.Size != Size || lib.Fd < 0)
+        continue;
+      void *Loaded = mmap(NULL, Size, PROT_READ, MAP_PRIVATE, lib.Fd, 0);
+      if (Loaded == MAP_FAILED)
+        continue;
+      bool Same = !memcmp(Loaded, Image, Size);
+      munmap(Loaded, Size);
+      if (Same)
+        return &lib;
+      DP("Image %016" PRIx64 " collides with a loaded library.\n", Hash);
+    }
+    return NULL;
   }
 
   ~RTLDeviceInfoTy() {
     // Close dynamic libraries
     for (auto &lib : DynLibs) {
-      if (lib.Handle) {
+      if (lib.Handle)
         dlclose(lib.Handle);
-        remove(lib.FileName);
-      }
+      if (lib.Fd >= 0)
+        close(lib.Fd);
     }
   }
 };
 
 static RTLDeviceInfoTy DeviceInfo(NUMBER_OF_DEVICES);
 
+/// In-order queue of asynchronous operations run by a worker thread.
+class AsyncQueueTy {
+  std::mutex Mtx;
+  std::condition_variable Cond;
+  std::deque<std::function<int32_t()>> Ops;
+  bool Busy = false;
+  bool Exit = false;
+  int32_t Status = OFFLOAD_SUCCESS;
+  std::thread Worker;
+
+  void run() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    while (true) {
+      Cond.wait(Lock, [this]() { return Exit || !Ops.empty(); });
+      if (Ops.empty())
+        return;
+      std::function<int32_t()> Op = std::move(Ops.front());
+      Ops.pop_front();
+      Busy = true;
+      Lock.unlock();
+
+      int32_t rc = Op();
+
+      Lock.lock();
+      Busy = false;
+      if (rc != OFFLOAD_SUCCESS)
+        Status = rc;
+      Cond.notify_all();
+    }
+  }
+
+public:
+  AsyncQueueTy() : Worker(&AsyncQueueTy::run, this) {}
+
+  ~AsyncQueueTy() {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      Exit = true;
+    }
+    Cond.notify_all();
+    Worker.join();
+  }
+
+  void push(std::function<int32_t()> Op) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    Ops.push_back(std::move(Op));
+    Cond.notify_all();
+  }
+
+  // Wait for the queue to drain and return the first error seen since the
+  // last synchronization, if any.
+  int32_t synchronize() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    Cond.wait(Lock, [this]() { return Ops.empty() && !Busy; });
+    int32_t rc = Status;
+    Status = OFFLOAD_SUCCESS;
+    return rc;
+  }
+
+  // Wait for the queue to drain and return the first error seen since the
+  // last synchronization, leaving it for synchronize() to report as well.
+  int32_t drain() {
+    std::unique_lock<std::mutex> Lock(Mtx);
+    Cond.wait(Lock, [this]() { return Ops.empty() && !Busy; });
+    return Status;
+  }
+};
+
+// Queues of each device. An async info takes an idle queue on first use and
+// gives it back when synchronized, so that what is enqueued on distinct async
+// infos, e.g. copies next to a kernel, runs concurrently. Kernels themselves
+// are not queued, see __tgt_rtl_run_target_team_region_async.
+static std::mutex AsyncQueuesMtx;
+static std::vector<std::vector<std::unique_ptr<AsyncQueueTy>>> AsyncQueues;
+static std::vector<std::vector<AsyncQueueTy *>> IdleAsyncQueues;
+
+static AsyncQueueTy *getAsyncQueue(int32_t device_id,
+                                   __tgt_async_info *async_info) {
+  if (!async_info->Queue) {
+    std::lock_guard<std::mutex> Lock(AsyncQueuesMtx);
+    if (AsyncQueues.empty()) {
+      AsyncQueues.resize(DeviceInfo.NumDevices);
+      IdleAsyncQueues.resize(DeviceInfo.NumDevices);
+    }
+    std::vector<AsyncQueueTy *> &Idle = IdleAsyncQueues[device_id];
+    if (Idle.empty()) {
+      AsyncQueues[device_id].emplace_back(new AsyncQueueTy());
+      Idle.push_back(AsyncQueues[device_id].back().get());
+    }
+    async_info->Queue = Idle.back();
+    Idle.pop_back();
+  }
+  return (AsyncQueueTy *)async_info->Queue;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -142,17 +444,88 @@ int32_t __tgt_rtl_is_valid_binary(__tgt_device_image *image) {
 #endif
 }
 
-int32_t __tgt_rtl_number_of_devices() { return NUMBER_OF_DEVICES; }
+int32_t __tgt_rtl_number_of_devices() { return DeviceInfo.NumDevices; }
 
 int32_t __tgt_rtl_init_device(int32_t device_id) { return OFFLOAD_SUCCESS; }
 
+/// FNV-1a style hash of an image, to recognize images loaded before. Four
+/// independent lanes keep the multiplies from serializing on large images.
+static uint64_t hashImage(const void *Image, size_t Size) {
+  const char *Bytes = (const char *)Image;
+  const uint64_t Prime = 0x100000001b3ULL;
+  uint64_t Lanes[4] = {0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL,
+                       0x9ce484222325cbf2ULL, 0x2325cbf29ce48422ULL};
+  size_t i = 0;
+  for (; i + 4 * sizeof(uint64_t) <= Size; i += 4 * sizeof(uint64_t)) {
+    uint64_t W[4];
+    memcpy(W, Bytes + i, sizeof(W));
+    for (int l = 0; l < 4; ++l)
+      Lanes[l] = (Lanes[l] ^ W[l]) * Prime;
+  }
+  uint64_t Hash = Size;
+  for (int l = 0; l < 4; ++l)
+    Hash = (Hash ^ Lanes[l]) * Prime;
+  for (; i < Size; ++i)
+    Hash = (Hash ^ (unsigned char)Bytes[i]) * Prime;
+  return Hash;
+}
+
+/// Write the whole buffer to a file descriptor.
+static bool writeAll(int fd, const char *Buf, size_t Size) {
+  while (Size) {
+    ssize_t Written = write(fd, Buf, Size);
+    if (Written < 0)
+      return false;
+    Buf += Written;
+    Size -= Written;
+  }
+  return true;
+}
+
+/// dlopen an image from an anonymous in-memory file, so that nothing is
+/// written to the file system; Fd is set to the file, to be closed after the
+/// library. Falls back to a temporary file, removed once loaded, where
+/// memfd_create or /proc are not available.
+static void *loadImage(const void *Image, size_t Size, int &Fd) {
+  void *Handle = NULL;
+  Fd = -1;
+#ifdef SYS_memfd_create
+  int mem_fd = syscall(SYS_memfd_create, "omptarget-image", MFD_CLOEXEC);
+  if (mem_fd >= 0) {
+    if (writeAll(mem_fd, (const char *)Image, Size)) {
+      std::string Path = "/proc/self/fd/" + std::to_string(mem_fd);
+      Handle = dlopen(Path.c_str(), RTLD_LAZY);
+      if (!Handle)
+        DP("Target library loading from memory error: %s\n", dlerror());
+    }
+    if (Handle) {
+      Fd = mem_fd;
+      return Handle;
+    }
+    close(mem_fd);
+  }
+#endif
+
+  char tmp_name[] = "/tmp/tmpfile_XXXXXX";
+  int tmp_fd = mkstemp(tmp_name);
+  if (tmp_fd == -1)
+    return NULL;
+  if (writeAll(tmp_fd, (const char *)Image, Size))
+    Handle = dlopen(tmp_name, RTLD_LAZY);
+  close(tmp_fd);
+  if (!Handle)
+    DP("Target library loading error: %s\n", dlerror());
+  remove(tmp_name);
+  return Handle;
+}
+
 __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
                                           __tgt_device_image *image) {
 
   DP("Dev %d: load binary from " DPxMOD " image\n", device_id,
      DPxPTR(image->ImageStart));
 
-  assert(device_id >= 0 && device_id < NUMBER_OF_DEVICES && "bad dev id");
+  assert(device_id >= 0 && device_id < DeviceInfo.NumDevices && "bad dev id");
 
   size_t ImageSize = (size_t)image->ImageEnd - (size_t)image->ImageStart;
   size_t NumEntries = (size_t)(image->EntriesEnd - image->EntriesBegin);
@@ -207,41 +580,40 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
 
   DP("Offset of entries section is (" DPxMOD ").\n", DPxPTR(entries_offset));
 
-  // load dynamic library and get the entry points. We use the dl library
-  // to do the loading of the library, but we could do it directly to avoid the
-  // dump to the temporary file.
-  //
-  // 1) Create tmp file with the library contents.
-  // 2) Use dlopen to load the file and dlsym to retrieve the symbols.
-  char tmp_name[] = "/tmp/tmpfile_XXXXXX";
-  int tmp_fd = mkstemp(tmp_name);
-
-  if (tmp_fd == -1) {
-    elf_end(e);
-    return NULL;
-  }
-
-  FILE *ftmp = fdopen(tmp_fd, "wb");
-
-  if (!ftmp) {
-    elf_end(e);
-    return NULL;
-  }
-
-  fwrite(image->ImageStart, ImageSize, 1, ftmp);
-  fclose(ftmp);
-
-  DynLibTy Lib = {tmp_name, dlopen(tmp_name, RTLD_LAZY)};
-
-  if (!Lib.Handle) {
-    DP("Target library loading error: %s\n", dlerror());
-    elf_end(e);
-    return NULL;
+  // load dynamic library and get the entry points. An image without global
+  // data behaves the same whichever device runs it, so all devices and later
+  // loads of the same contents share one copy. An image with global data gets
+  // its own copy, as each device has its own globals. With a single device no
+  // other load can share the copy, and the image is not even hashed. dlopen
+  // serializes loads anyway, so the lookup and the load happen under one lock.
+  bool Shared = DeviceInfo.NumDevices > 1;
+  for (__tgt_offload_entry *i = image->EntriesBegin; i < image->EntriesEnd;
+       ++i)
+    if (i->size)
+      Shared = false;
+  uint64_t Hash = Shared ? hashImage(image->ImageStart, ImageSize) : 0;
+
+  DeviceInfo.DynLibsMtx.lock();
+  DynLibTy *Lib =
+      Shared ? DeviceInfo.findSharedDynLib(Hash, image->ImageStart, ImageSize)
+             : NULL;
+  if (Lib) {
+    DP("Reusing the library loaded for image %016" PRIx64 ".\n", Hash);
+  } else {
+    int Fd;
+    void *Handle = loadImage(image->ImageStart, ImageSize, Fd);
+    if (!Handle) {
+      DeviceInfo.DynLibsMtx.unlock();
+      elf_end(e);
+      return NULL;
+    }
+    DynLibTy NewLib = {Handle, Fd, Hash, ImageSize, Shared};
+    DeviceInfo.DynLibs.push_back(NewLib);
+    Lib = &DeviceInfo.DynLibs.back();
   }
+  DeviceInfo.DynLibsMtx.unlock();
 
-  DeviceInfo.DynLibs.push_back(Lib);
-
-  struct link_map *libInfo = (struct link_map *)Lib.Handle;
+  struct link_map *libInfo = (struct link_map *)Lib->Handle;
 
   // The place where the entries info is loaded is the library base address
   // plus the offset determined from the ELF file.
@@ -271,38 +643,289 @@ __tgt_target_table *__tgt_rtl_load_binary(int32_t device_id,
   return DeviceInfo.getOffloadEntriesTable(device_id);
 }
 
+// Host memory is the device memory here, so there is no placement to tune.
+// A simulated device migrates the managed pages on prefetches; the advices
+// cost nothing.
+void __tgt_rtl_data_opt(int32_t device_id, int64_t size, void *hst_ptr,
+                        int32_t type) {
+#ifdef TARGET_SIM
+  if (type == 1) // prefetch to device
+    Sim.Devices[device_id]->migrate(hst_ptr, size, true);
+  else if (type == 5) // prefetch to host
+    Sim.Devices[device_id]->migrate(hst_ptr, size, false);
+#endif
+}
+
+#ifndef TARGET_SIM
+/// Map size bytes bound to a NUMA node. Return NULL if the node cannot be
+/// bound, e.g. without NUMA support in the kernel.
+static void *allocOnNode(int Node, int64_t size) {
+  void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return NULL;
+#ifdef SYS_mbind
+  const int Bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> Mask(Node / Bits + 1, 0);
+  Mask[Node / Bits] |= 1UL << (Node % Bits);
+  if (syscall(SYS_mbind, ptr, size, NUMA_MPOL_BIND, Mask.data(),
+              Mask.size() * Bits + 1, NUMA_MPOL_MF_MOVE) == 0)
+    return ptr;
+#endif
+  DP("Unable to bind memory to NUMA node %d\n", Node);
+  munmap(ptr, size);
+  return NULL;
+}
+#endif
+
 void *__tgt_rtl_data_alloc(int32_t device_id, int64_t size, void *hst_ptr) {
+#ifdef TARGET_SIM
+  // Managed memory, with a negative device id, stays on the host until it is
+  // prefetched; device memory takes room on the device.
+  if (device_id < 0) {
+    void *ptr = malloc(size);
+    if (ptr)
+      Sim.Devices[-device_id - 1]->allocManaged(ptr, size);
+    return ptr;
+  }
+  void *sim_ptr = malloc(size);
+  if (sim_ptr && !Sim.Devices[device_id]->alloc(sim_ptr, size)) {
+    DP("Simulated device %d is out of memory for %" PRId64 " bytes\n",
+       device_id, size);
+    free(sim_ptr);
+    return NULL;
+  }
+  return sim_ptr;
+#else
+  // Large blocks of a NUMA device live on its node; small ones come from
+  // the heap, where binding would cost a page each. Managed memory, with a
+  // negative device id, is placed on the node of its device as well.
+  if (!DeviceInfo.NumaNodes.empty() && size >= NUMA_BIND_MIN_SIZE) {
+    int32_t Dev = device_id < 0 ? -device_id - 1 : device_id;
+    if (void *ptr = allocOnNode(DeviceInfo.NumaNodes[Dev].Node, size)) {
+      std::lock_guard<std::mutex> Lock(DeviceInfo.NumaAllocsMtx);
+      DeviceInfo.NumaAllocs[ptr] = size;
+      return ptr;
+    }
+  }
   void *ptr = malloc(size);
   return ptr;
+#endif
 }
 
 int32_t __tgt_rtl_data_submit(int32_t device_id, void *tgt_ptr, void *hst_ptr,
                               int64_t size) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->transfer(SIM_H2D, size);
+#endif
   memcpy(tgt_ptr, hst_ptr, size);
   return OFFLOAD_SUCCESS;
 }
 
 int32_t __tgt_rtl_data_retrieve(int32_t device_id, void *hst_ptr, void *tgt_ptr,
                                 int64_t size) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->transfer(SIM_D2H, size);
+#endif
   memcpy(hst_ptr, tgt_ptr, size);
   return OFFLOAD_SUCCESS;
 }
 
+/// Copy a sub-volume as described by omp_target_memcpy_rect. Inner dimensions
+/// copied whole on both sides are copied as one block.
+static void copyRect(char *Dst, const char *Src, size_t ElementSize,
+                     int32_t NumDims, const size_t *Volume,
+                     const size_t *DstOffsets, const size_t *SrcOffsets,
+                     const size_t *DstDims, const size_t *SrcDims) {
+  if (NumDims == 1) {
+    memcpy(Dst + ElementSize * DstOffsets[0], Src + ElementSize * SrcOffsets[0],
+           ElementSize * Volume[0]);
+    return;
+  }
+
+  size_t DstSlice = ElementSize;
+  size_t SrcSlice = ElementSize;
+  bool Whole = true;
+  for (int32_t i = 1; i < NumDims; ++i) {
+    DstSlice *= DstDims[i];
+    SrcSlice *= SrcDims[i];
+    Whole = Whole && Volume[i] == DstDims[i] && Volume[i] == SrcDims[i];
+  }
+
+  Dst += DstOffsets[0] * DstSlice;
+  Src += SrcOffsets[0] * SrcSlice;
+  if (Whole) {
+    memcpy(Dst, Src, DstSlice * Volume[0]);
+    return;
+  }
+  if (NumDims == 2) {
+    // Innermost rows, copied in place rather than one call each.
+    size_t Row = ElementSize * Volume[1];
+    Dst += ElementSize * DstOffsets[1];
+    Src += ElementSize * SrcOffsets[1];
+    for (size_t i = 0; i < Volume[0]; ++i)
+      memcpy(Dst + DstSlice * i, Src + SrcSlice * i, Row);
+    return;
+  }
+  for (size_t i = 0; i < Volume[0]; ++i)
+    copyRect(Dst + DstSlice * i, Src + SrcSlice * i, ElementSize, NumDims - 1,
+             Volume + 1, DstOffsets + 1, SrcOffsets + 1, DstDims + 1,
+             SrcDims + 1);
+}
+
+#ifdef TARGET_SIM
+/// Bytes of a sub-volume, moved as one transfer.
+static int64_t rectSize(size_t ElementSize, int32_t NumDims,
+                        const size_t *Volume) {
+  int64_t Size = ElementSize;
+  for (int32_t i = 0; i < NumDims; ++i)
+    Size *= Volume[i];
+  return Size;
+}
+#endif
+
+int32_t __tgt_rtl_data_submit_rect(int32_t device_id, void *tgt_ptr,
+    void *hst_ptr, size_t element_size, int32_t num_dims,
+    const size_t *volume, const size_t *tgt_offsets, const size_t *hst_offsets,
+    const size_t *tgt_dims, const size_t *hst_dims) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->transfer(SIM_H2D,
+                                   rectSize(element_size, num_dims, volume));
+#endif
+  copyRect((char *)tgt_ptr, (const char *)hst_ptr, element_size, num_dims,
+           volume, tgt_offsets, hst_offsets, tgt_dims, hst_dims);
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_retrieve_rect(int32_t device_id, void *hst_ptr,
+    void *tgt_ptr, size_t element_size, int32_t num_dims,
+    const size_t *volume, const size_t *hst_offsets, const size_t *tgt_offsets,
+    const size_t *hst_dims, const size_t *tgt_dims) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->transfer(SIM_D2H,
+                                   rectSize(element_size, num_dims, volume));
+#endif
+  copyRect((char *)hst_ptr, (const char *)tgt_ptr, element_size, num_dims,
+           volume, hst_offsets, tgt_offsets, hst_dims, tgt_dims);
+  return OFFLOAD_SUCCESS;
+}
+
+// Device memory is host memory, there is no capacity to report unless a fake
+// one is configured.
+int32_t __tgt_rtl_get_mem_info(int32_t device_id, int64_t *free_size,
+                               int64_t *total_size) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->getMemInfo(free_size, total_size);
+  return OFFLOAD_SUCCESS;
+#else
+  if (DeviceInfo.FakeMemSize <= 0)
+    return OFFLOAD_FAIL;
+  *free_size = DeviceInfo.FakeMemSize;
+  *total_size = DeviceInfo.FakeMemSize;
+  return OFFLOAD_SUCCESS;
+#endif
+}
+
+// All devices share the address space of the host.
+int32_t __tgt_rtl_data_exchange(int32_t src_dev_id, void *src_ptr,
+                                int32_t dst_dev_id, void *dst_ptr,
+                                int64_t size) {
+#ifdef TARGET_SIM
+  Sim.Devices[src_dev_id]->transfer(SIM_D2D, size);
+#endif
+  memcpy(dst_ptr, src_ptr, size);
+  return OFFLOAD_SUCCESS;
+}
+
 int32_t __tgt_rtl_data_delete(int32_t device_id, void *tgt_ptr) {
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->release(tgt_ptr);
+#endif
+  if (!DeviceInfo.NumaNodes.empty()) {
+    size_t size = 0;
+    {
+      std::lock_guard<std::mutex> Lock(DeviceInfo.NumaAllocsMtx);
+      auto it = DeviceInfo.NumaAllocs.find(tgt_ptr);
+      if (it != DeviceInfo.NumaAllocs.end()) {
+        size = it->second;
+        DeviceInfo.NumaAllocs.erase(it);
+      }
+    }
+    if (size) {
+      munmap(tgt_ptr, size);
+      return OFFLOAD_SUCCESS;
+    }
+  }
   free(tgt_ptr);
   return OFFLOAD_SUCCESS;
 }
 
+/// Call interface for an entry point taking a number of references.
+struct CallInterfaceTy {
+  ffi_cif Cif;
+  std::vector<ffi_type *> ArgTypes;
+};
+
+/// Source location of the parallel regions the plugin forks itself, in the
+/// layout of libomp's ident_t.
+static struct {
+  int32_t Reserved1, Flags, Reserved2, Reserved3;
+  const char *Source;
+} BindLoc = {0, 0x02 /* KMP_IDENT_KMPC */, 0, 0, ";rtl.cpp;bindTeam;0;0;;"};
+
+static void bindThread(int32_t *, int32_t *Tid, const cpu_set_t *Cpus,
+                       cpu_set_t *Saved) {
+  sched_getaffinity(0, sizeof(cpu_set_t), &Saved[*Tid]);
+  sched_setaffinity(0, sizeof(cpu_set_t), Cpus);
+}
+
+static void unbindThread(int32_t *, int32_t *Tid, cpu_set_t *Saved) {
+  sched_setaffinity(0, sizeof(cpu_set_t), &Saved[*Tid]);
+}
+
+/// Bind the Threads threads of the hot team of the calling thread to Cpus,
+/// saving their masks in Saved, or restore them if Cpus is NULL. libomp hands
+/// the same threads to the next fork of that size from the calling thread,
+/// the league of the region; as they outlive the region, they would keep the
+/// binding they were created with, whatever device they run for.
+static void bindTeam(const cpu_set_t *Cpus, int32_t Threads,
+                     std::vector<cpu_set_t> &Saved) {
+  DeviceInfo.PushNumThreads(&BindLoc, DeviceInfo.GlobalThreadNum(NULL),
+      Threads);
+  if (Cpus) {
+    Saved.resize(Threads);
+    DeviceInfo.ForkCall(&BindLoc, 2,
+        (void (*)(int32_t *, int32_t *, ...))bindThread, Cpus, Saved.data());
+  } else {
+    DeviceInfo.ForkCall(&BindLoc, 1,
+        (void (*)(int32_t *, int32_t *, ...))unbindThread, Saved.data());
+  }
+}
+
+/// Prepared call interfaces by number of arguments, reused across launches.
+static thread_local std::unordered_map<int32_t,
+    std::unique_ptr<CallInterfaceTy>> CallInterfaces;
+
 int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
     void **tgt_args, ptrdiff_t *tgt_offsets, int32_t arg_num, int32_t team_num,
-    int32_t thread_limit, uint64_t loop_tripcount /*not used*/) {
-  // ignore team num and thread limit.
-
+    int32_t thread_limit, uint64_t loop_tripcount) {
   // Use libffi to launch execution.
-  ffi_cif cif;
+  std::unique_ptr<CallInterfaceTy> &CI = CallInterfaces[arg_num];
+  if (!CI) {
+    CI.reset(new CallInterfaceTy());
+    // All args are references.
+    CI->ArgTypes.assign(arg_num, &ffi_type_pointer);
+    ffi_status status = ffi_prep_cif(&CI->Cif, FFI_DEFAULT_ABI, arg_num,
+                                     &ffi_type_void, CI->ArgTypes.data());
+
+    assert(status == FFI_OK && "Unable to prepare target launch!");
+
+    if (status != FFI_OK) {
+      CI.reset();
+      return OFFLOAD_FAIL;
+    }
+  }
 
-  // All args are references.
-  std::vector<ffi_type *> args_types(arg_num, &ffi_type_pointer);
   std::vector<void *> args(arg_num);
   std::vector<void *> ptrs(arg_num);
 
@@ -311,19 +934,49 @@ int32_t __tgt_rtl_run_target_team_region(int32_t device_id, void *tgt_entry_ptr,
     args[i] = &ptrs[i];
   }
 
-  ffi_status status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, arg_num,
-                                   &ffi_type_void, &args_types[0]);
-
-  assert(status == FFI_OK && "Unable to prepare target launch!");
+  // The entry forks its teams through libomp, whose thread pool runs them.
+  // Without a num_teams clause, a distribute loop gets one team per core, or
+  // per iteration if there are fewer; anything else keeps a single team.
+  // On a NUMA device, the region runs on the cpus of its node, at most one
+  // team per cpu. The threads of the league are bound there for the region,
+  // those libomp creates for it inherit the binding.
+  NumaNodeTy *Numa = DeviceInfo.NumaNodes.empty() ? NULL :
+      &DeviceInfo.NumaNodes[device_id];
+  int32_t MaxTeams = Numa ? std::min(Numa->NumCpus, DeviceInfo.NumTeams) :
+      DeviceInfo.NumTeams;
+  cpu_set_t OldCpus;
+  if (Numa && (sched_getaffinity(0, sizeof(OldCpus), &OldCpus) ||
+               sched_setaffinity(0, sizeof(Numa->Cpus), &Numa->Cpus))) {
+    DP("Unable to bind the region to NUMA node %d\n", Numa->Node);
+    Numa = NULL;
+  }
 
-  if (status != FFI_OK)
-    return OFFLOAD_FAIL;
+  int32_t teams = team_num;
+  if (teams <= 0 && loop_tripcount > 0)
+    teams = (int32_t)std::min<uint64_t>(loop_tripcount, MaxTeams);
+  std::vector<cpu_set_t> SavedCpus;
+  bool BindTeam = Numa && teams > 1 && DeviceInfo.ForkCall;
+  if (BindTeam)
+    bindTeam(&Numa->Cpus, teams, SavedCpus);
+  if (teams > 1 && DeviceInfo.PushNumTeams) {
+    DP("Running %d teams of up to %d threads\n", teams, thread_limit);
+    DeviceInfo.PushNumTeams(NULL, DeviceInfo.GlobalThreadNum(NULL), teams,
+        thread_limit > 0 ? thread_limit : 0);
+  }
 
   DP("Running entry point at " DPxMOD "...\n", DPxPTR(tgt_entry_ptr));
+#ifdef TARGET_SIM
+  Sim.Devices[device_id]->launch();
+#endif
 
   void (*entry)(void);
   *((void**) &entry) = tgt_entry_ptr;
-  ffi_call(&cif, entry, NULL, &args[0]);
+  ffi_call(&CI->Cif, entry, NULL, args.data());
+
+  if (BindTeam)
+    bindTeam(NULL, teams, SavedCpus);
+  if (Numa)
+    sched_setaffinity(0, sizeof(OldCpus), &OldCpus);
   return OFFLOAD_SUCCESS;
 }
 
@@ -334,6 +987,93 @@ int32_t __tgt_rtl_run_target_region(int32_t device_id, void *tgt_entry_ptr,
       tgt_offsets, arg_num, 1, 1, 0);
 }
 
+int32_t __tgt_rtl_data_submit_async(int32_t device_id, void *tgt_ptr,
+    void *hst_ptr, int64_t size, __tgt_async_info *async_info) {
+  getAsyncQueue(device_id, async_info)->push([=]() {
+    return __tgt_rtl_data_submit(device_id, tgt_ptr, hst_ptr, size);
+  });
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_retrieve_async(int32_t device_id, void *hst_ptr,
+    void *tgt_ptr, int64_t size, __tgt_async_info *async_info) {
+  getAsyncQueue(device_id, async_info)->push([=]() {
+    return __tgt_rtl_data_retrieve(device_id, hst_ptr, tgt_ptr, size);
+  });
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_data_submit_batch(int32_t device_id, int32_t num,
+    void **tgt_ptrs, void **hst_ptrs, int64_t *sizes,
+    __tgt_async_info *async_info) {
+#ifdef TARGET_SIM
+  // The batch goes over the link packed, as one transfer.
+  int64_t total = 0;
+  for (int32_t i = 0; i < num; ++i)
+    total += sizes[i];
+  Sim.Devices[device_id]->transfer(SIM_H2D, total);
+#endif
+  if (!async_info) {
+    for (int32_t i = 0; i < num; ++i)
+      memcpy(tgt_ptrs[i], hst_ptrs[i], sizes[i]);
+    return OFFLOAD_SUCCESS;
+  }
+
+  // The host buffers may be reused once we return; queue a packed copy.
+  std::vector<void *> tgts(tgt_ptrs, tgt_ptrs + num);
+  std::vector<int64_t> lens(sizes, sizes + num);
+  std::vector<char> data;
+  for (int32_t i = 0; i < num; ++i)
+    data.insert(data.end(), (char *)hst_ptrs[i], (char *)hst_ptrs[i] + sizes[i]);
+  getAsyncQueue(device_id, async_info)->push([=]() {
+    const char *src = data.data();
+    for (int32_t i = 0; i < num; ++i) {
+      memcpy(tgts[i], src, lens[i]);
+      src += lens[i];
+    }
+    return OFFLOAD_SUCCESS;
+  });
+  return OFFLOAD_SUCCESS;
+}
+
+int32_t __tgt_rtl_run_target_team_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, int32_t team_num, int32_t thread_limit,
+    uint64_t loop_tripcount, __tgt_async_info *async_info) {
+  // The region runs on the calling thread once what was enqueued before it
+  // is done, and the launch returns when it completes. On a queue worker its
+  // teams would fork from a libomp root of the worker's own, next to the idle
+  // hot team of the encountering thread, and every launch would pay for the
+  // handoff. Copies enqueued on other async infos keep running meanwhile.
+  if (async_info->Queue) {
+    int32_t rc = ((AsyncQueueTy *)async_info->Queue)->drain();
+    if (rc != OFFLOAD_SUCCESS)
+      return rc;
+  }
+  return __tgt_rtl_run_target_team_region(device_id, tgt_entry_ptr, tgt_args,
+      tgt_offsets, arg_num, team_num, thread_limit, loop_tripcount);
+}
+
+int32_t __tgt_rtl_run_target_region_async(int32_t device_id,
+    void *tgt_entry_ptr, void **tgt_args, ptrdiff_t *tgt_offsets,
+    int32_t arg_num, __tgt_async_info *async_info) {
+  // use one team and one thread.
+  return __tgt_rtl_run_target_team_region_async(device_id, tgt_entry_ptr,
+      tgt_args, tgt_offsets, arg_num, 1, 1, 0, async_info);
+}
+
+int32_t __tgt_rtl_synchronize(int32_t device_id,
+    __tgt_async_info *async_info) {
+  if (!async_info->Queue)
+    return OFFLOAD_SUCCESS;
+  AsyncQueueTy *Queue = (AsyncQueueTy *)async_info->Queue;
+  int32_t rc = Queue->synchronize();
+  std::lock_guard<std::mutex> Lock(AsyncQueuesMtx);
+  IdleAsyncQueues[device_id].push_back(Queue);
+  async_info->Queue = NULL;
+  return rc;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,299 @@
+//===--- RTLs/sim/src/sim.h - Simulated device cost model ------- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Cost model of the simulated device. The generic 64-bit RTL built with
+// TARGET_SIM runs regions on the host, as it does for the host itself, and
+// charges its data path to a device with a memory capacity, a link bandwidth
+// and a latency per transfer:
+//
+//   LIBOMPTARGET_SIM_DEVICES=<n>      number of devices, none if not set
+//   LIBOMPTARGET_SIM_MEMORY=<MB>      capacity of each device (16384)
+//   LIBOMPTARGET_SIM_BANDWIDTH=<MB/s> bandwidth of the link (12288)
+//   LIBOMPTARGET_SIM_LATENCY=<us>     latency of a transfer (10)
+//   LIBOMPTARGET_SIM_PAGE_SIZE=<KB>   page size of managed memory (64)
+//   LIBOMPTARGET_SIM_REPORT=<file>    counters written at exit, '-' for stderr
+//
+// data_alloc fails once the capacity is used. Managed memory, from data_alloc
+// with a negative device id, lives on the host; data_opt prefetches migrate
+// its pages to and from the device, where they take room until evicted,
+// oldest first, by later prefetches or allocations. Every transfer costs the
+// latency plus its size over the bandwidth, and the modeled time is the sum
+// of those costs, as if nothing overlapped. Regions are not timed, and the
+// pages they would fault in are not modeled.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef _OMPTARGET_SIM_H
+#define _OMPTARGET_SIM_H
+
+/// Counters of a simulated device. All exact, time in nanoseconds.
+struct SimStatsTy {
+  int64_t Allocs = 0;
+  int64_t FailedAllocs = 0;
+  int64_t ManagedAllocs = 0;
+  int64_t Frees = 0;
+  int64_t PeakBytes = 0;
+  int64_t H2DTransfers = 0;
+  int64_t H2DBytes = 0;
+  int64_t D2HTransfers = 0;
+  int64_t D2HBytes = 0;
+  int64_t D2DTransfers = 0;
+  int64_t D2DBytes = 0;
+  int64_t PagesToDevice = 0;
+  int64_t PagesToHost = 0;
+  int64_t Launches = 0;
+  int64_t TimeNs = 0;
+};
+
+/// Direction of a transfer over the link.
+enum SimDirTy { SIM_H2D, SIM_D2H, SIM_D2D };
+
+/// Memory and counters of one simulated device.
+class SimDeviceTy {
+  std::mutex Mtx;
+  // Device allocations and their size.
+  std::unordered_map<void *, int64_t> Allocs;
+  int64_t AllocBytes = 0;
+  // Managed allocations and their size.
+  std::unordered_map<void *, int64_t> Managed;
+  // Managed pages resident on the device, oldest migration first.
+  std::list<uintptr_t> Pages;
+  std::unordered_map<uintptr_t, std::list<uintptr_t>::iterator> PageIndex;
+
+  int64_t used() const {
+    return AllocBytes + (int64_t)Pages.size() * PageSize;
+  }
+
+  void charge(SimDirTy Dir, int64_t Size) {
+    int64_t &Transfers = Dir == SIM_H2D ? Stats.H2DTransfers :
+        Dir == SIM_D2H ? Stats.D2HTransfers : Stats.D2DTransfers;
+    int64_t &Bytes = Dir == SIM_H2D ? Stats.H2DBytes :
+        Dir == SIM_D2H ? Stats.D2HBytes : Stats.D2DBytes;
+    ++Transfers;
+    Bytes += Size;
+    // Round up, so that no transfer is free.
+    unsigned __int128 Scaled = (unsigned __int128)Size * 1000000000;
+    Stats.TimeNs += LatencyNs + (int64_t)((Scaled + BytesPerSec - 1) /
+        BytesPerSec);
+  }
+
+  // Move the oldest managed pages outside [First, Last] back to the host, as
+  // one transfer, until Size more bytes fit. Return false if they cannot fit.
+  bool makeRoom(int64_t Size, uintptr_t First = 1, uintptr_t Last = 0) {
+    int64_t Evicted = 0;
+    for (auto It = Pages.begin();
+         It != Pages.end() && used() + Size > Capacity;) {
+      if (*It >= First && *It <= Last) {
+        ++It;
+        continue;
+      }
+      PageIndex.erase(*It);
+      It = Pages.erase(It);
+      ++Evicted;
+    }
+    if (Evicted) {
+      Stats.PagesToHost += Evicted;
+      charge(SIM_D2H, Evicted * PageSize);
+    }
+    return used() + Size <= Capacity;
+  }
+
+public:
+  int64_t Capacity = 0;
+  int64_t BytesPerSec = 0;
+  int64_t LatencyNs = 0;
+  int64_t PageSize = 0;
+  SimStatsTy Stats;
+
+  /// Reserve Size bytes for a new allocation at Ptr. Return false if the
+  /// device is full.
+  bool alloc(void *Ptr, int64_t Size) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    // Managed pages are evicted only if that makes room.
+    if (AllocBytes + Size > Capacity || !makeRoom(Size)) {
+      ++Stats.FailedAllocs;
+      return false;
+    }
+    Allocs[Ptr] = Size;
+    AllocBytes += Size;
+    ++Stats.Allocs;
+    Stats.PeakBytes = std::max(Stats.PeakBytes, used());
+    return true;
+  }
+
+  void allocManaged(void *Ptr, int64_t Size) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    Managed[Ptr] = Size;
+    ++Stats.ManagedAllocs;
+  }
+
+  /// Release the allocation at Ptr, device or managed, whose resident pages
+  /// are dropped without a transfer.
+  void release(void *Ptr) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    auto It = Allocs.find(Ptr);
+    if (It != Allocs.end()) {
+      AllocBytes -= It->second;
+      Allocs.erase(It);
+      ++Stats.Frees;
+      return;
+    }
+    auto MIt = Managed.find(Ptr);
+    if (MIt == Managed.end() || MIt->second <= 0)
+      return;
+    uintptr_t First = (uintptr_t)Ptr / PageSize;
+    uintptr_t Last = ((uintptr_t)Ptr + MIt->second - 1) / PageSize;
+    for (uintptr_t P = First; P <= Last; ++P) {
+      auto PIt = PageIndex.find(P);
+      if (PIt != PageIndex.end()) {
+        Pages.erase(PIt->second);
+        PageIndex.erase(PIt);
+      }
+    }
+    Managed.erase(MIt);
+    ++Stats.Frees;
+  }
+
+  void transfer(SimDirTy Dir, int64_t Size) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    charge(Dir, Size);
+  }
+
+  void launch() {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    ++Stats.Launches;
+  }
+
+  /// Migrate the managed pages of [Ptr, Ptr + Size) to the device, or back to
+  /// the host, as one transfer. Pages that do not fit stay on the host.
+  void migrate(void *Ptr, int64_t Size, bool ToDevice) {
+    if (Size <= 0)
+      return;
+    std::lock_guard<std::mutex> Lock(Mtx);
+    uintptr_t First = (uintptr_t)Ptr / PageSize;
+    uintptr_t Last = ((uintptr_t)Ptr + Size - 1) / PageSize;
+    int64_t Moved = 0;
+    if (ToDevice) {
+      std::vector<uintptr_t> Missing;
+      for (uintptr_t P = First; P <= Last; ++P)
+        if (!PageIndex.count(P))
+          Missing.push_back(P);
+      // Pages of the range itself are not evicted to make room for the rest;
+      // what does not fit stays on the host.
+      makeRoom(Missing.size() * PageSize, First, Last);
+      for (uintptr_t P : Missing) {
+        if (used() + PageSize > Capacity)
+          break;
+        Pages.push_back(P);
+        PageIndex[P] = std::prev(Pages.end());
+        ++Moved;
+      }
+    } else {
+      for (uintptr_t P = First; P <= Last; ++P) {
+        auto It = PageIndex.find(P);
+        if (It == PageIndex.end())
+          continue;
+        Pages.erase(It->second);
+        PageIndex.erase(It);
+        ++Moved;
+      }
+    }
+    if (!Moved)
+      return;
+    if (ToDevice) {
+      Stats.PagesToDevice += Moved;
+      Stats.PeakBytes = std::max(Stats.PeakBytes, used());
+    } else {
+      Stats.PagesToHost += Moved;
+    }
+    charge(ToDevice ? SIM_H2D : SIM_D2H, Moved * PageSize);
+  }
+
+  void getMemInfo(int64_t *Free, int64_t *Total) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    *Free = Capacity - used();
+    *Total = Capacity;
+  }
+};
+
+/// The simulated devices, configured from the environment.
+class SimTy {
+  std::string Report;
+
+  // The value of Name in units of Scale, or Default units if it is unset,
+  // malformed or out of range once scaled.
+  static int64_t getEnv(const char *Name, int64_t Default, int64_t Scale) {
+    char *envStr = getenv(Name);
+    if (!envStr)
+      return Default * Scale;
+    char *End;
+    errno = 0;
+    long long Value = strtoll(envStr, &End, 10);
+    if (End == envStr || *End || errno == ERANGE ||
+        Value > INT64_MAX / Scale || Value < INT64_MIN / Scale) {
+      DP("Ignoring %s=%s\n", Name, envStr);
+      return Default * Scale;
+    }
+    DP("Parsed %s=%s\n", Name, envStr);
+    return Value * Scale;
+  }
+
+public:
+  std::vector<std::unique_ptr<SimDeviceTy>> Devices;
+
+  /// Read the configuration and return the number of devices.
+  int32_t init() {
+    int64_t NumDevices = getEnv("LIBOMPTARGET_SIM_DEVICES", 0, 1);
+    int64_t Capacity = getEnv("LIBOMPTARGET_SIM_MEMORY", 16384, 1 << 20);
+    int64_t BytesPerSec = getEnv("LIBOMPTARGET_SIM_BANDWIDTH", 12288, 1 << 20);
+    int64_t LatencyNs = getEnv("LIBOMPTARGET_SIM_LATENCY", 10, 1000);
+    int64_t PageSize = getEnv("LIBOMPTARGET_SIM_PAGE_SIZE", 64, 1 << 10);
+    if (BytesPerSec <= 0 || PageSize <= 0 || LatencyNs < 0) {
+      DP("Invalid simulated link, no simulated devices\n");
+      NumDevices = 0;
+    }
+    for (int64_t i = 0; i < NumDevices; ++i) {
+      SimDeviceTy *D = new SimDeviceTy();
+      D->Capacity = Capacity;
+      D->BytesPerSec = BytesPerSec;
+      D->LatencyNs = LatencyNs;
+      D->PageSize = PageSize;
+      Devices.emplace_back(D);
+    }
+    if (char *envStr = getenv("LIBOMPTARGET_SIM_REPORT"))
+      Report = envStr;
+    return Devices.size();
+  }
+
+  ~SimTy() {
+    if (Report.empty() || Devices.empty())
+      return;
+    FILE *F = Report == "-" ? stderr : fopen(Report.c_str(), "w");
+    if (!F)
+      return;
+    for (size_t i = 0; i < Devices.size(); ++i) {
+      const SimStatsTy &S = Devices[i]->Stats;
+      fprintf(F, "sim device %zu: allocs %" PRId64 " failed %" PRId64
+          " managed %" PRId64 " frees %" PRId64 " peak %" PRId64 "\n", i,
+          S.Allocs, S.FailedAllocs, S.ManagedAllocs, S.Frees, S.PeakBytes);
+      fprintf(F, "sim device %zu: h2d %" PRId64 " transfers %" PRId64
+          " bytes, d2h %" PRId64 " transfers %" PRId64 " bytes, d2d %" PRId64
+          " transfers %" PRId64 " bytes\n", i, S.H2DTransfers, S.H2DBytes,
+          S.D2HTransfers, S.D2HBytes, S.D2DTransfers, S.D2DBytes);
+      fprintf(F, "sim device %zu: pages to device %" PRId64 ", to host %" PRId64
+          "\n", i, S.PagesToDevice, S.PagesToHost);
+      fprintf(F, "sim device %zu: launches %" PRId64 ", time %" PRId64
+          " ns\n", i, S.Launches, S.TimeNs);
+    }
+    if (F != stderr)
+      fclose(F);
+  }
+};
+
+#endif // _OMPTARGET_SIM_H
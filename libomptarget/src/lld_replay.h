@@ -0,0 +1,73 @@
+// lld: offload trace format and replay interface
+//
+// Shared by libomptarget, which records and replays traces (trace.h), by
+// tools/lld-replay and by the tests writing traces of their own, so it is
+// kept valid C.
+
+#ifndef _LLD_REPLAY_H_
+#define _LLD_REPLAY_H_
+
+#include <stdint.h>
+
+// A trace is TraceMagic, TraceVersion, then one TraceEventTy per event
+// followed by ArgNum TraceArgTy, all in host byte order.
+static const char TraceMagic[8] = {'L', 'L', 'D', 'T', 'R', 'A', 'C', 'E'};
+static const uint32_t TraceVersion = 1;
+
+enum TraceEventKindTy {
+  TRACE_DATA_BEGIN = 0,
+  TRACE_DATA_END,
+  TRACE_UPDATE,
+  TRACE_TARGET
+};
+
+struct TraceEventTy {
+  uint32_t Kind;
+  int32_t DeviceId;
+  int32_t ArgNum;
+  int32_t Pad;
+  uint64_t HostPtr; // entry of a target region, 0 for data constructs
+  uint64_t TripCount;
+};
+
+struct TraceArgTy {
+  uint64_t Base;
+  uint64_t Begin;
+  int64_t Size;
+  int64_t Type;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// What one replay of a trace recorded with LLD_RECORD would have done
+struct __tgt_replay_stats {
+  int64_t Events;          // events replayed
+  int64_t BytesToDevice;   // copied or prefetched to the device
+  int64_t BytesFromDevice; // copied or prefetched back to the host
+  int64_t Evictions;       // objects pushed out by the replacement policy
+  int64_t AccessedBytes;   // bytes mapped by target regions
+  int64_t ResidentBytes;   // of those, bytes already on the device
+  int64_t PeakDeviceBytes; // largest device allocation footprint
+  int64_t Prefetches;      // objects moved ahead of their predicted reuse
+  int64_t PrefetchHits;    // of those, objects used on the device
+  int64_t PrefetchLate;    // objects due within the window but still on the
+                           // host when used
+  int64_t PrefetchUseless; // prefetched objects released before any use
+};
+
+// Replay the trace in path on a simulated device of dev_size bytes, with
+// mode, partial_map, recycle and prefetch standing for LLD_GPU_MODE,
+// LLD_PARTIAL_MAP, LLD_RECYCLE and LLD_PREFETCH (LLD_POLICY is not applied);
+// returns 0 if the whole trace was replayed. Link with -lomptarget-replay:
+// libomptarget.so does not export it.
+int __tgt_replay_trace(const char *path, int32_t mode, int64_t dev_size,
+                       int32_t partial_map, int32_t recycle, int32_t prefetch,
+                       struct __tgt_replay_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LLD_REPLAY_H_
@@ -13,35 +13,58 @@
 //===----------------------------------------------------------------------===//
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <dlfcn.h>
+#include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <pthread.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // Header file global to this project
 //#define OMPTARGET_DEBUG
 #include "omptarget.h"
 
-// lld: GPU memory mode
-int GMode = 0;
-// lld: whether to recycle GPU memory
-int RecycleMem = 0;
-// lld: whether to enable partial mapping
-bool PartialMap = false;
-// lld: available device memory size
-int64_t total_dev_size = 14 * 1024 * 1024 * 1024L;
+// lld: device memory assumed when neither the RTL nor LLD_DEV_SIZE tell
+const int64_t DefaultDevMem = 16 * 1024 * 1024 * 1024L;
+// lld: share of device memory left to allocations the placement engine does
+// not decide, unless LLD_DEV_RESERVE says otherwise
+const double DefaultDevReserve = 0.125;
 // lld: global time stamp
-uint64_t GlobalTimeStamp = 0;
+std::atomic<uint64_t> GlobalTimeStamp(0);
+// lld: unmapped entries a device keeps with LLD_RECYCLE=1; LLD_RECYCLE=<n>
+// keeps up to n of them
+const size_t DefaultRecycleLimit = 256;
+// lld: freed device memory each device may keep cached for reuse
+int64_t PoolLimit = 256 * 1024 * 1024L;
+// lld: largest host-to-device copy packed into a batched submit
+int64_t BatchLimit = 4096;
+// lld: whether repeated launches may reuse their resolved arguments
+bool LaunchCacheEnabled = true;
+// lld: host staging buffer of a device-to-device copy without a direct path
+int64_t StagingLimit = 8 * 1024 * 1024L;
+
+// lld: profiler
+#include "profiler.h"
+// lld: trace recording and replay
+#include "trace.h"
 
 // lld: declare types in replacement.h
 struct DataClusterTy;
-typedef std::list<DataClusterTy> DataClusterListTy;
+typedef std::deque<DataClusterTy> DataClusterListTy;
 
 #ifdef OMPTARGET_DEBUG
 static int DebugLevel = 1;
@@ -59,8 +82,40 @@ static int DebugLevel = 1;
 #define INF_REF_CNT (LONG_MAX>>1) // leave room for additions/subtractions
 #define CONSIDERED_INF(x) (x > (INF_REF_CNT>>1))
 
-// List of all plugins that can support offloading.
+// lld: parse the value Str of environment variable Name as an integer in
+// units of Scale bytes, or as a number. Malformed or out of range values are
+// ignored: Value is left as it was and false is returned.
+static bool parseEnvInt(const char *Name, const char *Str, int64_t Scale,
+    int64_t &Value) {
+  char *End;
+  errno = 0;
+  long long V = strtoll(Str, &End, 10);
+  if (End == Str || *End || errno == ERANGE || V > INT64_MAX / Scale ||
+      V < INT64_MIN / Scale) {
+    DP("Ignoring %s=%s, not an integer in range\n", Name, Str);
+    return false;
+  }
+  Value = V * Scale;
+  return true;
+}
+
+static bool parseEnvDouble(const char *Name, const char *Str, double &Value) {
+  char *End;
+  errno = 0;
+  double V = strtod(Str, &End);
+  if (End == Str || *End || errno == ERANGE) {
+    DP("Ignoring %s=%s, not a number\n", Name, Str);
+    return false;
+  }
+  Value = V;
+  return true;
+}
+
+// List of all plugins that can support offloading. The simulated device comes
+// first: it supports no devices unless LIBOMPTARGET_SIM_DEVICES is set, and
+// then takes the images of the host.
 static const char *RTLNames[] = {
+    /* Simulated dev  */ "libomptarget.rtl.sim.so",
     /* PowerPC target */ "libomptarget.rtl.ppc64.so",
     /* x86_64 target  */ "libomptarget.rtl.x86_64.so",
     /* CUDA target    */ "libomptarget.rtl.cuda.so",
@@ -75,6 +130,39 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
 /// All begin addresses must be 8-aligned
 static const int64_t alignment = 8;
 
+/// std::atomic that is copied along with the structure holding it. Used for
+/// mapping fields that are updated under the shared mapping table lock.
+template <typename T> struct CopyableAtomicTy : std::atomic<T> {
+  CopyableAtomicTy(T V = T()) : std::atomic<T>(V) {}
+  CopyableAtomicTy(const CopyableAtomicTy &A) : std::atomic<T>(A.load()) {}
+  CopyableAtomicTy &operator=(const CopyableAtomicTy &A) {
+    this->store(A.load());
+    return *this;
+  }
+  CopyableAtomicTy &operator=(T V) {
+    this->store(V);
+    return *this;
+  }
+};
+
+/// Reader/writer lock guarding the mapping table of a device. Lookups take it
+/// shared, anything that inserts, erases or remaps entries takes it exclusive.
+class RWMutexTy {
+  pthread_rwlock_t Lock;
+
+  RWMutexTy(const RWMutexTy &) = delete;
+  RWMutexTy &operator=(const RWMutexTy &) = delete;
+
+public:
+  RWMutexTy() { pthread_rwlock_init(&Lock, NULL); }
+  ~RWMutexTy() { pthread_rwlock_destroy(&Lock); }
+
+  void lock() { pthread_rwlock_wrlock(&Lock); }
+  void unlock() { pthread_rwlock_unlock(&Lock); }
+  void lock_shared() { pthread_rwlock_rdlock(&Lock); }
+  void unlock_shared() { pthread_rwlock_unlock(&Lock); }
+};
+
 /// Map between host data and target data.
 struct HostDataToTargetTy {
   uintptr_t HstPtrBase; // host info.
@@ -89,18 +177,28 @@ struct HostDataToTargetTy {
   // lld: replacement info
   double Locality = 0.0;
   int64_t Reuse = 0;
-  uint64_t TimeStamp = 0;
+  CopyableAtomicTy<uint64_t> TimeStamp;
   bool IsValid = true;
   bool IsDeleted = false;
   bool Irreplaceable = false;
   bool ChangeMap = false;
   uint64_t ReuseDist = 0;
-  // lld: cluster info
-  std::list<DataClusterTy*> Clusters;
+  // lld: cluster info, a bit per DataClusterTy::Id of the clusters the entry
+  // belongs to and how many of them are mapped to the device
+  std::vector<uint64_t> ClusterBits;
+  int32_t DevClusters = 0;
   // lld: partial map
   int64_t DevSize = 0;
+  // lld: key of the entry in DeviceTy::RecycledEntries, or -1
+  int64_t RecycledKey = -1;
+  // lld: moved to the device ahead of its predicted reuse and not used since,
+  // or due within the prefetch window but left on the host
+  bool Prefetched = false;
+  bool PrefetchMissed = false;
+  // lld: slot of the entry in WriteTracks (see writetrack.h), or -1
+  int32_t WriteTrack = -1;
 
-  long RefCount;
+  CopyableAtomicTy<long> RefCount;
 
   HostDataToTargetTy()
       : HstPtrBase(0), HstPtrBegin(0), HstPtrEnd(0),
@@ -116,6 +214,53 @@ struct HostDataToTargetTy {
 
 typedef std::list<HostDataToTargetTy> HostDataToTargetListTy;
 
+/// Address-ordered index of the host data mappings of a device, keyed on
+/// HstPtrBegin. Mapped ranges never overlap, so a lookup only has to inspect
+/// the last entry starting at or before an address and the one following it.
+/// Iterators and pointers to entries stay valid until the entry is erased.
+class HostDataToTargetMapTy {
+  typedef std::map<uintptr_t, HostDataToTargetTy> IndexTy;
+  IndexTy Index;
+
+public:
+  class iterator {
+    friend class HostDataToTargetMapTy;
+    IndexTy::iterator It;
+
+  public:
+    iterator() : It() {}
+    iterator(IndexTy::iterator I) : It(I) {}
+
+    HostDataToTargetTy &operator*() const { return It->second; }
+    HostDataToTargetTy *operator->() const { return &It->second; }
+    iterator &operator++() { ++It; return *this; }
+    iterator &operator--() { --It; return *this; }
+    bool operator==(const iterator &I) const { return It == I.It; }
+    bool operator!=(const iterator &I) const { return It != I.It; }
+  };
+
+  iterator begin() { return Index.begin(); }
+  iterator end() { return Index.end(); }
+  size_t size() const { return Index.size(); }
+  bool empty() const { return Index.empty(); }
+
+  // Entry starting exactly at HstPtrBegin, or end().
+  iterator find(uintptr_t HstPtrBegin) { return Index.find(HstPtrBegin); }
+  // First entry starting after HstPtrBegin, or end().
+  iterator upper_bound(uintptr_t HstPtrBegin) {
+    return Index.upper_bound(HstPtrBegin);
+  }
+
+  // Returns end(), leaving the index unchanged, if an entry already starts
+  // at Entry.HstPtrBegin.
+  iterator insert(const HostDataToTargetTy &Entry) {
+    std::pair<IndexTy::iterator, bool> Res =
+        Index.insert(std::make_pair(Entry.HstPtrBegin, Entry));
+    return Res.second ? Res.first : Index.end();
+  }
+  void erase(iterator I) { Index.erase(I.It); }
+};
+
 struct LookupResult {
   struct {
     unsigned IsContained   : 1;
@@ -127,7 +272,7 @@ struct LookupResult {
     unsigned InvalidExtendsA        : 1;
   } Flags;
 
-  HostDataToTargetListTy::iterator Entry;
+  HostDataToTargetMapTy::iterator Entry;
 
   LookupResult() : Flags({0,0,0}), Entry() {}
 };
@@ -148,6 +293,74 @@ struct PendingCtorDtorListsTy {
 typedef std::map<__tgt_bin_desc *, PendingCtorDtorListsTy>
     PendingCtorsDtorsPerLibrary;
 
+/// lld: caching allocator between libomptarget and RTL->data_alloc. Blocks
+/// are allocated with the requested size; freed ones are cached and handed
+/// out again to later allocations of the same size class, up to PoolLimit
+/// cached bytes.
+struct DeviceMemPoolTy {
+  struct BlockTy {
+    int64_t BlockSize; // as allocated by the RTL
+    int64_t Size;      // as requested by the current user
+  };
+  // Blocks currently handed out, by device address.
+  std::unordered_map<void *, BlockTy> UsedBlocks;
+  // Cached free blocks, by block size.
+  std::map<int64_t, std::vector<void *>> FreeBlocks;
+  // Bytes in FreeBlocks, and bytes of UsedBlocks beyond what was requested.
+  int64_t CachedSize;
+  int64_t SlackSize;
+  uint64_t Hits;
+  uint64_t Misses;
+  std::mutex Mtx;
+
+  DeviceMemPoolTy() : CachedSize(0), SlackSize(0), Hits(0), Misses(0) {}
+  // Devices are only copied before first use, so start empty.
+  DeviceMemPoolTy(const DeviceMemPoolTy &) : DeviceMemPoolTy() {}
+
+  // The largest cached block reused for Size. Sizes up to 256 bytes share one
+  // class; above that each power of two is split into 8 classes, so a reused
+  // block wastes less than 1/8 of its size.
+  static int64_t getClassSize(int64_t Size) {
+    if (Size <= 256)
+      return 256;
+    int64_t Step = (int64_t)1 << (60 - __builtin_clzll(Size - 1));
+    return (Size + Step - 1) & ~(Step - 1);
+  }
+};
+
+/// lld: the resolved arguments of a recent launch of a target region on a
+/// device. They stay valid while the device's MapGeneration is unchanged and
+/// the launch is made with the same arguments.
+struct LaunchCacheEntryTy {
+  uint64_t Generation;
+  std::vector<void *> ArgsBase;
+  std::vector<void *> Args;
+  std::vector<int64_t> ArgSizes;
+  std::vector<int64_t> ArgTypes;
+  void *TgtEntryPtr;
+  const char *Name;
+  std::vector<void *> TgtArgs;
+  std::vector<ptrdiff_t> TgtOffsets;
+  // Mapped entries the launch uses, and the arguments they belong to; they
+  // must remain mapped by someone else.
+  std::vector<HostDataToTargetTy *> Entries;
+  std::vector<int32_t> EntryArgs;
+
+  bool matches(int32_t ArgNum, void **ArgsBaseIn, void **ArgsIn,
+      int64_t *ArgSizesIn, int64_t *ArgTypesIn) const {
+    return (size_t)ArgNum == Args.size() && (ArgNum == 0 ||
+        (!memcmp(ArgsBase.data(), ArgsBaseIn, ArgNum * sizeof(void *)) &&
+         !memcmp(Args.data(), ArgsIn, ArgNum * sizeof(void *)) &&
+         !memcmp(ArgSizes.data(), ArgSizesIn, ArgNum * sizeof(int64_t)) &&
+         !memcmp(ArgTypes.data(), ArgTypesIn, ArgNum * sizeof(int64_t))));
+  }
+};
+// A few launches are kept per region so that codes swapping buffers between
+// iterations still hit.
+#define LAUNCH_CACHE_WAYS 4
+typedef std::unordered_map<void *,
+    std::vector<std::shared_ptr<LaunchCacheEntryTy>>> LaunchCacheTy;
+
 struct DeviceTy {
   int32_t DeviceID;
   RTLInfoTy *RTL;
@@ -155,57 +368,122 @@ struct DeviceTy {
 
   bool IsInit;
   std::once_flag InitFlag;
-  bool HasPendingGlobals;
 
-  HostDataToTargetListTy HostDataToTargetMap;
-  // lld: replacement
-  HostDataToTargetListTy InvalidTargetDataList;
+  HostDataToTargetMapTy HostDataToTargetMap;
+  // lld: with LLD_RECYCLE, unmapped entries stay in HostDataToTargetMap with
+  // what they hold on the device, so that mapping the same data again finds
+  // it there. They are indexed by the bytes they hold (HstPtrBegin as value)
+  // and compacted when memory runs short or more of them are kept than
+  // LLD_RECYCLE allows; see replacement.h.
+  std::multimap<int64_t, uintptr_t> RecycledEntries;
   PendingCtorsDtorsPerLibrary PendingCtorsDtors;
-  // lld: clusters
+  // lld: clusters, one per kernel, indexed by its host pointer. A cluster
+  // keeps its position in DataClusters, which is its Id.
   DataClusterListTy DataClusters;
+  std::unordered_map<void *, DataClusterTy *> ClusterIndex;
   DataClusterTy *CurrentCluster;
   bool IsNewCluster;
 
   ShadowPtrListTy ShadowPtrMap;
 
-  std::mutex DataMapMtx, PendingGlobalsMtx, ShadowMtx;
+  RWMutexTy DataMapMtx;
+  std::mutex PendingGlobalsMtx, ShadowMtx;
+
+  // lld: bumped under DataMapMtx whenever a mapping is added, removed or
+  // moved, which invalidates LaunchCache.
+  std::atomic<uint64_t> MapGeneration;
+  LaunchCacheTy LaunchCache;
+  RWMutexTy LaunchCacheMtx;
 
   uint64_t loopTripCnt;
   // lld: memory management
-  int64_t deviceSize;
-  int64_t umSize;
+  // Placed bytes, updated under DataMapMtx and read by the pool under its
+  // own lock.
+  std::atomic<int64_t> deviceSize;
+  std::atomic<int64_t> umSize;
   int64_t allocSize;
+  int64_t evictions;
   double devMemRatio;
+  DeviceMemPoolTy MemPool;
+  // lld: replacement settings of this device, from LLD_<name>_<id> or else
+  // LLD_<name>: GPU memory mode, policy overriding the one of the mode (see
+  // replacement.h), whether to recycle device memory and to map partially
+  int GMode;
+  int RPolicy;
+  int RecycleMem;
+  bool PartialMap;
+  // lld: device memory as reported by the RTL or LLD_DEV_SIZE. The placement
+  // engine decides MemBudget of it; the rest is the reserve of allocations it
+  // does not decide, a share ReserveRatio of the capacity.
+  int64_t MemCapacity;
+  double ReserveRatio;
+  int64_t MemBudget;
+  // lld: window of streamed regions (see stream.h) from LLD_STREAM, in bytes;
+  // -1 streams only what does not fit in MemBudget, 0 never streams
+  int64_t StreamWindow;
+  // lld: lookahead prefetch (see replacement.h) from LLD_PREFETCH, in time
+  // stamps; 0 disables it. Host-resident entries are queued by predicted
+  // reuse time (HstPtrBegin as value); the counters tell what became of the
+  // prefetches.
+  int PrefetchDist;
+  std::multimap<uint64_t, uintptr_t> PrefetchQueue;
+  int64_t prefetches;
+  int64_t prefetchHits;
+  int64_t prefetchLate;
+  int64_t prefetchUseless;
+  // lld: host-side write tracking (see writetrack.h) of the entries of at
+  // least WriteTrackMin bytes, from LLD_WRITE_TRACK in KB; 0 disables it.
+  int64_t WriteTrackMin;
 
   DeviceTy(RTLInfoTy *RTL)
       : DeviceID(-1), RTL(RTL), RTLDeviceID(-1), IsInit(false), InitFlag(),
-        HasPendingGlobals(false), HostDataToTargetMap(),
-        InvalidTargetDataList(), // lld: replacement
+        HostDataToTargetMap(), RecycledEntries(),
         PendingCtorsDtors(), ShadowPtrMap(), DataMapMtx(), PendingGlobalsMtx(),
-        ShadowMtx(), loopTripCnt(0) {}
+        ShadowMtx(), MapGeneration(0), LaunchCache(), LaunchCacheMtx(),
+        loopTripCnt(0), GMode(0), RPolicy(0), RecycleMem(0), PartialMap(false),
+        ReserveRatio(DefaultDevReserve), StreamWindow(-1), PrefetchDist(0),
+        PrefetchQueue(), WriteTrackMin(0) {
+    setMemCapacity(DefaultDevMem);
+  }
 
   // The existence of mutexes makes DeviceTy non-copyable. We need to
   // provide a copy constructor and an assignment operator explicitly.
   DeviceTy(const DeviceTy &d)
       : DeviceID(d.DeviceID), RTL(d.RTL), RTLDeviceID(d.RTLDeviceID),
-        IsInit(d.IsInit), InitFlag(), HasPendingGlobals(d.HasPendingGlobals),
+        IsInit(d.IsInit), InitFlag(),
         HostDataToTargetMap(d.HostDataToTargetMap),
-        InvalidTargetDataList(d.InvalidTargetDataList), // lld: replacement
+        RecycledEntries(d.RecycledEntries),
         PendingCtorsDtors(d.PendingCtorsDtors), ShadowPtrMap(d.ShadowPtrMap),
         DataMapMtx(), PendingGlobalsMtx(),
-        ShadowMtx(), loopTripCnt(d.loopTripCnt) {}
+        ShadowMtx(), MapGeneration(0), LaunchCache(), LaunchCacheMtx(),
+        loopTripCnt(d.loopTripCnt), MemPool(), GMode(d.GMode),
+        RPolicy(d.RPolicy), RecycleMem(d.RecycleMem), PartialMap(d.PartialMap),
+        MemCapacity(d.MemCapacity), ReserveRatio(d.ReserveRatio),
+        MemBudget(d.MemBudget), StreamWindow(d.StreamWindow),
+        PrefetchDist(d.PrefetchDist), PrefetchQueue(d.PrefetchQueue),
+        WriteTrackMin(d.WriteTrackMin) {}
 
   DeviceTy& operator=(const DeviceTy &d) {
     DeviceID = d.DeviceID;
     RTL = d.RTL;
     RTLDeviceID = d.RTLDeviceID;
     IsInit = d.IsInit;
-    HasPendingGlobals = d.HasPendingGlobals;
     HostDataToTargetMap = d.HostDataToTargetMap;
-    InvalidTargetDataList= d.InvalidTargetDataList; // lld: replacement
+    RecycledEntries = d.RecycledEntries;
     PendingCtorsDtors = d.PendingCtorsDtors;
     ShadowPtrMap = d.ShadowPtrMap;
     loopTripCnt = d.loopTripCnt;
+    GMode = d.GMode;
+    RPolicy = d.RPolicy;
+    RecycleMem = d.RecycleMem;
+    PartialMap = d.PartialMap;
+    MemCapacity = d.MemCapacity;
+    ReserveRatio = d.ReserveRatio;
+    MemBudget = d.MemBudget;
+    StreamWindow = d.StreamWindow;
+    PrefetchDist = d.PrefetchDist;
+    PrefetchQueue = d.PrefetchQueue;
+    WriteTrackMin = d.WriteTrackMin;
 
     return *this;
   }
@@ -223,25 +501,109 @@ struct DeviceTy {
   int deallocTgtPtr(void *TgtPtrBegin, int64_t Size, bool ForceDelete);
   int associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size);
   int disassociatePtr(void *HstPtrBegin);
-  // lld: cluster
+  // lld: recycling of unmapped entries, with DataMapMtx held exclusively.
+  // recycleEntry() indexes an entry that was just unmapped, unrecycleEntry()
+  // takes it out of the index again. releaseRecycled() releases unmapped
+  // entries until Bytes are free and trimRecycled() until no more are kept
+  // than LLD_RECYCLE allows; both return the bytes released.
+  void recycleEntry(HostDataToTargetTy &HT);
+  void unrecycleEntry(HostDataToTargetTy &HT);
+  int64_t releaseRecycled(int64_t Bytes);
+  int64_t trimRecycled();
+  // lld: give back what an unmapped entry holds on the device and erase it
+  int64_t releaseEntry(HostDataToTargetMapTy::iterator It);
+  // lld: lookahead prefetch. queuePrefetch() and usePrefetched() run with
+  // DataMapMtx held exclusively: the first queues an entry left on the host,
+  // the second counts the outcome of its prefetch when it is accessed.
+  // prefetchAhead() moves queued entries due within PrefetchDist to the
+  // device while a region runs.
+  void queuePrefetch(HostDataToTargetTy &HT);
+  void usePrefetched(HostDataToTargetTy &HT);
+  void prefetchAhead();
+  // lld: host-side write tracking. trackWrites() returns in Runs the parts,
+  // as offsets and sizes, of a copy of [HstPtrBegin, HstPtrBegin + Size) to
+  // TgtPtrBegin that the device does not hold unchanged, or false if the
+  // entry is not tracked and everything is copied. invalidateWrites() forgets
+  // what the device holds of a host range, dropWrites() what it held in a
+  // device buffer being released, and untrackWrites() ends the tracking of an
+  // entry; DataMapMtx is held for the last one.
+  bool trackWrites(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size,
+      std::vector<std::pair<int64_t, int64_t>> &Runs);
+  void invalidateWrites(void *HstPtrBegin, int64_t Size);
+  void dropWrites(void *TgtPtrBegin);
+  void untrackWrites(HostDataToTargetTy &HT);
+  // lld: cluster, with DataMapMtx held exclusively
   DataClusterTy *lookupCluster(void *Base);
+  DataClusterTy *addCluster(void *Base);
+  void removeFromClusters(HostDataToTargetTy &HT);
+  // lld: launch cache
+  std::shared_ptr<LaunchCacheEntryTy> lookupLaunch(void *HostPtr,
+      int32_t ArgNum, void **ArgsBase, void **Args, int64_t *ArgSizes,
+      int64_t *ArgTypes);
+  void cacheLaunch(void *HostPtr, int32_t ArgNum, void **ArgsBase,
+      void **Args, int64_t *ArgSizes, int64_t *ArgTypes, void *TgtEntryPtr,
+      const char *Name);
+  void clearLaunchCache();
 
   // calls to RTL
   int32_t initOnce();
   __tgt_target_table *load_binary(void *Img);
 
-  int32_t data_submit(void *TgtPtrBegin, void *HstPtrBegin, int64_t Size);
-  int32_t data_retrieve(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size);
+  // lld: size the budget of the placement engine after Capacity bytes of
+  // device memory, and what is left of it once Used more bytes are placed.
+  void setMemCapacity(int64_t Capacity) {
+    MemCapacity = Capacity;
+    MemBudget = Capacity - (int64_t)(Capacity * ReserveRatio);
+  }
+  int64_t availDevSize(int64_t Used = 0) const {
+    return MemBudget - Used - deviceSize - umSize;
+  }
+
+  // lld: device memory goes through MemPool. trimMemPool() releases cached
+  // blocks while live data, Extra more bytes and the cache would exceed
+  // MemBudget; releaseMemPool() empties the cache.
+  void *data_alloc(int64_t Size, void *HstPtrBegin);
+  int32_t data_delete(void *TgtPtrBegin);
+  void trimMemPool(int64_t Extra = 0);
+  void releaseMemPool();
+
+  // With a non-NULL AsyncInfo the operation is only enqueued if the RTL
+  // supports it; synchronize() waits for everything enqueued on AsyncInfo.
+  int32_t data_submit(void *TgtPtrBegin, void *HstPtrBegin, int64_t Size,
+      __tgt_async_info *AsyncInfo = NULL);
+  int32_t data_retrieve(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size,
+      __tgt_async_info *AsyncInfo = NULL);
 
   int32_t run_region(void *TgtEntryPtr, void **TgtVarsPtr,
-      ptrdiff_t *TgtOffsets, int32_t TgtVarsSize);
+      ptrdiff_t *TgtOffsets, int32_t TgtVarsSize,
+      __tgt_async_info *AsyncInfo = NULL);
   int32_t run_team_region(void *TgtEntryPtr, void **TgtVarsPtr,
       ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, int32_t NumTeams,
-      int32_t ThreadLimit, uint64_t LoopTripCount);
+      int32_t ThreadLimit, uint64_t LoopTripCount,
+      __tgt_async_info *AsyncInfo = NULL);
+  int32_t synchronize(__tgt_async_info *AsyncInfo);
+  int32_t data_submit_batch(int32_t Num, void **TgtPtrs, void **HstPtrs,
+      int64_t *Sizes, __tgt_async_info *AsyncInfo = NULL);
+  // Copy to DstDev without staging on the host; only possible when both
+  // devices belong to an RTL with data_exchange.
+  bool canExchange(const DeviceTy &DstDev) const;
+  int32_t data_exchange(void *SrcPtr, DeviceTy &DstDev, void *DstPtr,
+      int64_t Size);
+  // Rectangular copies as in omp_target_memcpy_rect, for RTLs that support
+  // them natively.
+  int32_t data_submit_rect(void *TgtPtr, void *HstPtr, size_t ElementSize,
+      int32_t NumDims, const size_t *Volume, const size_t *TgtOffsets,
+      const size_t *HstOffsets, const size_t *TgtDims, const size_t *HstDims);
+  int32_t data_retrieve_rect(void *HstPtr, void *TgtPtr, size_t ElementSize,
+      int32_t NumDims, const size_t *Volume, const size_t *HstOffsets,
+      const size_t *TgtOffsets, const size_t *HstDims, const size_t *TgtDims);
 
 private:
   // Call to RTL
   void init(); // To be called only via DeviceTy::initOnce()
+  // lld: give at least Bytes of cached blocks back to the RTL, largest
+  // classes first; MemPool.Mtx must be held.
+  int64_t releasePoolBlocks(int64_t Bytes);
 };
 
 /// Map between Device ID (i.e. openmp device id) and its DeviceTy.
@@ -262,6 +624,26 @@ struct RTLInfoTy {
                                  int32_t);
   typedef int32_t(run_team_region_ty)(int32_t, void *, void **, ptrdiff_t *,
                                       int32_t, int32_t, int32_t, uint64_t);
+  typedef int32_t(data_submit_async_ty)(int32_t, void *, void *, int64_t,
+                                        __tgt_async_info *);
+  typedef int32_t(data_retrieve_async_ty)(int32_t, void *, void *, int64_t,
+                                          __tgt_async_info *);
+  typedef int32_t(run_region_async_ty)(int32_t, void *, void **, ptrdiff_t *,
+                                       int32_t, __tgt_async_info *);
+  typedef int32_t(run_team_region_async_ty)(int32_t, void *, void **,
+                                            ptrdiff_t *, int32_t, int32_t,
+                                            int32_t, uint64_t,
+                                            __tgt_async_info *);
+  typedef int32_t(synchronize_ty)(int32_t, __tgt_async_info *);
+  typedef int32_t(data_submit_batch_ty)(int32_t, int32_t, void **, void **,
+                                        int64_t *, __tgt_async_info *);
+  typedef int32_t(data_exchange_ty)(int32_t, void *, int32_t, void *,
+                                    int64_t);
+  typedef int32_t(data_rect_ty)(int32_t, void *, void *, size_t, int32_t,
+                                const size_t *, const size_t *,
+                                const size_t *, const size_t *,
+                                const size_t *);
+  typedef int32_t(get_mem_info_ty)(int32_t, int64_t *, int64_t *);
 
   int32_t Idx;                     // RTL index, index is the number of devices
                                    // of other RTLs that were registered before,
@@ -289,6 +671,26 @@ struct RTLInfoTy {
   run_region_ty *run_region;
   run_team_region_ty *run_team_region;
 
+  // Optional asynchronous interface, all or nothing.
+  data_submit_async_ty *data_submit_async;
+  data_retrieve_async_ty *data_retrieve_async;
+  run_region_async_ty *run_region_async;
+  run_team_region_async_ty *run_team_region_async;
+  synchronize_ty *synchronize;
+
+  // Optional batched copies to the device.
+  data_submit_batch_ty *data_submit_batch;
+
+  // Optional copies between two devices of this RTL.
+  data_exchange_ty *data_exchange;
+
+  // Optional rectangular copies, both or none.
+  data_rect_ty *data_submit_rect;
+  data_rect_ty *data_retrieve_rect;
+
+  // Optional query of the free and total device memory.
+  get_mem_info_ty *get_mem_info;
+
   // Are there images associated with this RTL.
   bool isUsed;
 
@@ -307,8 +709,11 @@ struct RTLInfoTy {
         is_valid_binary(0), number_of_devices(0), init_device(0),
         //load_binary(0), data_alloc(0), data_submit(0), data_retrieve(0),
         load_binary(0), data_opt(0), data_alloc(0), data_submit(0), data_retrieve(0), // lld
-        data_delete(0), run_region(0), run_team_region(0), isUsed(false),
-        Mtx() {}
+        data_delete(0), run_region(0), run_team_region(0),
+        data_submit_async(0), data_retrieve_async(0), run_region_async(0),
+        run_team_region_async(0), synchronize(0), data_submit_batch(0),
+        data_exchange(0), data_submit_rect(0), data_retrieve_rect(0),
+        get_mem_info(0), isUsed(false), Mtx() {}
 
   RTLInfoTy(const RTLInfoTy &r) : Mtx() {
     Idx = r.Idx;
@@ -329,6 +734,16 @@ struct RTLInfoTy {
     data_delete = r.data_delete;
     run_region = r.run_region;
     run_team_region = r.run_team_region;
+    data_submit_async = r.data_submit_async;
+    data_retrieve_async = r.data_retrieve_async;
+    run_region_async = r.run_region_async;
+    run_team_region_async = r.run_team_region_async;
+    synchronize = r.synchronize;
+    data_submit_batch = r.data_submit_batch;
+    data_exchange = r.data_exchange;
+    data_submit_rect = r.data_submit_rect;
+    data_retrieve_rect = r.data_retrieve_rect;
+    get_mem_info = r.get_mem_info;
     isUsed = r.isUsed;
   }
 };
@@ -369,45 +784,42 @@ void RTLsTy::LoadRTLs() {
     return;
   }
 
-  // lld: parse environment variables
-  envStr = getenv("LLD_GPU_MODE");
-  if (envStr) {
-    if (!strcmp(envStr, "OBJ")) {
-      GMode = -1;
-      LLD_DP("Set mode to GLOBAL\n");
-    } else if (!strcmp(envStr, "LOCAL")) {
-      GMode = -2;
-      LLD_DP("Set mode to LOCAL\n");
-    } else if (!strcmp(envStr, "RD")) {
-      GMode = -3;
-      LLD_DP("Set mode to RD\n");
-    } else if (!strcmp(envStr, "UM")) {
-      GMode = 1;
-      LLD_DP("Set mode to UM\n");
-    } else if (!strcmp(envStr, "DEV")) {
-      GMode = 2;
-      LLD_DP("Set mode to DEV\n");
-    } else if (!strcmp(envStr, "HOST")) {
-      GMode = 3;
-      LLD_DP("Set mode to HOST\n");
-    } else if (!strcmp(envStr, "HYB")) {
-      GMode = 4;
-      LLD_DP("Set mode to HYB\n");
-    } else if (!strcmp(envStr, "SDEV")) {
-      GMode = 5;
-      LLD_DP("Set mode to SDEV\n");
-    } else
-      LLD_DP("Default mode is CLUSTER\n");
-  }
-  envStr = getenv("LLD_RECYCLE");
-  if (envStr) {
-    RecycleMem = std::stoi(envStr);
-    LLD_DP("Set RecycleMem to %d\n", RecycleMem);
-  }
-  envStr = getenv("LLD_PARTIAL_MAP");
+  // lld: parse environment variables; the replacement settings are read per
+  // device, see DeviceTy::init()
+  int64_t Value;
+  envStr = getenv("LLD_BATCH_SIZE"); // in bytes, 0 disables batching
+  if (envStr && parseEnvInt("LLD_BATCH_SIZE", envStr, 1, Value)) {
+    BatchLimit = Value;
+    LLD_DP("Set BatchLimit to %ld\n", BatchLimit);
+  }
+  envStr = getenv("LLD_LAUNCH_CACHE");
+  if (envStr && parseEnvInt("LLD_LAUNCH_CACHE", envStr, 1, Value)) {
+    LaunchCacheEnabled = Value != 0;
+    LLD_DP("Set LaunchCacheEnabled to %d\n", LaunchCacheEnabled);
+  }
+  envStr = getenv("LLD_POOL_SIZE"); // in MB, 0 disables the pool
+  if (envStr && parseEnvInt("LLD_POOL_SIZE", envStr, 1024 * 1024, Value)) {
+    PoolLimit = Value;
+    LLD_DP("Set PoolLimit to %ld\n", PoolLimit);
+  }
+  envStr = getenv("LLD_STAGING_SIZE"); // in MB
+  if (envStr && parseEnvInt("LLD_STAGING_SIZE", envStr, 1024 * 1024, Value)) {
+    StagingLimit = std::max(Value, (int64_t)1024 * 1024);
+    LLD_DP("Set StagingLimit to %ld\n", StagingLimit);
+  }
+  envStr = getenv("LLD_PROFILE_TRACE"); // file, implies LLD_PROFILE
+  char *profStr = getenv("LLD_PROFILE");
+  int64_t Profile = 0;
+  if (profStr)
+    parseEnvInt("LLD_PROFILE", profStr, 1, Profile);
+  if (envStr || Profile) {
+    Profiler.init(envStr);
+    LLD_DP("Enabled the profiler\n");
+  }
+  envStr = getenv("LLD_RECORD"); // file
   if (envStr) {
-    PartialMap = (std::stoi(envStr) != 0 ? true : false);
-    LLD_DP("Set PartialMap to %d\n", PartialMap);
+    TraceRecorder.open(envStr);
+    LLD_DP("Recording a trace to %s\n", envStr);
   }
 
   DP("Loading RTLs...\n");
@@ -471,6 +883,41 @@ void RTLsTy::LoadRTLs() {
               dynlib_handle, "__tgt_rtl_run_target_team_region")))
       continue;
 
+    // Optional functions: use the asynchronous interface only if the RTL
+    // implements all of it.
+    *((void**) &R.data_submit_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_submit_async");
+    *((void**) &R.data_retrieve_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_retrieve_async");
+    *((void**) &R.run_region_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_run_target_region_async");
+    *((void**) &R.run_team_region_async) = dlsym(
+        dynlib_handle, "__tgt_rtl_run_target_team_region_async");
+    *((void**) &R.synchronize) = dlsym(
+        dynlib_handle, "__tgt_rtl_synchronize");
+    if (!R.data_submit_async || !R.data_retrieve_async ||
+        !R.run_region_async || !R.run_team_region_async || !R.synchronize) {
+      R.data_submit_async = 0;
+      R.data_retrieve_async = 0;
+      R.run_region_async = 0;
+      R.run_team_region_async = 0;
+      R.synchronize = 0;
+    }
+    *((void**) &R.data_submit_batch) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_submit_batch");
+    *((void**) &R.data_exchange) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_exchange");
+    *((void**) &R.data_submit_rect) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_submit_rect");
+    *((void**) &R.data_retrieve_rect) = dlsym(
+        dynlib_handle, "__tgt_rtl_data_retrieve_rect");
+    if (!R.data_submit_rect || !R.data_retrieve_rect) {
+      R.data_submit_rect = 0;
+      R.data_retrieve_rect = 0;
+    }
+    *((void**) &R.get_mem_info) = dlsym(
+        dynlib_handle, "__tgt_rtl_get_mem_info");
+
     // No devices are supported by this RTL?
     if (!(R.NumberOfDevices = R.number_of_devices())) {
       DP("No devices supported in this RTL\n");
@@ -509,6 +956,18 @@ struct TranslationTable {
 
   // Table of entry points or NULL if it was not already computed.
   std::vector<__tgt_target_table *> TargetsTable; // One table per device ID.
+
+  // lld: per device, the entries the RTL returned for the image, which
+  // TargetsTable points to, and the same table once the image's globals are
+  // mapped and its ctors have run, for launches to read without a lock. Sized
+  // for every device of every RTL, so it never moves.
+  struct LoadedImageTy {
+    __tgt_target_table Table;
+    std::vector<__tgt_offload_entry> Entries;
+    std::atomic<__tgt_target_table *> Ready;
+    LoadedImageTy() : Ready(nullptr) {}
+  };
+  std::unique_ptr<LoadedImageTy[]> Loaded;
 };
 typedef std::map<__tgt_offload_entry *, TranslationTable>
     HostEntriesBeginToTransTableTy;
@@ -523,9 +982,86 @@ struct TableMap {
   TableMap(TranslationTable *table, uint32_t index)
       : Table(table), Index(index) {}
 };
-typedef std::map<void *, TableMap> HostPtrToTableMapTy;
-static HostPtrToTableMapTy HostPtrToTableMap;
-static std::mutex TblMapMtx;
+
+/// lld: immutable view of all registered host entries, sorted by host ptr, so
+/// that launches resolve their entry point without taking any lock. Every
+/// change to HostEntriesBeginToTransTable bumps TableMapGeneration; the next
+/// launch builds a new snapshot and publishes it, so registering many
+/// libraries in a row costs one rebuild. Each thread holds a reference to the
+/// snapshot it last used, so a replaced snapshot is freed once every thread
+/// that read it has moved on to a newer one or exited.
+struct TableMapSnapshotTy {
+  uint64_t Generation;
+  std::vector<std::pair<void *, TableMap>> Entries;
+  // Global data entries, sorted by address, to find the image owning them.
+  struct GlobalTy {
+    uintptr_t Begin;
+    uintptr_t End;
+    TranslationTable *Table;
+  };
+  std::vector<GlobalTy> Globals;
+
+  const TableMap *find(void *HostPtr) const {
+    auto It = std::lower_bound(Entries.begin(), Entries.end(), HostPtr,
+        [](const std::pair<void *, TableMap> &E, void *P) {
+          return E.first < P;
+        });
+    if (It == Entries.end() || It->first != HostPtr)
+      return nullptr;
+    return &It->second;
+  }
+};
+// Protected by TrlTblMtx.
+static std::shared_ptr<const TableMapSnapshotTy> TableMapSnapshot;
+static std::atomic<uint64_t> TableMapGeneration(0);
+
+/// lld: return a table map snapshot covering every library registered so far,
+/// building and publishing a new one if the tables changed since the last.
+/// The snapshot stays valid until the calling thread asks for one again.
+static const TableMapSnapshotTy *getTableMapSnapshot() {
+  // Launches that see no change touch no shared state.
+  static thread_local std::shared_ptr<const TableMapSnapshotTy> Snapshot;
+  if (Snapshot && Snapshot->Generation == TableMapGeneration)
+    return Snapshot.get();
+
+  TrlTblMtx.lock();
+  uint64_t Generation = TableMapGeneration;
+  if (!TableMapSnapshot || TableMapSnapshot->Generation != Generation) {
+    std::shared_ptr<TableMapSnapshotTy> NewSnapshot =
+        std::make_shared<TableMapSnapshotTy>();
+    NewSnapshot->Generation = Generation;
+    for (auto &ii : HostEntriesBeginToTransTable) {
+      TranslationTable *TransTable = &ii.second;
+      __tgt_offload_entry *cur = TransTable->HostTable.EntriesBegin;
+      __tgt_offload_entry *end = TransTable->HostTable.EntriesEnd;
+      for (uint32_t i = 0; cur < end; ++cur, ++i) {
+        NewSnapshot->Entries.push_back(
+            std::make_pair(cur->addr, TableMap(TransTable, i)));
+        if (cur->size)
+          NewSnapshot->Globals.push_back({(uintptr_t)cur->addr,
+              (uintptr_t)cur->addr + cur->size, TransTable});
+      }
+    }
+    // Stable, so that a host ptr found in several libraries resolves to the
+    // first one, as the linear search did.
+    std::stable_sort(NewSnapshot->Entries.begin(), NewSnapshot->Entries.end(),
+        [](const std::pair<void *, TableMap> &A,
+           const std::pair<void *, TableMap> &B) {
+          return A.first < B.first;
+        });
+    std::sort(NewSnapshot->Globals.begin(), NewSnapshot->Globals.end(),
+        [](const TableMapSnapshotTy::GlobalTy &A,
+           const TableMapSnapshotTy::GlobalTy &B) {
+          return A.Begin < B.Begin;
+        });
+    DP("Built table map snapshot with %zu entries\n",
+        NewSnapshot->Entries.size());
+    TableMapSnapshot = NewSnapshot;
+  }
+  Snapshot = TableMapSnapshot;
+  TrlTblMtx.unlock();
+  return Snapshot.get();
+}
 
 /// Check whether a device has an associated RTL and initialize it if it's not
 /// already initialized.
@@ -605,7 +1141,7 @@ EXTERN void *omp_target_alloc(size_t size, int device_num) {
     rc = Device.RTL->data_alloc(device_id, size, NULL);
     LLD_DP("omp_target_alloc returns uvm ptr " DPxMOD ", size=%ld\n", DPxPTR(rc), size);
     Device.allocSize += size;
-    Device.devMemRatio = (double)total_dev_size / Device.allocSize;
+    Device.devMemRatio = (double)Device.MemBudget / Device.allocSize;
     return rc;
   }
 
@@ -675,6 +1211,41 @@ EXTERN int omp_target_is_present(void *ptr, int device_num) {
   return rc;
 }
 
+/// Copy between devices through two host buffers of at most StagingLimit
+/// bytes: the next chunk is retrieved while the previous one is submitted.
+static int staged_memcpy(DeviceTy &DstDev, void *dst, DeviceTy &SrcDev,
+    void *src, size_t length) {
+  size_t Chunk = std::min<size_t>(length, StagingLimit);
+  std::vector<char> Buffers[2];
+  Buffers[0].resize(Chunk);
+  if (Chunk < length)
+    Buffers[1].resize(Chunk);
+
+  __tgt_async_info AsyncInfo = {NULL};
+  int rc = OFFLOAD_SUCCESS;
+  for (size_t Off = 0, i = 0; Off < length && rc == OFFLOAD_SUCCESS;
+       Off += Chunk, ++i) {
+    size_t Size = std::min(Chunk, length - Off);
+    char *Buffer = Buffers[i % 2].data();
+    rc = SrcDev.data_retrieve(Buffer, (char *)src + Off, Size);
+    // The previous submit, from the other buffer, must be done before the
+    // next chunk is retrieved into it.
+    if (rc == OFFLOAD_SUCCESS)
+      rc = DstDev.synchronize(&AsyncInfo);
+    if (rc == OFFLOAD_SUCCESS)
+      rc = DstDev.data_submit((char *)dst + Off, Buffer, Size, &AsyncInfo);
+  }
+  int sync_rc = DstDev.synchronize(&AsyncInfo);
+  return rc == OFFLOAD_SUCCESS ? sync_rc : rc;
+}
+
+static int device_memcpy(DeviceTy &DstDev, void *dst, DeviceTy &SrcDev,
+    void *src, size_t length) {
+  if (SrcDev.canExchange(DstDev))
+    return SrcDev.data_exchange(src, DstDev, dst, length);
+  return staged_memcpy(DstDev, dst, SrcDev, src, length);
+}
+
 EXTERN int omp_target_memcpy(void *dst, void *src, size_t length,
     size_t dst_offset, size_t src_offset, int dst_device, int src_device) {
   DP("Call to omp_target_memcpy, dst device %d, src device %d, "
@@ -717,18 +1288,139 @@ EXTERN int omp_target_memcpy(void *dst, void *src, size_t length,
     rc = SrcDev.data_retrieve(dstAddr, srcAddr, length);
   } else {
     DP("copy from device to device\n");
-    void *buffer = malloc(length);
-    DeviceTy& SrcDev = Devices[src_device];
-    DeviceTy& DstDev = Devices[dst_device];
-    rc = SrcDev.data_retrieve(buffer, srcAddr, length);
-    if (rc == OFFLOAD_SUCCESS)
-      rc = DstDev.data_submit(dstAddr, buffer, length);
+    rc = device_memcpy(Devices[dst_device], dstAddr, Devices[src_device],
+        srcAddr, length);
   }
 
   DP("omp_target_memcpy returns %d\n", rc);
   return rc;
 }
 
+/// Call Row(DstOff, SrcOff, Size) for each contiguous row of a rectangular
+/// copy described as in omp_target_memcpy_rect. Inner dimensions copied
+/// whole on both sides are merged into the rows of the outer one.
+static int for_each_rect_row(size_t element_size, int num_dims,
+    const size_t *volume, const size_t *dst_offsets, const size_t *src_offsets,
+    const size_t *dst_dimensions, const size_t *src_dimensions,
+    size_t dst_off, size_t src_off,
+    const std::function<int(size_t, size_t, size_t)> &Row) {
+  if (num_dims == 1)
+    return Row(dst_off + element_size * dst_offsets[0],
+        src_off + element_size * src_offsets[0], element_size * volume[0]);
+
+  size_t dst_slice_size = element_size;
+  size_t src_slice_size = element_size;
+  bool whole = true;
+  for (int i=1; i<num_dims; ++i) {
+    dst_slice_size *= dst_dimensions[i];
+    src_slice_size *= src_dimensions[i];
+    whole = whole && volume[i] == dst_dimensions[i] &&
+        volume[i] == src_dimensions[i];
+  }
+
+  dst_off += dst_offsets[0] * dst_slice_size;
+  src_off += src_offsets[0] * src_slice_size;
+  if (whole)
+    return Row(dst_off, src_off, dst_slice_size * volume[0]);
+
+  for (size_t i=0; i<volume[0]; ++i) {
+    int rc = for_each_rect_row(element_size, num_dims - 1, volume + 1,
+        dst_offsets + 1, src_offsets + 1, dst_dimensions + 1,
+        src_dimensions + 1, dst_off + dst_slice_size * i,
+        src_off + src_slice_size * i, Row);
+    if (rc != OFFLOAD_SUCCESS)
+      return rc;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+static size_t rect_size(size_t element_size, int num_dims,
+    const size_t *volume) {
+  size_t size = element_size;
+  for (int i=0; i<num_dims; ++i)
+    size *= volume[i];
+  return size;
+}
+
+/// Host staging of a rectangular copy with a device that has no native
+/// rectangular transfers. Rows are packed into one buffer of at most
+/// StagingLimit bytes; rows adjacent on the device are moved with a single
+/// transfer, and the transfers of a buffer go in one batch or on one queue.
+class RectStagingTy {
+  DeviceTy &Device;
+  bool ToDevice;
+  std::vector<char> Buffer;
+  size_t Used;
+  // Host rows waiting in the buffer, for copies back to the host.
+  std::vector<std::pair<char *, size_t>> HstRows;
+  // Transfers of the buffer.
+  std::vector<void *> TgtPtrs;
+  std::vector<void *> BufPtrs;
+  std::vector<int64_t> Sizes;
+
+public:
+  RectStagingTy(DeviceTy &Device, bool ToDevice, size_t Size)
+      : Device(Device), ToDevice(ToDevice),
+        Buffer(std::min<size_t>(Size, StagingLimit)), Used(0) {}
+
+  int add(char *HstPtr, char *TgtPtr, size_t Size) {
+    if (Size > Buffer.size())
+      return ToDevice ? Device.data_submit(TgtPtr, HstPtr, Size) :
+          Device.data_retrieve(HstPtr, TgtPtr, Size);
+    if (Used + Size > Buffer.size()) {
+      int rc = flush();
+      if (rc != OFFLOAD_SUCCESS)
+        return rc;
+    }
+
+    char *BufPtr = Buffer.data() + Used;
+    if (ToDevice)
+      memcpy(BufPtr, HstPtr, Size);
+    else
+      HstRows.push_back(std::make_pair(HstPtr, Size));
+    if (!TgtPtrs.empty() && (char *)TgtPtrs.back() + Sizes.back() == TgtPtr) {
+      Sizes.back() += Size;
+    } else {
+      TgtPtrs.push_back(TgtPtr);
+      BufPtrs.push_back(BufPtr);
+      Sizes.push_back(Size);
+    }
+    Used += Size;
+    return OFFLOAD_SUCCESS;
+  }
+
+  int flush() {
+    int rc = OFFLOAD_SUCCESS;
+    if (ToDevice && TgtPtrs.size() > 1 && Device.RTL->data_submit_batch) {
+      rc = Device.data_submit_batch(TgtPtrs.size(), TgtPtrs.data(),
+          BufPtrs.data(), Sizes.data());
+    } else {
+      __tgt_async_info AsyncInfo = {NULL};
+      for (size_t i = 0; i < TgtPtrs.size() && rc == OFFLOAD_SUCCESS; ++i)
+        rc = ToDevice ?
+            Device.data_submit(TgtPtrs[i], BufPtrs[i], Sizes[i], &AsyncInfo) :
+            Device.data_retrieve(BufPtrs[i], TgtPtrs[i], Sizes[i], &AsyncInfo);
+      int sync_rc = Device.synchronize(&AsyncInfo);
+      if (rc == OFFLOAD_SUCCESS)
+        rc = sync_rc;
+    }
+
+    if (!ToDevice && rc == OFFLOAD_SUCCESS) {
+      const char *BufPtr = Buffer.data();
+      for (auto &R : HstRows) {
+        memcpy(R.first, BufPtr, R.second);
+        BufPtr += R.second;
+      }
+    }
+    HstRows.clear();
+    TgtPtrs.clear();
+    BufPtrs.clear();
+    Sizes.clear();
+    Used = 0;
+    return rc;
+  }
+};
+
 EXTERN int omp_target_memcpy_rect(void *dst, void *src, size_t element_size,
     int num_dims, const size_t *volume, const size_t *dst_offsets,
     const size_t *src_offsets, const size_t *dst_dimensions,
@@ -753,32 +1445,74 @@ EXTERN int omp_target_memcpy_rect(void *dst, void *src, size_t element_size,
     return OFFLOAD_FAIL;
   }
 
-  int rc;
-  if (num_dims == 1) {
-    rc = omp_target_memcpy(dst, src, element_size * volume[0],
-        element_size * dst_offsets[0], element_size * src_offsets[0],
-        dst_device, src_device);
-  } else {
-    size_t dst_slice_size = element_size;
-    size_t src_slice_size = element_size;
-    for (int i=1; i<num_dims; ++i) {
-      dst_slice_size *= dst_dimensions[i];
-      src_slice_size *= src_dimensions[i];
-    }
+  if (src_device != omp_get_initial_device() && !device_is_ready(src_device)) {
+    DP("omp_target_memcpy_rect returns OFFLOAD_FAIL\n");
+    return OFFLOAD_FAIL;
+  }
 
-    size_t dst_off = dst_offsets[0] * dst_slice_size;
-    size_t src_off = src_offsets[0] * src_slice_size;
-    for (size_t i=0; i<volume[0]; ++i) {
-      rc = omp_target_memcpy_rect((char *) dst + dst_off + dst_slice_size * i,
-          (char *) src + src_off + src_slice_size * i, element_size,
-          num_dims - 1, volume + 1, dst_offsets + 1, src_offsets + 1,
-          dst_dimensions + 1, src_dimensions + 1, dst_device, src_device);
+  if (dst_device != omp_get_initial_device() && !device_is_ready(dst_device)) {
+    DP("omp_target_memcpy_rect returns OFFLOAD_FAIL\n");
+    return OFFLOAD_FAIL;
+  }
 
-      if (rc) {
-        DP("Recursive call to omp_target_memcpy_rect returns unsuccessfully\n");
-        return rc;
-      }
+  int rc;
+  char *dstBase = (char *)dst;
+  char *srcBase = (char *)src;
+  if (src_device == omp_get_initial_device() &&
+      dst_device == omp_get_initial_device()) {
+    DP("rect copy from host to host\n");
+    rc = for_each_rect_row(element_size, num_dims, volume, dst_offsets,
+        src_offsets, dst_dimensions, src_dimensions, 0, 0,
+        [&](size_t DstOff, size_t SrcOff, size_t Size) {
+          memcpy(dstBase + DstOff, srcBase + SrcOff, Size);
+          return OFFLOAD_SUCCESS;
+        });
+  } else if (src_device == omp_get_initial_device()) {
+    DeviceTy &DstDev = Devices[dst_device];
+    if (DstDev.RTL->data_submit_rect) {
+      DP("rect copy from host to device\n");
+      rc = DstDev.data_submit_rect(dst, src, element_size, num_dims, volume,
+          dst_offsets, src_offsets, dst_dimensions, src_dimensions);
+    } else {
+      DP("rect copy from host to device, staged\n");
+      RectStagingTy Staging(DstDev, /*ToDevice=*/true,
+          rect_size(element_size, num_dims, volume));
+      rc = for_each_rect_row(element_size, num_dims, volume, dst_offsets,
+          src_offsets, dst_dimensions, src_dimensions, 0, 0,
+          [&](size_t DstOff, size_t SrcOff, size_t Size) {
+            return Staging.add(srcBase + SrcOff, dstBase + DstOff, Size);
+          });
+      if (rc == OFFLOAD_SUCCESS)
+        rc = Staging.flush();
     }
+  } else if (dst_device == omp_get_initial_device()) {
+    DeviceTy &SrcDev = Devices[src_device];
+    if (SrcDev.RTL->data_retrieve_rect) {
+      DP("rect copy from device to host\n");
+      rc = SrcDev.data_retrieve_rect(dst, src, element_size, num_dims, volume,
+          dst_offsets, src_offsets, dst_dimensions, src_dimensions);
+    } else {
+      DP("rect copy from device to host, staged\n");
+      RectStagingTy Staging(SrcDev, /*ToDevice=*/false,
+          rect_size(element_size, num_dims, volume));
+      rc = for_each_rect_row(element_size, num_dims, volume, dst_offsets,
+          src_offsets, dst_dimensions, src_dimensions, 0, 0,
+          [&](size_t DstOff, size_t SrcOff, size_t Size) {
+            return Staging.add(dstBase + DstOff, srcBase + SrcOff, Size);
+          });
+      if (rc == OFFLOAD_SUCCESS)
+        rc = Staging.flush();
+    }
+  } else {
+    DP("rect copy from device to device\n");
+    DeviceTy &SrcDev = Devices[src_device];
+    DeviceTy &DstDev = Devices[dst_device];
+    rc = for_each_rect_row(element_size, num_dims, volume, dst_offsets,
+        src_offsets, dst_dimensions, src_dimensions, 0, 0,
+        [&](size_t DstOff, size_t SrcOff, size_t Size) {
+          return device_memcpy(DstDev, dstBase + DstOff, SrcDev,
+              srcBase + SrcOff, Size);
+        });
   }
 
   DP("omp_target_memcpy_rect returns %d\n", rc);
@@ -845,27 +1579,30 @@ int DeviceTy::associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size) {
   DataMapMtx.lock();
 
   // Check if entry exists
-  for (auto &HT : HostDataToTargetMap) {
-    // lld: check validation
-    if (!HT.IsValid) continue;
-    if ((uintptr_t)HstPtrBegin == HT.HstPtrBegin) {
-      // Mapping already exists
-      bool isValid = HT.HstPtrBegin == (uintptr_t) HstPtrBegin &&
-                     HT.HstPtrEnd == (uintptr_t) HstPtrBegin + Size &&
-                     HT.TgtPtrBegin == (uintptr_t) TgtPtrBegin;
-      DataMapMtx.unlock();
-      if (isValid) {
-        DP("Attempt to re-associate the same device ptr+offset with the same "
-            "host ptr, nothing to do\n");
-        return OFFLOAD_SUCCESS;
-      } else {
-        DP("Not allowed to re-associate a different device ptr+offset with the "
-            "same host ptr\n");
-        return OFFLOAD_FAIL;
-      }
+  auto It = HostDataToTargetMap.find((uintptr_t)HstPtrBegin);
+  // lld: check validation
+  if (It != HostDataToTargetMap.end() && It->IsValid) {
+    auto &HT = *It;
+    // Mapping already exists
+    bool isValid = HT.HstPtrBegin == (uintptr_t) HstPtrBegin &&
+                   HT.HstPtrEnd == (uintptr_t) HstPtrBegin + Size &&
+                   HT.TgtPtrBegin == (uintptr_t) TgtPtrBegin;
+    DataMapMtx.unlock();
+    if (isValid) {
+      DP("Attempt to re-associate the same device ptr+offset with the same "
+          "host ptr, nothing to do\n");
+      return OFFLOAD_SUCCESS;
+    } else {
+      DP("Not allowed to re-associate a different device ptr+offset with the "
+          "same host ptr\n");
+      return OFFLOAD_FAIL;
     }
   }
 
+  // lld: an invalidated entry occupies this address, release it first
+  if (It != HostDataToTargetMap.end())
+    releaseEntry(It);
+
   // Mapping does not exist, allocate it
   HostDataToTargetTy newEntry;
 
@@ -881,10 +1618,15 @@ int DeviceTy::associatePtr(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size) {
       DPxMOD ", TgtBegin=" DPxMOD "\n", DPxPTR(newEntry.HstPtrBase),
       DPxPTR(newEntry.HstPtrBegin), DPxPTR(newEntry.HstPtrEnd),
       DPxPTR(newEntry.TgtPtrBegin));
-  HostDataToTargetMap.push_front(newEntry);
+  bool Inserted =
+      HostDataToTargetMap.insert(newEntry) != HostDataToTargetMap.end();
 
   DataMapMtx.unlock();
 
+  if (!Inserted) {
+    DP("A mapping already starts at " DPxMOD "\n", DPxPTR(HstPtrBegin));
+    return OFFLOAD_FAIL;
+  }
   return OFFLOAD_SUCCESS;
 }
 
@@ -892,22 +1634,21 @@ int DeviceTy::disassociatePtr(void *HstPtrBegin) {
   DataMapMtx.lock();
 
   // Check if entry exists
-  for (HostDataToTargetListTy::iterator ii = HostDataToTargetMap.begin();
-      ii != HostDataToTargetMap.end(); ++ii) {
-    // lld: check validation
-    if (!ii->IsValid) continue;
-    if ((uintptr_t)HstPtrBegin == ii->HstPtrBegin) {
-      // Mapping exists
-      if (CONSIDERED_INF(ii->RefCount)) {
-        DP("Association found, removing it\n");
-        HostDataToTargetMap.erase(ii);
-        DataMapMtx.unlock();
-        return OFFLOAD_SUCCESS;
-      } else {
-        DP("Trying to disassociate a pointer which was not mapped via "
-            "omp_target_associate_ptr\n");
-        break;
-      }
+  auto It = HostDataToTargetMap.find((uintptr_t)HstPtrBegin);
+  // lld: check validation
+  if (It != HostDataToTargetMap.end() && It->IsValid) {
+    // Mapping exists
+    if (CONSIDERED_INF(It->RefCount)) {
+      DP("Association found, removing it\n");
+      untrackWrites(*It);
+      removeFromClusters(*It);
+      HostDataToTargetMap.erase(It);
+      ++MapGeneration;
+      DataMapMtx.unlock();
+      return OFFLOAD_SUCCESS;
+    } else {
+      DP("Trying to disassociate a pointer which was not mapped via "
+          "omp_target_associate_ptr\n");
     }
   }
 
@@ -919,20 +1660,15 @@ int DeviceTy::disassociatePtr(void *HstPtrBegin) {
 
 // Get ref count of map entry containing HstPtrBegin
 long DeviceTy::getMapEntryRefCnt(void *HstPtrBegin) {
-  uintptr_t hp = (uintptr_t)HstPtrBegin;
   long RefCnt = -1;
 
-  DataMapMtx.lock();
-  for (auto &HT : HostDataToTargetMap) {
-    // lld: check validation
-    if (!HT.IsValid) continue;
-    if (hp >= HT.HstPtrBegin && hp < HT.HstPtrEnd) {
-      DP("DeviceTy::getMapEntry: requested entry found\n");
-      RefCnt = HT.RefCount;
-      break;
-    }
+  DataMapMtx.lock_shared();
+  LookupResult lr = lookupMapping(HstPtrBegin, 0);
+  if (lr.Flags.IsContained) {
+    DP("DeviceTy::getMapEntry: requested entry found\n");
+    RefCnt = lr.Entry->RefCount;
   }
-  DataMapMtx.unlock();
+  DataMapMtx.unlock_shared();
 
   if (RefCnt < 0) {
     DP("DeviceTy::getMapEntry: requested entry not found\n");
@@ -947,8 +1683,18 @@ LookupResult DeviceTy::lookupMapping(void *HstPtrBegin, int64_t Size) {
 
   DP("Looking up mapping(HstPtrBegin=" DPxMOD ", Size=%ld)...\n", DPxPTR(hp),
       Size);
-  for (lr.Entry = HostDataToTargetMap.begin();
-      lr.Entry != HostDataToTargetMap.end(); ++lr.Entry) {
+
+  // The section can only intersect the entry that starts at or before hp
+  // (if hp lies inside it) or otherwise the first entry that starts after hp.
+  lr.Entry = HostDataToTargetMap.upper_bound(hp);
+  if (lr.Entry != HostDataToTargetMap.begin()) {
+    HostDataToTargetMapTy::iterator Prev = lr.Entry;
+    --Prev;
+    if (hp < Prev->HstPtrEnd)
+      lr.Entry = Prev;
+  }
+
+  if (lr.Entry != HostDataToTargetMap.end()) {
     auto &HT = *lr.Entry;
     // Is it contained?
     lr.Flags.IsContained = hp >= HT.HstPtrBegin && hp < HT.HstPtrEnd &&
@@ -969,7 +1715,8 @@ LookupResult DeviceTy::lookupMapping(void *HstPtrBegin, int64_t Size) {
         lr.Flags.ExtendsBefore = 0;
         lr.Flags.ExtendsAfter = 0;
       }
-      break;
+    } else {
+      lr.Entry = HostDataToTargetMap.end();
     }
   }
 
@@ -988,18 +1735,22 @@ LookupResult DeviceTy::lookupMapping(void *HstPtrBegin, int64_t Size) {
 // Used by target_data_begin, target_data_end, target_data_update and target.
 // Return the target pointer begin (where the data will be moved).
 // Decrement the reference counter if called from target_data_end.
+// Only the shared lock is taken: the table is not modified and the reference
+// count is decremented atomically. Dropping the last reference is left to
+// deallocTgtPtr, which runs under the exclusive lock.
 void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size, bool &IsLast,
     bool UpdateRefCount) {
   void *rc = NULL;
-  DataMapMtx.lock();
+  DataMapMtx.lock_shared();
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
 
   if (lr.Flags.IsContained || lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) {
     auto &HT = *lr.Entry;
-    IsLast = !(HT.RefCount > 1);
-
-    if (HT.RefCount > 1 && UpdateRefCount)
-      --HT.RefCount;
+    long RefCount = HT.RefCount.load();
+    while (UpdateRefCount && RefCount > 1 &&
+           !HT.RefCount.compare_exchange_weak(RefCount, RefCount - 1))
+      ;
+    IsLast = !(RefCount > 1);
 
     uintptr_t tp = HT.TgtPtrBegin + ((uintptr_t)HstPtrBegin - HT.HstPtrBegin);
     DP("Mapping exists with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD ", "
@@ -1012,7 +1763,7 @@ void *DeviceTy::getTgtPtrBegin(void *HstPtrBegin, int64_t Size, bool &IsLast,
     IsLast = false;
   }
 
-  DataMapMtx.unlock();
+  DataMapMtx.unlock_shared();
   return rc;
 }
 
@@ -1043,21 +1794,26 @@ int DeviceTy::deallocTgtPtr(void *HstPtrBegin, int64_t Size, bool ForceDelete) {
       assert(HT.RefCount == 0 && "did not expect a negative ref count");
       DP("Deleting tgt data " DPxMOD " of size %ld\n",
           DPxPTR(HT.TgtPtrBegin), Size);
+      ++MapGeneration;
+      untrackWrites(HT);
       //RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
-      // lld: for unified memory
-      if (RecycleMem == 0) {
-        if (HT.TgtPtrBegin != HT.HstPtrBegin) {
-          deviceSize -= Size;
-          RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
-          LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
-        }
+      // lld: for unified memory; an entry whose placement is not decided
+      // holds nothing worth recycling
+      if (RecycleMem == 0 || !HT.Decided) {
         DP("Removing%s mapping with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD
             ", Size=%ld\n", (ForceDelete ? " (forced)" : ""),
             DPxPTR(HT.HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
-        HostDataToTargetMap.erase(lr.Entry);
+        // lld: soft device and UM entries give their bytes back as well
+        HT.IsValid = false;
+        releaseEntry(lr.Entry);
       } else {
+        // lld: keep the entry with what it holds for a later remap
+        DP("Recycling mapping with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD
+            ", Size=%ld\n", DPxPTR(HT.HstPtrBegin), DPxPTR(HT.TgtPtrBegin),
+            Size);
         HT.IsValid = false;
-        //InvalidTargetDataList.push_front(*lr.Entry);
+        recycleEntry(HT);
+        trimRecycled();
       }
     }
     rc = OFFLOAD_SUCCESS;
@@ -1072,6 +1828,35 @@ int DeviceTy::deallocTgtPtr(void *HstPtrBegin, int64_t Size, bool ForceDelete) {
 }
 
 /// Init device, should not be called directly.
+// lld: LLD_<name>_<id> for device <id> if set, else LLD_<name>
+static char *getDeviceEnv(const char *Name, int32_t DeviceID) {
+  std::string Key = std::string(Name) + "_" + std::to_string(DeviceID);
+  char *envStr = getenv(Key.c_str());
+  return envStr ? envStr : getenv(Name);
+}
+
+// lld: LLD_GPU_MODE; CLUSTER (0) unless the value names another mode
+static int parseGpuMode(const char *Str) {
+  static const std::pair<const char *, int> Modes[] = {
+      {"OBJ", -1}, {"LOCAL", -2}, {"RD", -3},  {"LRU", -4}, {"COST", -5},
+      {"UM", 1},   {"DEV", 2},    {"HOST", 3}, {"HYB", 4},  {"SDEV", 5}};
+  for (auto &M : Modes)
+    if (!strcmp(Str, M.first))
+      return M.second;
+  return 0;
+}
+
+// lld: LLD_POLICY, with the numbering of the per object modes; 0 keeps the
+// policy of the mode
+static int parsePolicy(const char *Str) {
+  static const std::pair<const char *, int> Policies[] = {
+      {"RANK", -1}, {"LOCAL", -2}, {"RD", -3}, {"LRU", -4}, {"COST", -5}};
+  for (auto &P : Policies)
+    if (!strcmp(Str, P.first))
+      return P.second;
+  return 0;
+}
+
 void DeviceTy::init() {
   int32_t rc = RTL->init_device(RTLDeviceID);
   if (rc == OFFLOAD_SUCCESS) {
@@ -1081,6 +1866,56 @@ void DeviceTy::init() {
   deviceSize = 0;
   umSize = 0;
   allocSize = 0;
+  evictions = 0;
+  prefetches = 0;
+  prefetchHits = 0;
+  prefetchLate = 0;
+  prefetchUseless = 0;
+
+  // lld: replacement settings
+  char *envStr;
+  int64_t Value;
+  if ((envStr = getDeviceEnv("LLD_GPU_MODE", DeviceID)))
+    GMode = parseGpuMode(envStr);
+  if ((envStr = getDeviceEnv("LLD_POLICY", DeviceID)))
+    RPolicy = parsePolicy(envStr);
+  if ((envStr = getDeviceEnv("LLD_RECYCLE", DeviceID)) &&
+      parseEnvInt("LLD_RECYCLE", envStr, 1, Value))
+    RecycleMem = (int)std::min<int64_t>(std::max<int64_t>(Value, INT_MIN),
+        INT_MAX);
+  if ((envStr = getDeviceEnv("LLD_PARTIAL_MAP", DeviceID)) &&
+      parseEnvInt("LLD_PARTIAL_MAP", envStr, 1, Value))
+    PartialMap = Value != 0;
+  if ((envStr = getDeviceEnv("LLD_STREAM", DeviceID)) && // in MB
+      parseEnvInt("LLD_STREAM", envStr, 1024 * 1024, Value))
+    StreamWindow = std::max<int64_t>(Value, 0);
+  if ((envStr = getDeviceEnv("LLD_PREFETCH", DeviceID)) &&
+      parseEnvInt("LLD_PREFETCH", envStr, 1, Value))
+    PrefetchDist = (int)std::min<int64_t>(std::max<int64_t>(Value, 0), INT_MAX);
+  if ((envStr = getDeviceEnv("LLD_WRITE_TRACK", DeviceID)) && // in KB
+      parseEnvInt("LLD_WRITE_TRACK", envStr, 1024, Value))
+    WriteTrackMin = std::max<int64_t>(Value, 0);
+
+  int64_t Capacity = DefaultDevMem;
+  int64_t Free = 0, Total = 0;
+  if (IsInit && RTL->get_mem_info &&
+      RTL->get_mem_info(RTLDeviceID, &Free, &Total) == OFFLOAD_SUCCESS &&
+      Total > 0)
+    Capacity = (Free > 0 && Free <= Total) ? Free : Total;
+  if ((envStr = getDeviceEnv("LLD_DEV_SIZE", DeviceID)) && // in MB
+      parseEnvInt("LLD_DEV_SIZE", envStr, 1024 * 1024, Value))
+    Capacity = Value;
+  double Ratio;
+  if ((envStr = getDeviceEnv("LLD_DEV_RESERVE", DeviceID)) &&
+      parseEnvDouble("LLD_DEV_RESERVE", envStr, Ratio))
+    ReserveRatio = std::min(std::max(Ratio, 0.0), 1.0);
+  setMemCapacity(Capacity);
+  DP("Device %d memory: capacity %" PRId64 ", budget %" PRId64 "\n",
+      DeviceID, MemCapacity, MemBudget);
+  LLD_DP("Device %d: mode %d, policy %d, recycle %d, partial %d, stream %"
+      PRId64 ", prefetch %d, write track %" PRId64 "\n", DeviceID, GMode,
+      RPolicy, RecycleMem, PartialMap, StreamWindow, PrefetchDist,
+      WriteTrackMin);
 }
 
 /// Thread-safe method to initialize the device only once.
@@ -1100,30 +1935,41 @@ int32_t DeviceTy::initOnce() {
 }
 
 // Load binary to device.
+// lld: not under RTL->Mtx, devices load their images in parallel. RTLs guard
+// what their devices share while loading.
 __tgt_target_table *DeviceTy::load_binary(void *Img) {
-  RTL->Mtx.lock();
-  __tgt_target_table *rc = RTL->load_binary(RTLDeviceID, Img);
-  RTL->Mtx.unlock();
-  return rc;
+  return RTL->load_binary(RTLDeviceID, Img);
 }
 
 // Submit data to device.
 int32_t DeviceTy::data_submit(void *TgtPtrBegin, void *HstPtrBegin,
-    int64_t Size) {
+    int64_t Size, __tgt_async_info *AsyncInfo) {
   LLD_DP("  Submit " DPxMOD " to " DPxMOD ", size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(TgtPtrBegin), Size);
+  if (AsyncInfo && RTL->data_submit_async)
+    return RTL->data_submit_async(RTLDeviceID, TgtPtrBegin, HstPtrBegin, Size,
+        AsyncInfo);
   return RTL->data_submit(RTLDeviceID, TgtPtrBegin, HstPtrBegin, Size);
 }
 
 // Retrieve data from device.
 int32_t DeviceTy::data_retrieve(void *HstPtrBegin, void *TgtPtrBegin,
-    int64_t Size) {
+    int64_t Size, __tgt_async_info *AsyncInfo) {
   LLD_DP("  Retrieve " DPxMOD " from " DPxMOD ", size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(TgtPtrBegin), Size);
+  // lld: the copy writes into pages that may be write-protected
+  if (WriteTrackMin)
+    invalidateWrites(HstPtrBegin, Size);
+  if (AsyncInfo && RTL->data_retrieve_async)
+    return RTL->data_retrieve_async(RTLDeviceID, HstPtrBegin, TgtPtrBegin,
+        Size, AsyncInfo);
   return RTL->data_retrieve(RTLDeviceID, HstPtrBegin, TgtPtrBegin, Size);
 }
 
 // Run region on device
 int32_t DeviceTy::run_region(void *TgtEntryPtr, void **TgtVarsPtr,
-    ptrdiff_t *TgtOffsets, int32_t TgtVarsSize) {
+    ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, __tgt_async_info *AsyncInfo) {
+  if (AsyncInfo && RTL->run_region_async)
+    return RTL->run_region_async(RTLDeviceID, TgtEntryPtr, TgtVarsPtr,
+        TgtOffsets, TgtVarsSize, AsyncInfo);
   return RTL->run_region(RTLDeviceID, TgtEntryPtr, TgtVarsPtr, TgtOffsets,
       TgtVarsSize);
 }
@@ -1131,11 +1977,270 @@ int32_t DeviceTy::run_region(void *TgtEntryPtr, void **TgtVarsPtr,
 // Run team region on device.
 int32_t DeviceTy::run_team_region(void *TgtEntryPtr, void **TgtVarsPtr,
     ptrdiff_t *TgtOffsets, int32_t TgtVarsSize, int32_t NumTeams,
-    int32_t ThreadLimit, uint64_t LoopTripCount) {
+    int32_t ThreadLimit, uint64_t LoopTripCount, __tgt_async_info *AsyncInfo) {
+  if (AsyncInfo && RTL->run_team_region_async)
+    return RTL->run_team_region_async(RTLDeviceID, TgtEntryPtr, TgtVarsPtr,
+        TgtOffsets, TgtVarsSize, NumTeams, ThreadLimit, LoopTripCount,
+        AsyncInfo);
   return RTL->run_team_region(RTLDeviceID, TgtEntryPtr, TgtVarsPtr, TgtOffsets,
       TgtVarsSize, NumTeams, ThreadLimit, LoopTripCount);
 }
 
+// Wait for the operations enqueued on AsyncInfo.
+int32_t DeviceTy::synchronize(__tgt_async_info *AsyncInfo) {
+  if (!AsyncInfo || !AsyncInfo->Queue || !RTL->synchronize)
+    return OFFLOAD_SUCCESS;
+  return RTL->synchronize(RTLDeviceID, AsyncInfo);
+}
+
+// Submit a batch of copies to device.
+int32_t DeviceTy::data_submit_batch(int32_t Num, void **TgtPtrs,
+    void **HstPtrs, int64_t *Sizes, __tgt_async_info *AsyncInfo) {
+  LLD_DP("  Submit batch of %d copies\n", Num);
+  if (!RTL->synchronize)
+    AsyncInfo = NULL;
+  return RTL->data_submit_batch(RTLDeviceID, Num, TgtPtrs, HstPtrs, Sizes,
+      AsyncInfo);
+}
+
+bool DeviceTy::canExchange(const DeviceTy &DstDev) const {
+  return RTL == DstDev.RTL && RTL->data_exchange;
+}
+
+// Copy data to another device of the same RTL.
+int32_t DeviceTy::data_exchange(void *SrcPtr, DeviceTy &DstDev, void *DstPtr,
+    int64_t Size) {
+  LLD_DP("  Exchange " DPxMOD " to " DPxMOD " on device %d, size=%ld\n",
+      DPxPTR(SrcPtr), DPxPTR(DstPtr), DstDev.DeviceID, Size);
+  return RTL->data_exchange(RTLDeviceID, SrcPtr, DstDev.RTLDeviceID, DstPtr,
+      Size);
+}
+
+// Submit a rectangular sub-volume to device.
+int32_t DeviceTy::data_submit_rect(void *TgtPtr, void *HstPtr,
+    size_t ElementSize, int32_t NumDims, const size_t *Volume,
+    const size_t *TgtOffsets, const size_t *HstOffsets, const size_t *TgtDims,
+    const size_t *HstDims) {
+  LLD_DP("  Submit rect " DPxMOD " to " DPxMOD ", %d dims\n", DPxPTR(HstPtr),
+      DPxPTR(TgtPtr), NumDims);
+  return RTL->data_submit_rect(RTLDeviceID, TgtPtr, HstPtr, ElementSize,
+      NumDims, Volume, TgtOffsets, HstOffsets, TgtDims, HstDims);
+}
+
+// Retrieve a rectangular sub-volume from device.
+int32_t DeviceTy::data_retrieve_rect(void *HstPtr, void *TgtPtr,
+    size_t ElementSize, int32_t NumDims, const size_t *Volume,
+    const size_t *HstOffsets, const size_t *TgtOffsets, const size_t *HstDims,
+    const size_t *TgtDims) {
+  LLD_DP("  Retrieve rect " DPxMOD " from " DPxMOD ", %d dims\n",
+      DPxPTR(HstPtr), DPxPTR(TgtPtr), NumDims);
+  return RTL->data_retrieve_rect(RTLDeviceID, HstPtr, TgtPtr, ElementSize,
+      NumDims, Volume, HstOffsets, TgtOffsets, HstDims, TgtDims);
+}
+
+// lld: allocate device memory, reusing a cached block of the same class.
+void *DeviceTy::data_alloc(int64_t Size, void *HstPtrBegin) {
+  if (Size <= 0 || Size > PoolLimit)
+    return RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+
+  int64_t BlockSize = Size;
+  void *TgtPtrBegin = NULL;
+  std::lock_guard<std::mutex> LG(MemPool.Mtx);
+  auto It = MemPool.FreeBlocks.lower_bound(Size);
+  if (It != MemPool.FreeBlocks.end() &&
+      It->first <= DeviceMemPoolTy::getClassSize(Size)) {
+    BlockSize = It->first;
+    TgtPtrBegin = It->second.back();
+    It->second.pop_back();
+    if (It->second.empty())
+      MemPool.FreeBlocks.erase(It);
+    MemPool.CachedSize -= BlockSize;
+    ++MemPool.Hits;
+    LLD_DP("  Pool reuses " DPxMOD " for size=%ld\n", DPxPTR(TgtPtrBegin),
+        Size);
+  } else {
+    ++MemPool.Misses;
+    int64_t Over = deviceSize + umSize + MemPool.SlackSize +
+        MemPool.CachedSize + Size - MemBudget;
+    if (Over > 0)
+      releasePoolBlocks(Over);
+    TgtPtrBegin = RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+    if (!TgtPtrBegin && MemPool.CachedSize > 0) {
+      // The RTL is out of memory, hand it the whole cache and try again.
+      releasePoolBlocks(MemPool.CachedSize);
+      TgtPtrBegin = RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+    }
+    if (!TgtPtrBegin)
+      return NULL;
+  }
+  DeviceMemPoolTy::BlockTy &Block = MemPool.UsedBlocks[TgtPtrBegin];
+  Block.BlockSize = BlockSize;
+  Block.Size = Size;
+  MemPool.SlackSize += BlockSize - Size;
+  return TgtPtrBegin;
+}
+
+// lld: return device memory to the pool, or to the RTL if it was not pooled
+// or the pool is full.
+int32_t DeviceTy::data_delete(void *TgtPtrBegin) {
+  if (WriteTrackMin)
+    dropWrites(TgtPtrBegin);
+  std::unique_lock<std::mutex> LG(MemPool.Mtx);
+  auto It = MemPool.UsedBlocks.find(TgtPtrBegin);
+  if (It == MemPool.UsedBlocks.end()) {
+    LG.unlock();
+    return RTL->data_delete(RTLDeviceID, TgtPtrBegin);
+  }
+  int64_t BlockSize = It->second.BlockSize;
+  MemPool.SlackSize -= BlockSize - It->second.Size;
+  MemPool.UsedBlocks.erase(It);
+  if (BlockSize > PoolLimit)
+    return RTL->data_delete(RTLDeviceID, TgtPtrBegin);
+  if (MemPool.CachedSize + BlockSize > PoolLimit)
+    releasePoolBlocks(MemPool.CachedSize + BlockSize - PoolLimit);
+  MemPool.FreeBlocks[BlockSize].push_back(TgtPtrBegin);
+  MemPool.CachedSize += BlockSize;
+  return OFFLOAD_SUCCESS;
+}
+
+void DeviceTy::trimMemPool(int64_t Extra) {
+  std::lock_guard<std::mutex> LG(MemPool.Mtx);
+  int64_t Over = deviceSize + umSize + MemPool.SlackSize + MemPool.CachedSize +
+      Extra - MemBudget;
+  if (Over > 0 && MemPool.CachedSize > 0) {
+    LLD_DP("  Trim pool by %ld bytes\n", Over);
+    releasePoolBlocks(Over);
+  }
+}
+
+void DeviceTy::releaseMemPool() {
+  std::lock_guard<std::mutex> LG(MemPool.Mtx);
+  if (MemPool.Hits + MemPool.Misses > 0) {
+    DP("Device %d pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRId64
+        " bytes cached\n", DeviceID, MemPool.Hits, MemPool.Misses,
+        MemPool.CachedSize);
+    Profiler.pool(DeviceID, MemPool.Hits, MemPool.Misses);
+    MemPool.Hits = MemPool.Misses = 0;
+  }
+  releasePoolBlocks(MemPool.CachedSize);
+}
+
+int64_t DeviceTy::releasePoolBlocks(int64_t Bytes) {
+  int64_t Released = 0;
+  while (Released < Bytes && !MemPool.FreeBlocks.empty()) {
+    auto It = std::prev(MemPool.FreeBlocks.end());
+    while (Released < Bytes && !It->second.empty()) {
+      RTL->data_delete(RTLDeviceID, It->second.back());
+      It->second.pop_back();
+      Released += It->first;
+    }
+    if (It->second.empty())
+      MemPool.FreeBlocks.erase(It);
+  }
+  MemPool.CachedSize -= Released;
+  return Released;
+}
+
+// lld: find the cached arguments of a launch of HostPtr with exactly these
+// arguments. On success the mapped entries of the launch are referenced as
+// target_data_begin would have done, and nothing needs to be copied.
+std::shared_ptr<LaunchCacheEntryTy> DeviceTy::lookupLaunch(void *HostPtr,
+    int32_t ArgNum, void **ArgsBase, void **Args, int64_t *ArgSizes,
+    int64_t *ArgTypes) {
+  std::shared_ptr<LaunchCacheEntryTy> Launch;
+  LaunchCacheMtx.lock_shared();
+  auto It = LaunchCache.find(HostPtr);
+  if (It != LaunchCache.end()) {
+    for (auto &L : It->second)
+      if (L->matches(ArgNum, ArgsBase, Args, ArgSizes, ArgTypes)) {
+        Launch = L;
+        break;
+      }
+  }
+  LaunchCacheMtx.unlock_shared();
+  if (!Launch)
+    return nullptr;
+
+  DataMapMtx.lock_shared();
+  if (Launch->Generation != MapGeneration) {
+    DataMapMtx.unlock_shared();
+    return nullptr;
+  }
+  ++GlobalTimeStamp;
+  for (auto *HT : Launch->Entries) {
+    ++HT->RefCount;
+    HT->TimeStamp = GlobalTimeStamp;
+  }
+  DataMapMtx.unlock_shared();
+  return Launch;
+}
+
+// lld: remember the arguments of a launch that has completed, if replaying it
+// would be equivalent: every mapped argument must be held by an enclosing
+// data region, so that the launch neither allocates, copies nor releases.
+void DeviceTy::cacheLaunch(void *HostPtr, int32_t ArgNum, void **ArgsBase,
+    void **Args, int64_t *ArgSizes, int64_t *ArgTypes, void *TgtEntryPtr,
+    const char *Name) {
+  auto Launch = std::make_shared<LaunchCacheEntryTy>();
+  Launch->ArgsBase.assign(ArgsBase, ArgsBase + ArgNum);
+  Launch->Args.assign(Args, Args + ArgNum);
+  Launch->ArgSizes.assign(ArgSizes, ArgSizes + ArgNum);
+  Launch->ArgTypes.assign(ArgTypes, ArgTypes + ArgNum);
+  Launch->TgtEntryPtr = TgtEntryPtr;
+  Launch->Name = Name;
+
+  DataMapMtx.lock_shared();
+  Launch->Generation = MapGeneration;
+  for (int32_t i = 0; i < ArgNum; ++i) {
+    int64_t Type = ArgTypes[i];
+    if (Type & OMP_TGT_MAPTYPE_LITERAL) {
+      if (Type & OMP_TGT_MAPTYPE_TARGET_PARAM) {
+        Launch->TgtArgs.push_back(ArgsBase[i]);
+        Launch->TgtOffsets.push_back(0);
+      }
+      continue;
+    }
+    if ((Type & (OMP_TGT_MAPTYPE_PRIVATE | OMP_TGT_MAPTYPE_ALWAYS |
+                 OMP_TGT_MAPTYPE_DELETE | OMP_TGT_MAPTYPE_PTR_AND_OBJ |
+                 OMP_TGT_MAPTYPE_RETURN_PARAM | OMP_TGT_MAPTYPE_MEMBER_OF)) ||
+        (GMode <= 0 && (Type & (OMP_TGT_MAPTYPE_RANK |
+                                OMP_TGT_MAPTYPE_LOCAL_REUSE |
+                                OMP_TGT_MAPTYPE_DIST)))) {
+      DataMapMtx.unlock_shared();
+      return;
+    }
+    LookupResult lr = lookupMapping(Args[i], ArgSizes[i]);
+    if (!lr.Flags.IsContained || !lr.Entry->Decided || !lr.Entry->IsValid ||
+        lr.Entry->ChangeMap || lr.Entry->RefCount < 1) {
+      DataMapMtx.unlock_shared();
+      return;
+    }
+    HostDataToTargetTy &HT = *lr.Entry;
+    if (Type & OMP_TGT_MAPTYPE_TARGET_PARAM) {
+      Launch->TgtArgs.push_back((void *)(HT.TgtPtrBegin +
+          ((uintptr_t)Args[i] - HT.HstPtrBegin)));
+      Launch->TgtOffsets.push_back((intptr_t)ArgsBase[i] - (intptr_t)Args[i]);
+    }
+    Launch->Entries.push_back(&HT);
+    Launch->EntryArgs.push_back(i);
+  }
+  DataMapMtx.unlock_shared();
+
+  // Keep the most recent launches first; stale ones age out.
+  LaunchCacheMtx.lock();
+  auto &Ways = LaunchCache[HostPtr];
+  if (Ways.size() >= LAUNCH_CACHE_WAYS)
+    Ways.pop_back();
+  Ways.insert(Ways.begin(), Launch);
+  LaunchCacheMtx.unlock();
+}
+
+void DeviceTy::clearLaunchCache() {
+  LaunchCacheMtx.lock();
+  LaunchCache.clear();
+  LaunchCacheMtx.unlock();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Functionality for registering libs
 
@@ -1174,7 +2279,6 @@ static void RegisterGlobalCtorsDtorsForImage(__tgt_bin_desc *desc,
   for (int32_t i = 0; i < RTL->NumberOfDevices; ++i) {
     DeviceTy &Device = Devices[RTL->Idx + i];
     Device.PendingGlobalsMtx.lock();
-    Device.HasPendingGlobals = true;
     for (__tgt_offload_entry *entry = img->EntriesBegin;
         entry != img->EntriesEnd; ++entry) {
       if (entry->flags & OMP_DECLARE_TARGET_CTOR) {
@@ -1258,6 +2362,13 @@ EXTERN void __tgt_register_lib(__tgt_bin_desc *desc) {
             HostEntriesBeginToTransTable[desc->HostEntriesBegin];
         tt.HostTable.EntriesBegin = desc->HostEntriesBegin;
         tt.HostTable.EntriesEnd = desc->HostEntriesEnd;
+        // lld: room for every device any RTL may bring up, so that the
+        // loaded tables never move under a lock-free launch.
+        size_t MaxDevices = 0;
+        for (auto &AR : RTLs.AllRTLs)
+          MaxDevices += AR.NumberOfDevices;
+        tt.Loaded.reset(new TranslationTable::LoadedImageTy[MaxDevices]);
+        ++TableMapGeneration;
       }
 
       // Retrieve translation table for this library.
@@ -1317,12 +2428,17 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
 
       FoundRTL = R;
 
-      // Execute dtors for static objects if the device has been used, i.e.
-      // if its PendingCtors list has been emptied.
+      // Execute dtors for static objects if the image has been loaded on the
+      // device, i.e. its ctors have run.
+      TrlTblMtx.lock();
+      auto tt = HostEntriesBeginToTransTable.find(desc->HostEntriesBegin);
+      TranslationTable *TransTable = tt != HostEntriesBeginToTransTable.end() ?
+          &tt->second : NULL;
+      TrlTblMtx.unlock();
       for (int32_t i = 0; i < FoundRTL->NumberOfDevices; ++i) {
         DeviceTy &Device = Devices[FoundRTL->Idx + i];
         Device.PendingGlobalsMtx.lock();
-        if (Device.PendingCtorsDtors[desc].PendingCtors.empty()) {
+        if (TransTable && TransTable->Loaded[Device.DeviceID].Ready.load()) {
           for (auto &dtor : Device.PendingCtorsDtors[desc].PendingDtors) {
             int rc = target(Device.DeviceID, dtor, 0, NULL, NULL, NULL, NULL, 1,
                 1, true /*team*/);
@@ -1330,10 +2446,14 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
               DP("Running destructor " DPxMOD " failed.\n", DPxPTR(dtor));
             }
           }
-          // Remove this library's entry from PendingCtorsDtors
-          Device.PendingCtorsDtors.erase(desc);
         }
+        // Remove this library's entry from PendingCtorsDtors
+        Device.PendingCtorsDtors.erase(desc);
         Device.PendingGlobalsMtx.unlock();
+        // lld: the library's data and entry points are gone, drop what the
+        // pool and the launch cache kept of them
+        Device.releaseMemPool();
+        Device.clearLaunchCache();
       }
 
       DP("Unregistered image " DPxMOD " from RTL " DPxMOD "!\n",
@@ -1351,25 +2471,20 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
   RTLsMtx.unlock();
   DP("Done unregistering images!\n");
 
-  // Remove entries from HostPtrToTableMap
-  TblMapMtx.lock();
-  for (__tgt_offload_entry *cur = desc->HostEntriesBegin;
-      cur < desc->HostEntriesEnd; ++cur) {
-    HostPtrToTableMap.erase(cur->addr);
-  }
-
-  // Remove translation table for this descriptor.
+  // Remove translation table for this descriptor; its entries disappear from
+  // the next table map snapshot.
+  TrlTblMtx.lock();
   auto tt = HostEntriesBeginToTransTable.find(desc->HostEntriesBegin);
   if (tt != HostEntriesBeginToTransTable.end()) {
     DP("Removing translation table for descriptor " DPxMOD "\n",
         DPxPTR(desc->HostEntriesBegin));
     HostEntriesBeginToTransTable.erase(tt);
+    ++TableMapGeneration;
   } else {
     DP("Translation table for descriptor " DPxMOD " cannot be found, probably "
         "it has been already removed.\n", DPxPTR(desc->HostEntriesBegin));
   }
-
-  TblMapMtx.unlock();
+  TrlTblMtx.unlock();
 
   // TODO: Remove RTL and the devices it manages if it's not used anymore?
   // TODO: Write some RTL->unload_image(...) function?
@@ -1377,131 +2492,176 @@ EXTERN void __tgt_unregister_lib(__tgt_bin_desc *desc) {
   DP("Done unregistering library!\n");
 }
 
-/// Map global data and execute pending ctors
-static int InitLibrary(DeviceTy& Device) {
-  /*
-   * Map global data
-   */
+/// lld: load the image of a library on a device, map its global data and run
+/// its pending ctors. This happens when one of its entries is first launched
+/// or one of its globals is first mapped, not for every library on the first
+/// target region. Only the device's PendingGlobalsMtx is held while loading,
+/// so that devices load their images in parallel.
+static int InitImage(DeviceTy &Device, TranslationTable *TransTable) {
   int32_t device_id = Device.DeviceID;
-  int rc = OFFLOAD_SUCCESS;
+  TranslationTable::LoadedImageTy &Loaded = TransTable->Loaded[device_id];
 
   Device.PendingGlobalsMtx.lock();
+  if (Loaded.Ready.load(std::memory_order_acquire)) {
+    // Another thread got here first.
+    Device.PendingGlobalsMtx.unlock();
+    return OFFLOAD_SUCCESS;
+  }
+
+  // 1) get image.
   TrlTblMtx.lock();
-  for (HostEntriesBeginToTransTableTy::iterator
-      ii = HostEntriesBeginToTransTable.begin();
-      ii != HostEntriesBeginToTransTable.end(); ++ii) {
-    TranslationTable *TransTable = &ii->second;
-    if (TransTable->TargetsTable[device_id] != 0) {
-      // Library entries have already been processed
-      continue;
-    }
+  assert(TransTable->TargetsImages.size() > (size_t)device_id &&
+         "Not expecting a device ID outside the table's bounds!");
+  __tgt_device_image *img = TransTable->TargetsImages[device_id];
+  TrlTblMtx.unlock();
+  if (!img) {
+    DP("No image loaded for device id %d.\n", device_id);
+    Device.PendingGlobalsMtx.unlock();
+    return OFFLOAD_FAIL;
+  }
 
-    // 1) get image.
-    assert(TransTable->TargetsImages.size() > (size_t)device_id &&
-           "Not expecting a device ID outside the table's bounds!");
-    __tgt_device_image *img = TransTable->TargetsImages[device_id];
-    if (!img) {
-      DP("No image loaded for device id %d.\n", device_id);
-      rc = OFFLOAD_FAIL;
-      break;
-    }
-    // 2) load image into the target table.
-    __tgt_target_table *TargetTable =
-        TransTable->TargetsTable[device_id] = Device.load_binary(img);
-    // Unable to get table for this image: invalidate image and fail.
+  // 2) load image into the target table.
+  DP("Loading image " DPxMOD " on device %d.\n", DPxPTR(img->ImageStart),
+      device_id);
+  __tgt_target_table *TargetTable = Device.load_binary(img);
+  // Verify whether the two table sizes match.
+  size_t hsize =
+      TransTable->HostTable.EntriesEnd - TransTable->HostTable.EntriesBegin;
+  size_t tsize = TargetTable ?
+      TargetTable->EntriesEnd - TargetTable->EntriesBegin : 0;
+  // Unable to get table for this image or invalid image for these host
+  // entries: invalidate image and fail.
+  if (!TargetTable || hsize != tsize) {
     if (!TargetTable) {
       DP("Unable to generate entries table for device id %d.\n", device_id);
-      TransTable->TargetsImages[device_id] = 0;
-      rc = OFFLOAD_FAIL;
-      break;
-    }
-
-    // Verify whether the two table sizes match.
-    size_t hsize =
-        TransTable->HostTable.EntriesEnd - TransTable->HostTable.EntriesBegin;
-    size_t tsize = TargetTable->EntriesEnd - TargetTable->EntriesBegin;
-
-    // Invalid image for these host entries!
-    if (hsize != tsize) {
+    } else {
       DP("Host and Target tables mismatch for device id %d [%zx != %zx].\n",
          device_id, hsize, tsize);
-      TransTable->TargetsImages[device_id] = 0;
-      TransTable->TargetsTable[device_id] = 0;
-      rc = OFFLOAD_FAIL;
-      break;
     }
+    TrlTblMtx.lock();
+    TransTable->TargetsImages[device_id] = 0;
+    TrlTblMtx.unlock();
+    Device.PendingGlobalsMtx.unlock();
+    return OFFLOAD_FAIL;
+  }
 
-    // process global data that needs to be mapped.
-    Device.DataMapMtx.lock();
-    __tgt_target_table *HostTable = &TransTable->HostTable;
-    for (__tgt_offload_entry *CurrDeviceEntry = TargetTable->EntriesBegin,
-                             *CurrHostEntry = HostTable->EntriesBegin,
-                             *EntryDeviceEnd = TargetTable->EntriesEnd;
-         CurrDeviceEntry != EntryDeviceEnd;
-         CurrDeviceEntry++, CurrHostEntry++) {
-      if (CurrDeviceEntry->size != 0) {
-        // has data.
-        assert(CurrDeviceEntry->size == CurrHostEntry->size &&
-               "data size mismatch");
-
-        // Fortran may use multiple weak declarations for the same symbol,
-        // therefore we must allow for multiple weak symbols to be loaded from
-        // the fat binary. Treat these mappings as any other "regular" mapping.
-        // Add entry to map.
-        if (Device.getTgtPtrBegin(CurrHostEntry->addr, CurrHostEntry->size))
-          continue;
-        DP("Add mapping from host " DPxMOD " to device " DPxMOD " with size %zu"
-            "\n", DPxPTR(CurrHostEntry->addr), DPxPTR(CurrDeviceEntry->addr),
-            CurrDeviceEntry->size);
-        Device.HostDataToTargetMap.push_front(HostDataToTargetTy(
-            (uintptr_t)CurrHostEntry->addr /*HstPtrBase*/,
-            (uintptr_t)CurrHostEntry->addr /*HstPtrBegin*/,
-            (uintptr_t)CurrHostEntry->addr + CurrHostEntry->size /*HstPtrEnd*/,
-            (uintptr_t)CurrDeviceEntry->addr /*TgtPtrBegin*/,
-            INF_REF_CNT /*RefCount*/));
-      }
+  // The RTL reuses its table for the next image loaded on the device; keep
+  // a copy of the entries for this one.
+  Loaded.Entries.assign(TargetTable->EntriesBegin, TargetTable->EntriesEnd);
+  Loaded.Table.EntriesBegin = Loaded.Entries.data();
+  Loaded.Table.EntriesEnd = Loaded.Entries.data() + Loaded.Entries.size();
+  TargetTable = &Loaded.Table;
+  TrlTblMtx.lock();
+  TransTable->TargetsTable[device_id] = TargetTable;
+  TrlTblMtx.unlock();
+
+  // process global data that needs to be mapped.
+  Device.DataMapMtx.lock();
+  __tgt_target_table *HostTable = &TransTable->HostTable;
+  for (__tgt_offload_entry *CurrDeviceEntry = TargetTable->EntriesBegin,
+                           *CurrHostEntry = HostTable->EntriesBegin,
+                           *EntryDeviceEnd = TargetTable->EntriesEnd;
+       CurrDeviceEntry != EntryDeviceEnd;
+       CurrDeviceEntry++, CurrHostEntry++) {
+    if (CurrDeviceEntry->size != 0) {
+      // has data.
+      assert(CurrDeviceEntry->size == CurrHostEntry->size &&
+             "data size mismatch");
+
+      // Fortran may use multiple weak declarations for the same symbol,
+      // therefore we must allow for multiple weak symbols to be loaded from
+      // the fat binary. Treat these mappings as any other "regular" mapping.
+      // Add entry to map.
+      if (Device.getTgtPtrBegin(CurrHostEntry->addr, CurrHostEntry->size))
+        continue;
+      DP("Add mapping from host " DPxMOD " to device " DPxMOD " with size %zu"
+          "\n", DPxPTR(CurrHostEntry->addr), DPxPTR(CurrDeviceEntry->addr),
+          CurrDeviceEntry->size);
+      if (Device.HostDataToTargetMap.insert(HostDataToTargetTy(
+              (uintptr_t)CurrHostEntry->addr /*HstPtrBase*/,
+              (uintptr_t)CurrHostEntry->addr /*HstPtrBegin*/,
+              (uintptr_t)CurrHostEntry->addr + CurrHostEntry->size /*HstPtrEnd*/,
+              (uintptr_t)CurrDeviceEntry->addr /*TgtPtrBegin*/,
+              INF_REF_CNT /*RefCount*/)) == Device.HostDataToTargetMap.end())
+        DP("Another mapping starts at " DPxMOD ", global not mapped\n",
+            DPxPTR(CurrHostEntry->addr));
     }
-    Device.DataMapMtx.unlock();
-  }
-  TrlTblMtx.unlock();
-
-  if (rc != OFFLOAD_SUCCESS) {
-    Device.PendingGlobalsMtx.unlock();
-    return rc;
   }
+  Device.DataMapMtx.unlock();
 
   /*
-   * Run ctors for static objects
+   * Run ctors for static objects of this library, before any of its kernels.
+   * The table is not published yet, so they are launched directly.
    */
-  if (!Device.PendingCtorsDtors.empty()) {
-    // Call all ctors for all libraries registered so far
-    for (auto &lib : Device.PendingCtorsDtors) {
-      if (!lib.second.PendingCtors.empty()) {
-        DP("Has pending ctors... call now\n");
-        for (auto &entry : lib.second.PendingCtors) {
-          void *ctor = entry;
-          int rc = target(device_id, ctor, 0, NULL, NULL, NULL,
-                          NULL, 1, 1, true /*team*/);
-          if (rc != OFFLOAD_SUCCESS) {
-            DP("Running ctor " DPxMOD " failed.\n", DPxPTR(ctor));
-            Device.PendingGlobalsMtx.unlock();
-            return OFFLOAD_FAIL;
-          }
-        }
-        // Clear the list to indicate that this device has been used
-        lib.second.PendingCtors.clear();
-        DP("Done with pending ctors for lib " DPxMOD "\n", DPxPTR(lib.first));
+  for (auto &lib : Device.PendingCtorsDtors) {
+    if (lib.first->HostEntriesBegin != HostTable->EntriesBegin ||
+        lib.second.PendingCtors.empty())
+      continue;
+    DP("Has pending ctors... call now\n");
+    for (auto &ctor : lib.second.PendingCtors) {
+      int rc = OFFLOAD_FAIL;
+      for (__tgt_offload_entry *cur = HostTable->EntriesBegin;
+           cur < HostTable->EntriesEnd; ++cur) {
+        if (cur->addr != ctor)
+          continue;
+        __tgt_async_info AsyncInfo = {NULL};
+        rc = Device.run_team_region(
+            TargetTable->EntriesBegin[cur - HostTable->EntriesBegin].addr,
+            NULL, NULL, 0, 1, 1, 0, &AsyncInfo);
+        if (Device.synchronize(&AsyncInfo) != OFFLOAD_SUCCESS)
+          rc = OFFLOAD_FAIL;
+        break;
+      }
+      if (rc != OFFLOAD_SUCCESS) {
+        DP("Running ctor " DPxMOD " failed.\n", DPxPTR(ctor));
+        Device.PendingGlobalsMtx.unlock();
+        return OFFLOAD_FAIL;
       }
     }
+    // Clear the list to indicate that this device has been used
+    lib.second.PendingCtors.clear();
+    DP("Done with pending ctors for lib " DPxMOD "\n", DPxPTR(lib.first));
   }
-  Device.HasPendingGlobals = false;
+
+  Loaded.Ready.store(TargetTable, std::memory_order_release);
   Device.PendingGlobalsMtx.unlock();
 
   return OFFLOAD_SUCCESS;
 }
 
-// Check whether a device has been initialized, global ctors have been
-// executed and global data has been mapped; do so if not already done.
+/// lld: load the images owning any global data the arguments refer to, so
+/// that declare target variables are mapped before being used by a data
+/// construct or a region of another image.
+static int InitImagesForArgs(DeviceTy &Device, const TableMapSnapshotTy *Snap,
+    int32_t arg_num, void **args, int64_t *arg_sizes) {
+  if (Snap->Globals.empty())
+    return OFFLOAD_SUCCESS;
+  for (int32_t i = 0; i < arg_num; ++i) {
+    uintptr_t Begin = (uintptr_t)args[i];
+    uintptr_t End = Begin + (arg_sizes[i] > 0 ? arg_sizes[i] : 1);
+    // Globals do not overlap: those starting inside the argument, and the
+    // last one starting before it.
+    auto It = std::lower_bound(Snap->Globals.begin(), Snap->Globals.end(),
+        End, [](const TableMapSnapshotTy::GlobalTy &G, uintptr_t P) {
+          return G.Begin < P;
+        });
+    while (It != Snap->Globals.begin()) {
+      --It;
+      if (It->End <= Begin)
+        break;
+      if (!It->Table->Loaded[Device.DeviceID].Ready.load(
+              std::memory_order_acquire) &&
+          InitImage(Device, It->Table) != OFFLOAD_SUCCESS)
+        return OFFLOAD_FAIL;
+      if (It->Begin < Begin)
+        break;
+    }
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+// Check whether a device has been initialized. Images are loaded and their
+// global data mapped on demand, see InitImage.
 static int CheckDevice(int64_t device_id) {
   // Is device ready?
   if (!device_is_ready(device_id)) {
@@ -1509,18 +2669,6 @@ static int CheckDevice(int64_t device_id) {
     return OFFLOAD_FAIL;
   }
 
-  // Get device info.
-  DeviceTy &Device = Devices[device_id];
-
-  // Check whether global data has been mapped for this device
-  Device.PendingGlobalsMtx.lock();
-  bool hasPendingGlobals = Device.HasPendingGlobals;
-  Device.PendingGlobalsMtx.unlock();
-  if (hasPendingGlobals && InitLibrary(Device) != OFFLOAD_SUCCESS) {
-    DP("Failed to init globals on device %" PRId64 "\n", device_id);
-    return OFFLOAD_FAIL;
-  }
-
   return OFFLOAD_SUCCESS;
 }
 
@@ -1528,20 +2676,209 @@ static int member_of(int64_t type) {
   return ((type & OMP_TGT_MAPTYPE_MEMBER_OF) >> 48) - 1;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+/// Deferred execution of the nowait entry points.
+///
+/// The compiler wraps a nowait construct in an explicit task carrying its
+/// dependences, which libomp may run on any thread of the team while the
+/// encountering thread goes on. The offload runs inside that task and returns
+/// its status, so that a target region that cannot be offloaded falls back to
+/// the host.
+///
+/// A nowait data construct issued from an implicit task has no such task. It
+/// becomes a libomp proxy task carrying the dependences of the call. Once they
+/// are satisfied, the offload is queued to a host thread owned by libomptarget
+/// for its device, which completes the proxy task when the offload is done.
+/// The data entry points report no status, so nothing is lost by returning
+/// before the offload. Target regions issued from an implicit task run
+/// synchronously, as their caller needs the status to fall back to the host.
+/// Serialized teams do not count tasks that depend on a proxy task as
+/// children, so outside an active parallel region offloads stay synchronous.
+
+// Flags of a tied proxy task, see kmp_tasking_flags_t in libomp.
+static const int32_t PROXY_TASK_FLAGS = 0x11;
+
+/// Offloads to one device, run in order by a thread started on first use.
+class DeferredOffloadQueueTy {
+  typedef std::pair<std::function<void()> *, kmp_task_t *> JobTy;
+
+  std::mutex Mtx;
+  std::condition_variable Cond;
+  std::list<JobTy> Jobs;
+  bool WorkerStarted = false;
+
+  void run() {
+    while (true) {
+      std::unique_lock<std::mutex> Lock(Mtx);
+      Cond.wait(Lock, [this]() { return !Jobs.empty(); });
+      JobTy Job = Jobs.front();
+      Jobs.pop_front();
+      Lock.unlock();
+
+      (*Job.first)();
+      delete Job.first;
+      __kmpc_proxy_task_completed_ooo(Job.second);
+    }
+  }
+
+public:
+  void push(std::function<void()> *Job, kmp_task_t *Task) {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    Jobs.push_back(std::make_pair(Job, Task));
+    if (!WorkerStarted) {
+      std::thread(&DeferredOffloadQueueTy::run, this).detach();
+      WorkerStarted = true;
+    }
+    Cond.notify_one();
+  }
+};
+
+// Queue of each device id. Never destroyed: the worker threads may still wait
+// on them at exit.
+static std::mutex DeferredOffloadsMtx;
+static std::map<int64_t, DeferredOffloadQueueTy *> DeferredOffloads;
+
+static DeferredOffloadQueueTy *deferred_offload_queue(int64_t device_id) {
+  std::lock_guard<std::mutex> Lock(DeferredOffloadsMtx);
+  DeferredOffloadQueueTy *&Queue = DeferredOffloads[device_id];
+  if (!Queue)
+    Queue = new DeferredOffloadQueueTy();
+  return Queue;
+}
+
+/// Copy of the argument arrays of a deferred offload; the arrays passed by the
+/// compiler do not outlive the call.
+struct DeferredArgsTy {
+  std::vector<void *> ArgsBase;
+  std::vector<void *> Args;
+  std::vector<int64_t> ArgSizes;
+  std::vector<int64_t> ArgTypes;
+
+  DeferredArgsTy(int32_t arg_num, void **args_base, void **args,
+      int64_t *arg_sizes, int64_t *arg_types)
+      : ArgsBase(args_base, args_base + arg_num), Args(args, args + arg_num),
+        ArgSizes(arg_sizes, arg_sizes + arg_num),
+        ArgTypes(arg_types, arg_types + arg_num) {}
+};
+
+/// Shareds of a deferred offload's proxy task.
+struct DeferredOffloadTy {
+  DeferredOffloadQueueTy *Queue;
+  std::function<void()> *Job;
+};
+
+static int32_t run_deferred_offload(int32_t gtid, kmp_task_t *task) {
+  DeferredOffloadTy *D = (DeferredOffloadTy *)task->shareds;
+  D->Queue->push(D->Job, task);
+  return 0;
+}
+
+// Return the global thread id to defer a data offload from, or -1 if it has
+// to run synchronously.
+static int32_t deferring_gtid() {
+  if (!omp_in_parallel || !__kmpc_global_thread_num ||
+      !__kmpc_omp_task_alloc || !__kmpc_omp_task_with_deps ||
+      !__kmpc_proxy_task_completed_ooo || !__kmpc_omp_in_explicit_task)
+    return -1;
+
+  if (!omp_in_parallel())
+    return -1;
+
+  int32_t gtid = __kmpc_global_thread_num(NULL);
+  if (__kmpc_omp_in_explicit_task(gtid))
+    return -1;
+  return gtid;
+}
+
+/// Defer Job, a data offload to device_id, as a proxy task of gtid.
+static void defer_offload(int32_t gtid, int64_t device_id,
+    const std::function<void()> &Job, int32_t depNum, void *depList,
+    int32_t noAliasDepNum, void *noAliasDepList) {
+  if (device_id == OFFLOAD_DEVICE_DEFAULT)
+    device_id = omp_get_default_device();
+
+  kmp_task_t *Task = __kmpc_omp_task_alloc(NULL, gtid, PROXY_TASK_FLAGS,
+      sizeof(kmp_task_t), sizeof(DeferredOffloadTy), run_deferred_offload);
+  DeferredOffloadTy *D = (DeferredOffloadTy *)Task->shareds;
+  D->Queue = deferred_offload_queue(device_id);
+  D->Job = new std::function<void()>(Job);
+  DP("Deferring offload to device %" PRId64 " as proxy task " DPxMOD
+      " with %d dependences\n", device_id, DPxPTR(Task),
+      depNum + noAliasDepNum);
+  __kmpc_omp_task_with_deps(NULL, gtid, Task, depNum, depList, noAliasDepNum,
+      noAliasDepList);
+}
+
+// Wait for the dependences of a nowait offload run synchronously.
+static void wait_for_dependences(int32_t depNum, int32_t noAliasDepNum) {
+  if (depNum + noAliasDepNum > 0)
+    __kmpc_omp_taskwait(NULL, __kmpc_global_thread_num ?
+        __kmpc_global_thread_num(NULL) : 0);
+}
+
 // lld: replacement
 #include "replacement.h"
+// lld: out-of-core streaming
+#include "stream.h"
+
+/// lld: small host-to-device copies of one region, packed into a staging
+/// buffer and handed to the RTL in a single call when the region's copies
+/// are complete.
+struct SubmitBatchTy {
+  std::vector<char> Staging;
+  std::vector<void *> TgtPtrs;
+  std::vector<int64_t> Offsets;
+  std::vector<int64_t> Sizes;
+
+  // Pack the copy if the RTL takes batches and it is small enough; the
+  // caller submits it itself otherwise.
+  bool add(DeviceTy &Device, void *TgtPtrBegin, void *HstPtrBegin,
+      int64_t Size) {
+    if (!Device.RTL->data_submit_batch || Size > BatchLimit)
+      return false;
+    int64_t Offset = (Staging.size() + alignment - 1) & ~(alignment - 1);
+    Staging.resize(Offset + Size);
+    memcpy(&Staging[Offset], HstPtrBegin, Size);
+    TgtPtrs.push_back(TgtPtrBegin);
+    Offsets.push_back(Offset);
+    Sizes.push_back(Size);
+    return true;
+  }
+
+  int flush(DeviceTy &Device, __tgt_async_info *AsyncInfo) {
+    if (TgtPtrs.empty())
+      return OFFLOAD_SUCCESS;
+    std::vector<void *> HstPtrs(Offsets.size());
+    for (size_t i = 0; i < Offsets.size(); ++i)
+      HstPtrs[i] = &Staging[Offsets[i]];
+    int rt = Device.data_submit_batch(TgtPtrs.size(), TgtPtrs.data(),
+        HstPtrs.data(), Sizes.data(), AsyncInfo);
+    Staging.clear();
+    TgtPtrs.clear();
+    Offsets.clear();
+    Sizes.clear();
+    return rt;
+  }
+};
+
+// lld: host-side write tracking
+#include "writetrack.h"
 
 /// Internal function to do the mapping and transfer the data to the device
 static int target_data_begin(DeviceTy &Device, int32_t arg_num,
     //void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
     // lld: target data region or not
-    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types, void *host_ptr) {
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types, void *host_ptr,
+    __tgt_async_info *AsyncInfo = NULL) {
   // process each input.
   int rc = OFFLOAD_SUCCESS;
   // lld: decide data mapping
   auto TypeSize = target_uvm_data_mapping_opt(Device, args_base, args, arg_num, arg_sizes, arg_types, host_ptr);
   arg_types = TypeSize.first;
   arg_sizes = TypeSize.second;
+  // lld: small copies and pointer fix-ups go to the device in one batch
+  SubmitBatchTy Batch;
+  std::vector<std::pair<void *, ShadowPtrValTy>> NewShadows;
   for (int32_t i = 0; i < arg_num; ++i) {
     // Ignore private variables and arrays - there is no mapping for them.
     if ((arg_types[i] & OMP_TGT_MAPTYPE_LITERAL) ||
@@ -1587,6 +2924,8 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
       if (!Pointer_TgtPtrBegin) {
         DP("Call to getOrAllocTgtPtr returned null pointer (device failure or "
             "illegal mapping).\n");
+        rc = OFFLOAD_FAIL;
+        break;
       }
       DP("There are %zu bytes allocated at target address " DPxMOD " - is%s new"
           "\n", sizeof(void *), DPxPTR(Pointer_TgtPtrBegin),
@@ -1607,6 +2946,8 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
       // NULL, so getOrAlloc() returning NULL is not an error.
       DP("Call to getOrAllocTgtPtr returned null pointer (device failure or "
           "illegal mapping).\n");
+      rc = OFFLOAD_FAIL;
+      break;
     }
     DP("There are %" PRId64 " bytes allocated at target address " DPxMOD
         " - is%s new\n", data_size, DPxPTR(TgtPtrBegin),
@@ -1640,7 +2981,8 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
         // lld: uvm
         int rt = OFFLOAD_SUCCESS;
         if (TgtPtrBegin != HstPtrBegin)
-          rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, data_size);
+          rt = submitTracked(Device, i, TgtPtrBegin, HstPtrBegin, data_size,
+              &Batch, AsyncInfo);
         if (rt != OFFLOAD_SUCCESS) {
           DP("Copying data to device failed.\n");
           rc = OFFLOAD_FAIL;
@@ -1653,20 +2995,40 @@ static int target_data_begin(DeviceTy &Device, int32_t arg_num,
           DPxPTR(Pointer_TgtPtrBegin), DPxPTR(TgtPtrBegin));
       uint64_t Delta = (uint64_t)HstPtrBegin - (uint64_t)HstPtrBase;
       void *TgtPtrBase = (void *)((uint64_t)TgtPtrBegin - Delta);
-      int rt = Device.data_submit(Pointer_TgtPtrBegin, &TgtPtrBase,
-          sizeof(void *));
+      // The pointer is written from the stack and must land after the
+      // enclosing struct. A batch keeps its own copy and is applied in order
+      // after everything submitted before it; otherwise drain the queue and
+      // copy it synchronously.
+      int rt = OFFLOAD_SUCCESS;
+      profileBytes(i, sizeof(void *), true);
+      if (!Batch.add(Device, Pointer_TgtPtrBegin, &TgtPtrBase,
+              sizeof(void *))) {
+        rt = Device.synchronize(AsyncInfo);
+        if (rt == OFFLOAD_SUCCESS)
+          rt = Device.data_submit(Pointer_TgtPtrBegin, &TgtPtrBase,
+              sizeof(void *));
+      }
       if (rt != OFFLOAD_SUCCESS) {
         DP("Copying data to device failed.\n");
         rc = OFFLOAD_FAIL;
       }
       // create shadow pointers for this entry
-      Device.ShadowMtx.lock();
-      Device.ShadowPtrMap[Pointer_HstPtrBegin] = {HstPtrBase,
-          Pointer_TgtPtrBegin, TgtPtrBase};
-      Device.ShadowMtx.unlock();
+      ShadowPtrValTy Shadow = {HstPtrBase, Pointer_TgtPtrBegin, TgtPtrBase};
+      NewShadows.push_back(std::make_pair(Pointer_HstPtrBegin, Shadow));
     }
   }
 
+  if (Batch.flush(Device, AsyncInfo) != OFFLOAD_SUCCESS) {
+    DP("Copying data to device failed.\n");
+    rc = OFFLOAD_FAIL;
+  }
+  if (!NewShadows.empty()) {
+    Device.ShadowMtx.lock();
+    for (auto &NS : NewShadows)
+      Device.ShadowPtrMap[NS.first] = NS.second;
+    Device.ShadowMtx.unlock();
+  }
+
   // lld: uvm
   free(arg_types);
   free(arg_sizes);
@@ -1677,8 +3039,17 @@ EXTERN void __tgt_target_data_begin_nowait(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
     int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
-  if (depNum + noAliasDepNum > 0)
-    __kmpc_omp_taskwait(NULL, 0);
+  int32_t gtid = deferring_gtid();
+  if (gtid >= 0) {
+    DeferredArgsTy A(arg_num, args_base, args, arg_sizes, arg_types);
+    defer_offload(gtid, device_id, [=]() mutable {
+      __tgt_target_data_begin(device_id, arg_num, A.ArgsBase.data(),
+          A.Args.data(), A.ArgSizes.data(), A.ArgTypes.data());
+    }, depNum, depList, noAliasDepNum, noAliasDepList);
+    return;
+  }
+
+  wait_for_dependences(depNum, noAliasDepNum);
 
   __tgt_target_data_begin(device_id, arg_num, args_base, args, arg_sizes,
                           arg_types);
@@ -1691,6 +3062,8 @@ EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
   DP("Entering data begin region for device %" PRId64 " with %d mappings\n",
       device_id, arg_num);
+  ProfileScopeTy Prof(&ProfileDataBeginKey, arg_num, PROFILE_DATA_BEGIN);
+  Prof.setName("<target data begin>");
 
   // No devices available?
   if (device_id == OFFLOAD_DEVICE_DEFAULT) {
@@ -1704,6 +3077,8 @@ EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
   }
 
   DeviceTy& Device = Devices[device_id];
+  TraceRecorder.record(TRACE_DATA_BEGIN, device_id, NULL, Device.loopTripCnt,
+      arg_num, args_base, args, arg_sizes, arg_types);
 
 #ifdef OMPTARGET_DEBUG
   for (int i=0; i<arg_num; ++i) {
@@ -1713,15 +3088,80 @@ EXTERN void __tgt_target_data_begin(int64_t device_id, int32_t arg_num,
   }
 #endif
 
+  if (InitImagesForArgs(Device, getTableMapSnapshot(), arg_num, args,
+          arg_sizes) != OFFLOAD_SUCCESS) {
+    DP("Failed to load the images of global data on device %" PRId64 "\n",
+        device_id);
+    return;
+  }
+
   //target_data_begin(Device, arg_num, args_base, args, arg_sizes, arg_types);
   // lld: target data region or not
   target_data_begin(Device, arg_num, args_base, args, arg_sizes, arg_types, NULL);
 }
 
+/// Restore the shadowed host pointers of a section that was copied back to the
+/// host and release its mapping if it is the last reference.
+static int target_data_end_entry(DeviceTy &Device, void *HstPtrBegin,
+    int64_t data_size, bool IsFrom, bool DelEntry, bool ForceDelete) {
+  int rc = OFFLOAD_SUCCESS;
+
+  // If we copied back to the host a struct/array containing pointers, we
+  // need to restore the original host pointer values from their shadow
+  // copies. If the struct is going to be deallocated, remove any remaining
+  // shadow pointer entries for this struct.
+  uintptr_t ub = (uintptr_t) HstPtrBegin + data_size;
+  Device.ShadowMtx.lock();
+  // An STL map is sorted on its keys; visit only the entries of the section.
+  for (ShadowPtrListTy::iterator it =
+      Device.ShadowPtrMap.lower_bound(HstPtrBegin);
+      it != Device.ShadowPtrMap.end();) {
+    void **ShadowHstPtrAddr = (void**) it->first;
+    if ((uintptr_t) ShadowHstPtrAddr >= ub)
+      break;
+
+    // If we copied the struct to the host, we need to restore the pointer.
+    if (IsFrom) {
+      DP("Restoring original host pointer value " DPxMOD " for host "
+          "pointer " DPxMOD "\n", DPxPTR(it->second.HstPtrVal),
+          DPxPTR(ShadowHstPtrAddr));
+      *ShadowHstPtrAddr = it->second.HstPtrVal;
+    }
+    // If the struct is to be deallocated, remove the shadow entry.
+    if (DelEntry) {
+      DP("Removing shadow pointer " DPxMOD "\n", DPxPTR(ShadowHstPtrAddr));
+      it = Device.ShadowPtrMap.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  Device.ShadowMtx.unlock();
+
+  // Deallocate map
+  if (DelEntry) {
+    int rt = Device.deallocTgtPtr(HstPtrBegin, data_size, ForceDelete);
+    if (rt != OFFLOAD_SUCCESS) {
+      DP("Deallocating data from device failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+
+  return rc;
+}
+
 /// Internal function to undo the mapping and retrieve the data from the device.
+/// With AsyncInfo, copies back to the host are enqueued and the mappings are
+/// released after a single synchronization at the end.
 static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
-    void **args, int64_t *arg_sizes, int64_t *arg_types) {
+    void **args, int64_t *arg_sizes, int64_t *arg_types,
+    __tgt_async_info *AsyncInfo = NULL) {
   int rc = OFFLOAD_SUCCESS;
+  struct PendingEntryTy {
+    void *HstPtrBegin;
+    int64_t Size;
+    bool IsFrom, DelEntry, ForceDelete;
+  };
+  std::vector<PendingEntryTy> PendingEntries;
   // process each input.
   for (int32_t i = arg_num - 1; i >= 0; --i) {
     // Ignore private variables and arrays - there is no mapping for them.
@@ -1760,6 +3200,8 @@ static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
     DP("There are %" PRId64 " bytes allocated at target address " DPxMOD
         " - is%s last\n", data_size, DPxPTR(TgtPtrBegin),
         (IsLast ? "" : " not"));
+    if (!TgtPtrBegin)
+      continue; // not mapped, e.g. the device could not allocate it
 
     bool DelEntry = IsLast || ForceDelete;
 
@@ -1790,8 +3232,11 @@ static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
           //int rt = Device.data_retrieve(HstPtrBegin, TgtPtrBegin, data_size);
           // lld: uvm
           int rt = OFFLOAD_SUCCESS;
-          if (HstPtrBegin != TgtPtrBegin)
-            rt = Device.data_retrieve(HstPtrBegin, TgtPtrBegin, data_size);
+          if (HstPtrBegin != TgtPtrBegin) {
+            profileBytes(i, data_size, false);
+            rt = Device.data_retrieve(HstPtrBegin, TgtPtrBegin, data_size,
+                AsyncInfo);
+          }
           if (rt != OFFLOAD_SUCCESS) {
             DP("Copying data from device failed.\n");
             rc = OFFLOAD_FAIL;
@@ -1799,47 +3244,29 @@ static int target_data_end(DeviceTy &Device, int32_t arg_num, void **args_base,
         }
       }
 
-      // If we copied back to the host a struct/array containing pointers, we
-      // need to restore the original host pointer values from their shadow
-      // copies. If the struct is going to be deallocated, remove any remaining
-      // shadow pointer entries for this struct.
-      uintptr_t lb = (uintptr_t) HstPtrBegin;
-      uintptr_t ub = (uintptr_t) HstPtrBegin + data_size;
-      Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
-          it != Device.ShadowPtrMap.end(); ++it) {
-        void **ShadowHstPtrAddr = (void**) it->first;
-
-        // An STL map is sorted on its keys; use this property
-        // to quickly determine when to break out of the loop.
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
-        if ((uintptr_t) ShadowHstPtrAddr >= ub)
-          break;
-
-        // If we copied the struct to the host, we need to restore the pointer.
-        if (arg_types[i] & OMP_TGT_MAPTYPE_FROM) {
-          DP("Restoring original host pointer value " DPxMOD " for host "
-              "pointer " DPxMOD "\n", DPxPTR(it->second.HstPtrVal),
-              DPxPTR(ShadowHstPtrAddr));
-          *ShadowHstPtrAddr = it->second.HstPtrVal;
-        }
-        // If the struct is to be deallocated, remove the shadow entry.
-        if (DelEntry) {
-          DP("Removing shadow pointer " DPxMOD "\n", DPxPTR(ShadowHstPtrAddr));
-          Device.ShadowPtrMap.erase(it);
-        }
+      bool IsFrom = arg_types[i] & OMP_TGT_MAPTYPE_FROM;
+      if (AsyncInfo) {
+        PendingEntries.push_back(
+            {HstPtrBegin, data_size, IsFrom, DelEntry, ForceDelete});
+      } else if (target_data_end_entry(Device, HstPtrBegin, data_size, IsFrom,
+                                       DelEntry, ForceDelete) !=
+                 OFFLOAD_SUCCESS) {
+        rc = OFFLOAD_FAIL;
       }
-      Device.ShadowMtx.unlock();
+    }
+  }
 
-      // Deallocate map
-      if (DelEntry) {
-        int rt = Device.deallocTgtPtr(HstPtrBegin, data_size, ForceDelete);
-        if (rt != OFFLOAD_SUCCESS) {
-          DP("Deallocating data from device failed.\n");
-          rc = OFFLOAD_FAIL;
-        }
-      }
+  if (AsyncInfo) {
+    // The copies back to the host must land before host pointers are restored
+    // and device memory is released.
+    if (Device.synchronize(AsyncInfo) != OFFLOAD_SUCCESS) {
+      DP("Asynchronous operations on the device failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+    for (auto &E : PendingEntries) {
+      if (target_data_end_entry(Device, E.HstPtrBegin, E.Size, E.IsFrom,
+                                E.DelEntry, E.ForceDelete) != OFFLOAD_SUCCESS)
+        rc = OFFLOAD_FAIL;
     }
   }
 
@@ -1853,6 +3280,8 @@ EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
   DP("Entering data end region for device %" PRId64 " with %d mappings\n",
       device_id, arg_num);
+  ProfileScopeTy Prof(&ProfileDataEndKey, arg_num, PROFILE_DATA_END);
+  Prof.setName("<target data end>");
 
   // No devices available?
   if (device_id == OFFLOAD_DEVICE_DEFAULT) {
@@ -1872,6 +3301,8 @@ EXTERN void __tgt_target_data_end(int64_t device_id, int32_t arg_num,
     DP("uninit device: ignore");
     return;
   }
+  TraceRecorder.record(TRACE_DATA_END, device_id, NULL, Device.loopTripCnt,
+      arg_num, args_base, args, arg_sizes, arg_types);
 
 #ifdef OMPTARGET_DEBUG
   for (int i=0; i<arg_num; ++i) {
@@ -1888,31 +3319,29 @@ EXTERN void __tgt_target_data_end_nowait(int64_t device_id, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
     int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
-  if (depNum + noAliasDepNum > 0)
-    __kmpc_omp_taskwait(NULL, 0);
+  int32_t gtid = deferring_gtid();
+  if (gtid >= 0) {
+    DeferredArgsTy A(arg_num, args_base, args, arg_sizes, arg_types);
+    defer_offload(gtid, device_id, [=]() mutable {
+      __tgt_target_data_end(device_id, arg_num, A.ArgsBase.data(),
+          A.Args.data(), A.ArgSizes.data(), A.ArgTypes.data());
+    }, depNum, depList, noAliasDepNum, noAliasDepList);
+    return;
+  }
+
+  wait_for_dependences(depNum, noAliasDepNum);
 
   __tgt_target_data_end(device_id, arg_num, args_base, args, arg_sizes,
                         arg_types);
 }
 
-/// passes data to/from the target.
-EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
+/// Internal function to copy the sections of a target update construct.
+static int target_data_update(DeviceTy &Device, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
-  DP("Entering data update for device %" PRId64 " with %d mappings\n",
-      device_id, arg_num);
-
-  // No devices available?
-  if (device_id == OFFLOAD_DEVICE_DEFAULT) {
-    device_id = omp_get_default_device();
-  }
-
-  if (CheckDevice(device_id) != OFFLOAD_SUCCESS) {
-    DP("Failed to get device %" PRId64 " ready\n", device_id);
-    return;
-  }
-
-  DeviceTy& Device = Devices[device_id];
-
+  // Small copies to the device, the runs of changed pages of tracked entries
+  // among them, and the target pointers restored after them go in one batch,
+  // applied in order at the end.
+  SubmitBatchTy Batch;
   // process each input.
   for (int32_t i = 0; i < arg_num; ++i) {
     if ((arg_types[i] & OMP_TGT_MAPTYPE_LITERAL) ||
@@ -1924,23 +3353,29 @@ EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
     bool IsLast;
     void *TgtPtrBegin = Device.getTgtPtrBegin(HstPtrBegin, MapSize, IsLast,
         false);
+    if (!TgtPtrBegin) {
+      // E.g. the device could not allocate it.
+      DP("hst data:" DPxMOD " not found, becomes a noop\n",
+          DPxPTR(HstPtrBegin));
+      continue;
+    }
 
     if (arg_types[i] & OMP_TGT_MAPTYPE_FROM) {
       DP("Moving %" PRId64 " bytes (tgt:" DPxMOD ") -> (hst:" DPxMOD ")\n",
           arg_sizes[i], DPxPTR(TgtPtrBegin), DPxPTR(HstPtrBegin));
       //Device.data_retrieve(HstPtrBegin, TgtPtrBegin, MapSize);
       // lld: uvm
-      if (HstPtrBegin != TgtPtrBegin)
+      if (HstPtrBegin != TgtPtrBegin) {
+        profileBytes(i, MapSize, false);
         Device.data_retrieve(HstPtrBegin, TgtPtrBegin, MapSize);
+      }
 
-      uintptr_t lb = (uintptr_t) HstPtrBegin;
       uintptr_t ub = (uintptr_t) HstPtrBegin + MapSize;
       Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
+      for (ShadowPtrListTy::iterator it =
+          Device.ShadowPtrMap.lower_bound(HstPtrBegin);
           it != Device.ShadowPtrMap.end(); ++it) {
         void **ShadowHstPtrAddr = (void**) it->first;
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
         if ((uintptr_t) ShadowHstPtrAddr >= ub)
           break;
         DP("Restoring original host pointer value " DPxMOD " for host pointer "
@@ -1957,40 +3392,151 @@ EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
       //Device.data_submit(TgtPtrBegin, HstPtrBegin, MapSize);
       // lld: for unified memory
       if (TgtPtrBegin != HstPtrBegin)
-        Device.data_submit(TgtPtrBegin, HstPtrBegin, MapSize);
+        submitTracked(Device, i, TgtPtrBegin, HstPtrBegin, MapSize, &Batch,
+            NULL);
 
-      uintptr_t lb = (uintptr_t) HstPtrBegin;
       uintptr_t ub = (uintptr_t) HstPtrBegin + MapSize;
       Device.ShadowMtx.lock();
-      for (ShadowPtrListTy::iterator it = Device.ShadowPtrMap.begin();
+      for (ShadowPtrListTy::iterator it =
+          Device.ShadowPtrMap.lower_bound(HstPtrBegin);
           it != Device.ShadowPtrMap.end(); ++it) {
         void **ShadowHstPtrAddr = (void**) it->first;
-        if ((uintptr_t) ShadowHstPtrAddr < lb)
-          continue;
         if ((uintptr_t) ShadowHstPtrAddr >= ub)
           break;
         DP("Restoring original target pointer value " DPxMOD " for target "
             "pointer " DPxMOD "\n", DPxPTR(it->second.TgtPtrVal),
             DPxPTR(it->second.TgtPtrAddr));
-        Device.data_submit(it->second.TgtPtrAddr,
-            &it->second.TgtPtrVal, sizeof(void *));
+        profileBytes(i, sizeof(void *), true);
+        if (!Batch.add(Device, it->second.TgtPtrAddr, &it->second.TgtPtrVal,
+                sizeof(void *)))
+          Device.data_submit(it->second.TgtPtrAddr,
+              &it->second.TgtPtrVal, sizeof(void *));
       }
       Device.ShadowMtx.unlock();
     }
   }
+
+  if (Batch.flush(Device, NULL) != OFFLOAD_SUCCESS) {
+    DP("Copying data to device failed.\n");
+    return OFFLOAD_FAIL;
+  }
+  return OFFLOAD_SUCCESS;
+}
+
+/// passes data to/from the target.
+EXTERN void __tgt_target_data_update(int64_t device_id, int32_t arg_num,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types) {
+  DP("Entering data update for device %" PRId64 " with %d mappings\n",
+      device_id, arg_num);
+  ProfileScopeTy Prof(&ProfileUpdateKey, arg_num, PROFILE_UPDATE);
+  Prof.setName("<target update>");
+
+  // No devices available?
+  if (device_id == OFFLOAD_DEVICE_DEFAULT) {
+    device_id = omp_get_default_device();
+  }
+
+  if (CheckDevice(device_id) != OFFLOAD_SUCCESS) {
+    DP("Failed to get device %" PRId64 " ready\n", device_id);
+    return;
+  }
+
+  DeviceTy& Device = Devices[device_id];
+  TraceRecorder.record(TRACE_UPDATE, device_id, NULL, Device.loopTripCnt,
+      arg_num, args_base, args, arg_sizes, arg_types);
+
+  if (InitImagesForArgs(Device, getTableMapSnapshot(), arg_num, args,
+          arg_sizes) != OFFLOAD_SUCCESS) {
+    DP("Failed to load the images of global data on device %" PRId64 "\n",
+        device_id);
+    return;
+  }
+
+  target_data_update(Device, arg_num, args_base, args, arg_sizes,
+      arg_types);
 }
 
 EXTERN void __tgt_target_data_update_nowait(
     int64_t device_id, int32_t arg_num, void **args_base, void **args,
     int64_t *arg_sizes, int64_t *arg_types, int32_t depNum, void *depList,
     int32_t noAliasDepNum, void *noAliasDepList) {
-  if (depNum + noAliasDepNum > 0)
-    __kmpc_omp_taskwait(NULL, 0);
+  int32_t gtid = deferring_gtid();
+  if (gtid >= 0) {
+    DeferredArgsTy A(arg_num, args_base, args, arg_sizes, arg_types);
+    defer_offload(gtid, device_id, [=]() mutable {
+      __tgt_target_data_update(device_id, arg_num, A.ArgsBase.data(),
+          A.Args.data(), A.ArgSizes.data(), A.ArgTypes.data());
+    }, depNum, depList, noAliasDepNum, noAliasDepList);
+    return;
+  }
+
+  wait_for_dependences(depNum, noAliasDepNum);
 
   __tgt_target_data_update(device_id, arg_num, args_base, args, arg_sizes,
                            arg_types);
 }
 
+/// lld: launch a region with the arguments found by DeviceTy::lookupLaunch,
+/// then drop the references it took. Only an entry whose last other reference
+/// went away meanwhile needs the full target_data_end treatment.
+static int target_cached(DeviceTy &Device, const LaunchCacheEntryTy &Launch,
+    void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
+    int32_t team_num, int32_t thread_limit, int IsTeamConstruct,
+    ProfileScopeTy &Prof) {
+  __tgt_async_info AsyncInfo = {NULL};
+  Prof.setName(Launch.Name);
+  Prof.phase(PROFILE_KERNEL);
+  void **TgtArgs = const_cast<void **>(Launch.TgtArgs.data());
+  ptrdiff_t *TgtOffsets = const_cast<ptrdiff_t *>(Launch.TgtOffsets.data());
+
+  // Pop loop trip count
+  uint64_t ltc = Device.loopTripCnt;
+  Device.loopTripCnt = 0;
+
+  DP("Launching target execution %s with pointer " DPxMOD " from the launch "
+      "cache.\n", Launch.Name, DPxPTR(Launch.TgtEntryPtr));
+  invalidateRegionWrites(Device, Launch.Args.size(), args, arg_sizes,
+      arg_types);
+  int rc;
+  if (IsTeamConstruct) {
+    rc = Device.run_team_region(Launch.TgtEntryPtr, TgtArgs, TgtOffsets,
+        Launch.TgtArgs.size(), team_num, thread_limit, ltc, &AsyncInfo);
+  } else {
+    rc = Device.run_region(Launch.TgtEntryPtr, TgtArgs, TgtOffsets,
+        Launch.TgtArgs.size(), &AsyncInfo);
+  }
+  if (Device.synchronize(&AsyncInfo) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  Prof.phase(PROFILE_DATA_END);
+
+  std::vector<int32_t> LastRefs;
+  Device.DataMapMtx.lock_shared();
+  if (Launch.Generation != Device.MapGeneration) {
+    LastRefs = Launch.EntryArgs;
+  } else {
+    for (size_t k = 0; k < Launch.Entries.size(); ++k) {
+      auto &RefCount = Launch.Entries[k]->RefCount;
+      long RC = RefCount.load();
+      while (RC > 1 && !RefCount.compare_exchange_weak(RC, RC - 1))
+        ;
+      if (RC <= 1)
+        LastRefs.push_back(Launch.EntryArgs[k]);
+    }
+  }
+  Device.DataMapMtx.unlock_shared();
+
+  for (int32_t i : LastRefs) {
+    Prof.ArgOffset = i;
+    int rt = target_data_end(Device, 1, &args_base[i], &args[i], &arg_sizes[i],
+        &arg_types[i]);
+    if (rt != OFFLOAD_SUCCESS) {
+      DP("Call to target_data_end failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+  return rc;
+}
+
 /// performs the same actions as data_begin in case arg_num is
 /// non-zero and initiates run of the offloaded region on the target platform;
 /// if arg_num is non-zero after the region execution is done it also
@@ -2001,42 +3547,23 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
     void **args_base, void **args, int64_t *arg_sizes, int64_t *arg_types,
     int32_t team_num, int32_t thread_limit, int IsTeamConstruct) {
   DeviceTy &Device = Devices[device_id];
+  ProfileScopeTy Prof(host_ptr, arg_num, PROFILE_DATA_BEGIN);
+  TraceRecorder.record(TRACE_TARGET, device_id, host_ptr, Device.loopTripCnt,
+      arg_num, args_base, args, arg_sizes, arg_types);
 
-  // Find the table information in the map or look it up in the translation
-  // tables.
-  TableMap *TM = 0;
-  TblMapMtx.lock();
-  HostPtrToTableMapTy::iterator TableMapIt = HostPtrToTableMap.find(host_ptr);
-  if (TableMapIt == HostPtrToTableMap.end()) {
-    // We don't have a map. So search all the registered libraries.
-    TrlTblMtx.lock();
-    for (HostEntriesBeginToTransTableTy::iterator
-             ii = HostEntriesBeginToTransTable.begin(),
-             ie = HostEntriesBeginToTransTable.end();
-         !TM && ii != ie; ++ii) {
-      // get the translation table (which contains all the good info).
-      TranslationTable *TransTable = &ii->second;
-      // iterate over all the host table entries to see if we can locate the
-      // host_ptr.
-      __tgt_offload_entry *begin = TransTable->HostTable.EntriesBegin;
-      __tgt_offload_entry *end = TransTable->HostTable.EntriesEnd;
-      __tgt_offload_entry *cur = begin;
-      for (uint32_t i = 0; cur < end; ++cur, ++i) {
-        if (cur->addr != host_ptr)
-          continue;
-        // we got a match, now fill the HostPtrToTableMap so that we
-        // may avoid this search next time.
-        TM = &HostPtrToTableMap[host_ptr];
-        TM->Table = TransTable;
-        TM->Index = i;
-        break;
-      }
-    }
-    TrlTblMtx.unlock();
-  } else {
-    TM = &TableMapIt->second;
+  // lld: a launch repeated with the same arguments while the mappings did not
+  // change reuses what was resolved for it last time.
+  if (LaunchCacheEnabled) {
+    std::shared_ptr<LaunchCacheEntryTy> Launch = Device.lookupLaunch(host_ptr,
+        arg_num, args_base, args, arg_sizes, arg_types);
+    if (Launch)
+      return target_cached(Device, *Launch, args_base, args, arg_sizes,
+          arg_types, team_num, thread_limit, IsTeamConstruct, Prof);
   }
-  TblMapMtx.unlock();
+
+  // Find the table information in the table map snapshot.
+  const TableMapSnapshotTy *Snapshot = getTableMapSnapshot();
+  const TableMap *TM = Snapshot->find(host_ptr);
 
   // No map for this host pointer found!
   if (!TM) {
@@ -2045,25 +3572,46 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
     return OFFLOAD_FAIL;
   }
 
-  // get target table.
-  TrlTblMtx.lock();
-  assert(TM->Table->TargetsTable.size() > (size_t)device_id &&
-         "Not expecting a device ID outside the table's bounds!");
-  __tgt_target_table *TargetTable = TM->Table->TargetsTable[device_id];
-  TrlTblMtx.unlock();
-  assert(TargetTable && "Global data has not been mapped\n");
+  // get target table, loading the image on the first launch of one of its
+  // entries.
+  __tgt_target_table *TargetTable =
+      TM->Table->Loaded[device_id].Ready.load(std::memory_order_acquire);
+  if (!TargetTable) {
+    if (InitImage(Device, TM->Table) != OFFLOAD_SUCCESS) {
+      DP("Failed to load the image of entry " DPxMOD " on device %" PRId64
+          "\n", DPxPTR(host_ptr), device_id);
+      return OFFLOAD_FAIL;
+    }
+    TargetTable = TM->Table->Loaded[device_id].Ready.load();
+  }
+  Prof.setName(TargetTable->EntriesBegin[TM->Index].name);
+  if (InitImagesForArgs(Device, Snapshot, arg_num, args, arg_sizes) !=
+      OFFLOAD_SUCCESS)
+    return OFFLOAD_FAIL;
+
+  // lld: a region too large for the device may run tile by tile, see
+  // stream.h; its streamed arrays are then left out of the mappings.
+  StreamPlanTy Stream;
+  bool Streamed = planStream(Device, arg_num, args_base, args, arg_sizes,
+      arg_types, Stream);
+  int64_t *map_types = Streamed ? Stream.ArgTypes.data() : arg_types;
+
+  // Copies and the launch are enqueued if the RTL supports it; the queue is
+  // synchronized once, when the data is moved back in target_data_end.
+  __tgt_async_info AsyncInfo = {NULL};
 
   // Move data to device.
   int rc = target_data_begin(Device, arg_num, args_base, args, arg_sizes,
       //arg_types);
       // lld: target data region or not
-      arg_types, host_ptr);
+      map_types, host_ptr, &AsyncInfo);
 
   if (rc != OFFLOAD_SUCCESS) {
     DP("Call to target_data_begin failed, skipping target execution.\n");
     // Call target_data_end to dealloc whatever target_data_begin allocated
     // and return OFFLOAD_FAIL.
-    target_data_end(Device, arg_num, args_base, args, arg_sizes, arg_types);
+    target_data_end(Device, arg_num, args_base, args, arg_sizes, map_types,
+        &AsyncInfo);
     return OFFLOAD_FAIL;
   }
 
@@ -2072,6 +3620,8 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
 
   // List of (first-)private arrays allocated for this target region
   std::vector<void *> fpArrays;
+  // lld: small first-private arrays go to the device in one batch
+  SubmitBatchTy fpBatch;
 
   for (int32_t i = 0; i < arg_num; ++i) {
     if (!(arg_types[i] & OMP_TGT_MAPTYPE_TARGET_PARAM)) {
@@ -2090,8 +3640,7 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
       TgtBaseOffset = 0;
     } else if (arg_types[i] & OMP_TGT_MAPTYPE_PRIVATE) {
       // Allocate memory for (first-)private array
-      TgtPtrBegin = Device.RTL->data_alloc(Device.RTLDeviceID,
-          arg_sizes[i], HstPtrBegin);
+      TgtPtrBegin = Device.data_alloc(arg_sizes[i], HstPtrBegin);
       if (!TgtPtrBegin) {
         DP ("Data allocation for %sprivate array " DPxMOD " failed\n",
             (arg_types[i] & OMP_TGT_MAPTYPE_TO ? "first-" : ""),
@@ -2112,7 +3661,11 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
         // If first-private, copy data from host
         if (arg_types[i] & OMP_TGT_MAPTYPE_TO) {
           // lld: this is required for private
-          int rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, arg_sizes[i]);
+          int rt = OFFLOAD_SUCCESS;
+          profileBytes(i, arg_sizes[i], true);
+          if (!fpBatch.add(Device, TgtPtrBegin, HstPtrBegin, arg_sizes[i]))
+            rt = Device.data_submit(TgtPtrBegin, HstPtrBegin, arg_sizes[i],
+                &AsyncInfo);
           if (rt != OFFLOAD_SUCCESS) {
             DP ("Copying data to device failed.\n");
             rc = OFFLOAD_FAIL;
@@ -2144,47 +3697,79 @@ static int target(int64_t device_id, void *host_ptr, int32_t arg_num,
   assert(tgt_args.size() == tgt_offsets.size() &&
       "Size mismatch in arguments and offsets");
 
+  if (fpBatch.flush(Device, &AsyncInfo) != OFFLOAD_SUCCESS) {
+    DP ("Copying data to device failed.\n");
+    rc = OFFLOAD_FAIL;
+  }
+  invalidateRegionWrites(Device, arg_num, args, arg_sizes, map_types);
+
   // Pop loop trip count
   uint64_t ltc = Device.loopTripCnt;
   Device.loopTripCnt = 0;
 
+  // lld: when profiling, queued work is waited for at each phase change so
+  // that it is charged to its own phase.
+  if (Prof.active() && Device.synchronize(&AsyncInfo) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  Prof.phase(PROFILE_KERNEL);
+
   // Launch device execution.
-  if (rc == OFFLOAD_SUCCESS) {
+  if (rc == OFFLOAD_SUCCESS && Streamed) {
+    DP("Launching target execution %s with pointer " DPxMOD " per tile.\n",
+        TargetTable->EntriesBegin[TM->Index].name,
+        DPxPTR(TargetTable->EntriesBegin[TM->Index].addr));
+    rc = target_stream(Device, Stream,
+        TargetTable->EntriesBegin[TM->Index].addr, tgt_args, tgt_offsets,
+        args_base, args, arg_types, team_num, thread_limit, ltc,
+        IsTeamConstruct, &AsyncInfo, Prof);
+  } else if (rc == OFFLOAD_SUCCESS) {
     DP("Launching target execution %s with pointer " DPxMOD " (index=%d).\n",
         TargetTable->EntriesBegin[TM->Index].name,
         DPxPTR(TargetTable->EntriesBegin[TM->Index].addr), TM->Index);
     if (IsTeamConstruct) {
       rc = Device.run_team_region(TargetTable->EntriesBegin[TM->Index].addr,
           &tgt_args[0], &tgt_offsets[0], tgt_args.size(), team_num,
-          thread_limit, ltc);
+          thread_limit, ltc, &AsyncInfo);
     } else {
       rc = Device.run_region(TargetTable->EntriesBegin[TM->Index].addr,
-          &tgt_args[0], &tgt_offsets[0], tgt_args.size());
+          &tgt_args[0], &tgt_offsets[0], tgt_args.size(), &AsyncInfo);
     }
+    // lld: move what the next regions need while this one runs
+    if (rc == OFFLOAD_SUCCESS)
+      Device.prefetchAhead();
   } else {
     DP("Errors occurred while obtaining target arguments, skipping kernel "
         "execution\n");
   }
 
-  // Deallocate (first-)private arrays
-  for (auto it : fpArrays) {
-    // lld: no need for modification since data is always allocated for private
-    int rt = Device.RTL->data_delete(Device.RTLDeviceID, it);
-    if (rt != OFFLOAD_SUCCESS) {
-      DP("Deallocation of (first-)private arrays failed.\n");
-      rc = OFFLOAD_FAIL;
-    }
-  }
+  if (Prof.active() && Device.synchronize(&AsyncInfo) != OFFLOAD_SUCCESS)
+    rc = OFFLOAD_FAIL;
+  Prof.phase(PROFILE_DATA_END);
 
   // Move data from device.
   int rt = target_data_end(Device, arg_num, args_base, args, arg_sizes,
-      arg_types);
+      map_types, &AsyncInfo);
 
   if (rt != OFFLOAD_SUCCESS) {
     DP("Call to target_data_end failed.\n");
     rc = OFFLOAD_FAIL;
   }
 
+  // Deallocate (first-)private arrays once the region is done with them.
+  for (auto it : fpArrays) {
+    // lld: no need for modification since data is always allocated for private
+    int rt = Device.data_delete(it);
+    if (rt != OFFLOAD_SUCCESS) {
+      DP("Deallocation of (first-)private arrays failed.\n");
+      rc = OFFLOAD_FAIL;
+    }
+  }
+
+  if (rc == OFFLOAD_SUCCESS && LaunchCacheEnabled && !Streamed)
+    Device.cacheLaunch(host_ptr, arg_num, args_base, args, arg_sizes,
+        arg_types, TargetTable->EntriesBegin[TM->Index].addr,
+        TargetTable->EntriesBegin[TM->Index].name);
+
   return rc;
 }
 
@@ -2220,8 +3805,7 @@ EXTERN int __tgt_target_nowait(int64_t device_id, void *host_ptr,
     int32_t arg_num, void **args_base, void **args, int64_t *arg_sizes,
     int64_t *arg_types, int32_t depNum, void *depList, int32_t noAliasDepNum,
     void *noAliasDepList) {
-  if (depNum + noAliasDepNum > 0)
-    __kmpc_omp_taskwait(NULL, 0);
+  wait_for_dependences(depNum, noAliasDepNum);
 
   return __tgt_target(device_id, host_ptr, arg_num, args_base, args, arg_sizes,
                       arg_types);
@@ -2260,8 +3844,7 @@ EXTERN int __tgt_target_teams_nowait(int64_t device_id, void *host_ptr,
     int32_t arg_num, void **args_base, void **args, int64_t *arg_sizes,
     int64_t *arg_types, int32_t team_num, int32_t thread_limit, int32_t depNum,
     void *depList, int32_t noAliasDepNum, void *noAliasDepList) {
-  if (depNum + noAliasDepNum > 0)
-    __kmpc_omp_taskwait(NULL, 0);
+  wait_for_dependences(depNum, noAliasDepNum);
 
   return __tgt_target_teams(device_id, host_ptr, arg_num, args_base, args,
                             arg_sizes, arg_types, team_num, thread_limit);
@@ -2285,6 +3868,148 @@ EXTERN void __kmpc_push_target_tripcount(int64_t device_id,
   Devices[device_id].loopTripCnt = loop_tripcount;
 }
 
+#ifdef OMPTARGET_REPLAY
+/// lld: replay a trace recorded with LLD_RECORD through target_data_begin,
+/// target_data_end and target_data_update on simulated devices, one per
+/// device id of the trace, which take the policy knobs of the arguments. The
+/// global time stamp is swapped for the replay, which must not overlap with
+/// offloading in this process.
+EXTERN int __tgt_replay_trace(const char *path, int32_t mode,
+    int64_t dev_size, int32_t partial_map, int32_t recycle, int32_t prefetch,
+    __tgt_replay_stats *stats) {
+  static std::mutex ReplayMtx;
+  std::lock_guard<std::mutex> LG(ReplayMtx);
+
+  memset(stats, 0, sizeof(*stats));
+  TraceReaderTy Reader;
+  if (!Reader.open(path)) {
+    DP("Cannot read a trace from %s\n", path);
+    return OFFLOAD_FAIL;
+  }
+
+  uint64_t SavedTimeStamp = GlobalTimeStamp;
+  GlobalTimeStamp = 0;
+
+  ReplayStats = stats;
+  ReplayAllocs.clear();
+  ReplayNextPtr = ReplayDeviceBase;
+  ReplayLiveBytes = 0;
+
+  RTLInfoTy SimRTL;
+  SimRTL.init_device = replay_init_device;
+  SimRTL.data_opt = replay_data_opt;
+  SimRTL.data_alloc = replay_data_alloc;
+  SimRTL.data_submit = replay_data_submit;
+  SimRTL.data_retrieve = replay_data_retrieve;
+  SimRTL.data_delete = replay_data_delete;
+  std::map<int32_t, std::unique_ptr<DeviceTy>> SimDevices;
+
+  TraceEventTy E;
+  std::vector<TraceArgTy> A;
+  std::vector<void *> ArgsBase, Args;
+  std::vector<int64_t> ArgSizes, ArgTypes;
+  while (Reader.next(E, A)) {
+    std::unique_ptr<DeviceTy> &D = SimDevices[E.DeviceId];
+    if (!D) {
+      D.reset(new DeviceTy(&SimRTL));
+      D->DeviceID = E.DeviceId;
+      D->RTLDeviceID = E.DeviceId;
+      D->devMemRatio = 1.0;
+      D->initOnce();
+      D->GMode = mode;
+      D->RPolicy = 0;
+      D->RecycleMem = recycle;
+      D->PartialMap = partial_map != 0;
+      D->PrefetchDist = std::max(prefetch, 0);
+      // The host pages of the trace are not ours to protect.
+      D->WriteTrackMin = 0;
+      D->setMemCapacity(dev_size);
+    }
+    DeviceTy &Device = *D;
+    ++stats->Events;
+
+    int32_t ArgNum = A.size();
+    ArgsBase.resize(ArgNum);
+    Args.resize(ArgNum);
+    ArgSizes.resize(ArgNum);
+    ArgTypes.resize(ArgNum);
+    for (int32_t i = 0; i < ArgNum; ++i) {
+      ArgsBase[i] = (void *)(uintptr_t)A[i].Base;
+      Args[i] = (void *)(uintptr_t)A[i].Begin;
+      ArgSizes[i] = A[i].Size;
+      ArgTypes[i] = A[i].Type;
+      // The pointer of a PTR_AND_OBJ entry lives in host memory of the
+      // recording process; the pointee is replayed as a section of its own.
+      if (ArgTypes[i] & OMP_TGT_MAPTYPE_PTR_AND_OBJ)
+        ArgTypes[i] &= ~(OMP_TGT_MAPTYPE_PTR_AND_OBJ |
+            OMP_TGT_MAPTYPE_MEMBER_OF);
+    }
+
+    Device.loopTripCnt = E.TripCount;
+    switch (E.Kind) {
+    case TRACE_DATA_BEGIN:
+      target_data_begin(Device, ArgNum, ArgsBase.data(), Args.data(),
+          ArgSizes.data(), ArgTypes.data(), NULL);
+      break;
+    case TRACE_DATA_END:
+      target_data_end(Device, ArgNum, ArgsBase.data(), Args.data(),
+          ArgSizes.data(), ArgTypes.data());
+      break;
+    case TRACE_UPDATE:
+      target_data_update(Device, ArgNum, ArgsBase.data(), Args.data(),
+          ArgSizes.data(), ArgTypes.data());
+      break;
+    case TRACE_TARGET:
+      // A region hits on the bytes placed in device memory before it starts.
+      Device.DataMapMtx.lock_shared();
+      for (int32_t i = 0; i < ArgNum; ++i) {
+        if ((ArgTypes[i] & OMP_TGT_MAPTYPE_LITERAL) ||
+            (ArgTypes[i] & OMP_TGT_MAPTYPE_PRIVATE))
+          continue;
+        stats->AccessedBytes += ArgSizes[i];
+        LookupResult lr = Device.lookupMapping(Args[i], ArgSizes[i]);
+        if (!lr.Flags.IsContained || !lr.Entry->Decided)
+          continue;
+        mem_map_type Map = getMemMapType(lr.Entry->MapType);
+        if (Map == MEM_MAPTYPE_DEV || Map == MEM_MAPTYPE_SDEV)
+          stats->ResidentBytes += ArgSizes[i];
+        else if (Map == MEM_MAPTYPE_PART)
+          stats->ResidentBytes += std::min(ArgSizes[i], lr.Entry->DevSize);
+      }
+      Device.DataMapMtx.unlock_shared();
+      target_data_begin(Device, ArgNum, ArgsBase.data(), Args.data(),
+          ArgSizes.data(), ArgTypes.data(), (void *)(uintptr_t)E.HostPtr);
+      Device.loopTripCnt = 0;
+      Device.prefetchAhead();
+      target_data_end(Device, ArgNum, ArgsBase.data(), Args.data(),
+          ArgSizes.data(), ArgTypes.data());
+      break;
+    default:
+      DP("Unknown trace event %u\n", E.Kind);
+      break;
+    }
+  }
+
+  for (auto &D : SimDevices) {
+    // Prefetches still unused when the trace ends were of no use either.
+    for (auto &HT : D.second->HostDataToTargetMap)
+      if (HT.Prefetched)
+        ++D.second->prefetchUseless;
+    stats->Evictions += D.second->evictions;
+    stats->Prefetches += D.second->prefetches;
+    stats->PrefetchHits += D.second->prefetchHits;
+    stats->PrefetchLate += D.second->prefetchLate;
+    stats->PrefetchUseless += D.second->prefetchUseless;
+    D.second->releaseMemPool();
+  }
+  SimDevices.clear();
+  ReplayStats = NULL;
+
+  GlobalTimeStamp = SavedTimeStamp;
+  return Reader.truncated() ? OFFLOAD_FAIL : OFFLOAD_SUCCESS;
+}
+#endif // OMPTARGET_REPLAY
+
 ////////////////////////////////////////////////////////////////////////////////
 // temporary for debugging (matching the ones in omptarget-nvptx)
 
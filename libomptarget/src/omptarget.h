@@ -18,6 +18,8 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "lld_replay.h"
+
 // lld: debug print
 //#define LLD_DEBUG
 //#define LLD_VERBOSE
@@ -85,6 +87,10 @@ enum tgt_map_type {
   OMP_TGT_MAPTYPE_SDEV            = 0x200000000,
   // lld: partial map
   OMP_TGT_MAPTYPE_PART            = 0x400000000,
+  // lld: streamed array, or extent of the streamed loop on a literal
+  OMP_TGT_MAPTYPE_STREAM          = 0x800000000,
+  // lld: elements around its own a streamed iteration reads
+  OMP_TGT_MAPTYPE_HALO            = 0xf000000000,
   // lld: reuse distance
   OMP_TGT_MAPTYPE_DIST            = 0x3f0000000000,
   // member of struct, member given by 4 MSBs - 1
@@ -132,14 +138,43 @@ struct __tgt_target_table {
       *EntriesEnd; // End of the table with all the entries (non inclusive)
 };
 
+/// This struct identifies the queue on which a plugin runs the asynchronous
+/// operations issued by one host thread. The plugin fills in the queue on the
+/// first asynchronous call and may take it back when it is synchronized;
+/// libomptarget only passes it around.
+struct __tgt_async_info {
+  void *Queue; // Opaque plugin queue, NULL until first used
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 // Implemented in libomp, they are called from within __tgt_* functions.
 int omp_get_default_device(void) __attribute__((weak));
+int omp_in_parallel(void) __attribute__((weak));
 int32_t __kmpc_omp_taskwait(void *loc_ref, int32_t gtid) __attribute__((weak));
 
+// kmp_task_t of libomp as the compiler lays it out for its tasks; proxy tasks
+// deferring nowait offloads only use shareds.
+typedef struct kmp_task {
+  void *shareds;
+  int32_t (*routine)(int32_t, struct kmp_task *);
+  int32_t part_id;
+  void *data1;
+  void *data2;
+} kmp_task_t;
+
+int32_t __kmpc_global_thread_num(void *loc_ref) __attribute__((weak));
+kmp_task_t *__kmpc_omp_task_alloc(void *loc_ref, int32_t gtid, int32_t flags,
+    size_t sizeof_kmp_task_t, size_t sizeof_shareds,
+    int32_t (*task_entry)(int32_t, kmp_task_t *)) __attribute__((weak));
+int32_t __kmpc_omp_task_with_deps(void *loc_ref, int32_t gtid,
+    kmp_task_t *new_task, int32_t ndeps, void *dep_list, int32_t ndeps_noalias,
+    void *noalias_dep_list) __attribute__((weak));
+void __kmpc_proxy_task_completed_ooo(kmp_task_t *ptask) __attribute__((weak));
+int32_t __kmpc_omp_in_explicit_task(int32_t gtid) __attribute__((weak));
+
 int omp_get_num_devices(void);
 int omp_get_initial_device(void);
 void *omp_target_alloc(size_t size, int device_num);
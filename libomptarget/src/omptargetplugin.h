@@ -88,6 +88,77 @@ int32_t __tgt_rtl_run_target_team_region(int32_t ID, void *Entry, void **Args,
                                          int32_t NumTeams, int32_t ThreadLimit,
                                          uint64_t loop_tripcount);
 
+// Pass Num pieces of data to the target device in one call; the i-th piece
+// is Sizes[i] bytes from HostPtrs[i] to TargetPtrs[i], applied in order. This
+// function is optional. With a non-NULL AsyncInfo the copies may be enqueued
+// on its queue; the host buffers can be reused as soon as the call returns
+// either way. In case of success, return zero. Otherwise, return an error
+// code.
+int32_t __tgt_rtl_data_submit_batch(int32_t ID, int32_t Num,
+                                    void **TargetPtrs, void **HostPtrs,
+                                    int64_t *Sizes,
+                                    __tgt_async_info *AsyncInfo);
+
+// Copy Size bytes from SrcPtr on device SrcID to DstPtr on device DstID, both
+// devices of this RTL, without staging the data on the host. This function is
+// optional. In case of success, return zero. Otherwise, return an error code.
+int32_t __tgt_rtl_data_exchange(int32_t SrcID, void *SrcPtr, int32_t DstID,
+                                void *DstPtr, int64_t Size);
+
+// Copy a rectangular sub-volume of a row-major array between the host and
+// the target. ElementSize, NumDims, Volume, the offsets and the dimensions
+// are as in omp_target_memcpy_rect; each pair of offsets and dimensions
+// describes the side of its pointer. These functions are optional, an RTL
+// provides both or none. In case of success, return zero. Otherwise, return
+// an error code.
+int32_t __tgt_rtl_data_submit_rect(int32_t ID, void *TargetPtr, void *HostPtr,
+                                   size_t ElementSize, int32_t NumDims,
+                                   const size_t *Volume,
+                                   const size_t *TargetOffsets,
+                                   const size_t *HostOffsets,
+                                   const size_t *TargetDims,
+                                   const size_t *HostDims);
+int32_t __tgt_rtl_data_retrieve_rect(int32_t ID, void *HostPtr,
+                                     void *TargetPtr, size_t ElementSize,
+                                     int32_t NumDims, const size_t *Volume,
+                                     const size_t *HostOffsets,
+                                     const size_t *TargetOffsets,
+                                     const size_t *HostDims,
+                                     const size_t *TargetDims);
+
+// Report the free and total memory of the device in bytes, to size the budget
+// of data placement. This function is optional. In case of success, return
+// zero. Otherwise, return an error code.
+int32_t __tgt_rtl_get_mem_info(int32_t ID, int64_t *Free, int64_t *Total);
+
+// Asynchronous variants of the functions above; they are optional. The
+// operation is enqueued on the queue of AsyncInfo, which is created on first
+// use, and may still be in flight when the call returns. Operations on the
+// same queue execute in order. Buffers passed in must stay valid until the
+// queue is synchronized; argument arrays of a launch are copied. In case of
+// success, return zero. Otherwise, return an error code.
+int32_t __tgt_rtl_data_submit_async(int32_t ID, void *TargetPtr, void *HostPtr,
+                                    int64_t Size,
+                                    __tgt_async_info *AsyncInfo);
+int32_t __tgt_rtl_data_retrieve_async(int32_t ID, void *HostPtr,
+                                      void *TargetPtr, int64_t Size,
+                                      __tgt_async_info *AsyncInfo);
+int32_t __tgt_rtl_run_target_region_async(int32_t ID, void *Entry,
+                                          void **Args, ptrdiff_t *Offsets,
+                                          int32_t NumArgs,
+                                          __tgt_async_info *AsyncInfo);
+int32_t __tgt_rtl_run_target_team_region_async(
+    int32_t ID, void *Entry, void **Args, ptrdiff_t *Offsets, int32_t NumArgs,
+    int32_t NumTeams, int32_t ThreadLimit, uint64_t loop_tripcount,
+    __tgt_async_info *AsyncInfo);
+
+// Wait until all the operations enqueued on the queue of AsyncInfo are done.
+// The plugin may then release the queue and reset AsyncInfo, whose next
+// operation goes to a fresh queue; operations on distinct async infos may
+// run concurrently. Return zero if all of them succeeded, an error code
+// otherwise.
+int32_t __tgt_rtl_synchronize(int32_t ID, __tgt_async_info *AsyncInfo);
+
 #ifdef __cplusplus
 }
 #endif
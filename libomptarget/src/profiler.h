@@ -0,0 +1,348 @@
+// lld: offload profiler
+//
+// With LLD_PROFILE=1, every target region, keyed by its host entry address,
+// accumulates its launch count, the time spent in target_data_begin, in the
+// kernel and in target_data_end, and the bytes moved to and from the device
+// per argument. Standalone target data and update constructs are accounted
+// as regions of their own, updates in a phase of their own. A summary table
+// is printed to stderr at exit.
+// Regions streamed tile by tile (see stream.h) also report their tiles and how
+// much of their transfer time the kernels hid.
+// With write tracking (see writetrack.h), regions also report the bytes they
+// did not send again because the device held them unchanged.
+// The device memory pool of each device reports its hits and misses.
+// LLD_PROFILE_TRACE=<file> also writes every phase as a Chrome trace event,
+// to be loaded in chrome://tracing or Perfetto. Events are buffered and
+// written out every ProfileTraceBatch events, so long runs grow the file but
+// not the process.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+bool ProfileEnabled = false;
+
+/// Cycle counter read as tsc_tick_count in libomp's kmp_stats_timing.h; a
+/// steady clock in nanoseconds where there is no TSC.
+struct ProfileClockTy {
+  static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+};
+
+enum ProfilePhaseTy {
+  PROFILE_DATA_BEGIN = 0,
+  PROFILE_KERNEL,
+  PROFILE_DATA_END,
+  PROFILE_UPDATE,
+  PROFILE_NUM_PHASES,
+  PROFILE_NONE = PROFILE_NUM_PHASES
+};
+
+static const char *ProfilePhaseNames[PROFILE_NUM_PHASES] = {
+    "data_begin", "kernel", "data_end", "update"};
+
+/// Trace events buffered before they are written out.
+static const size_t ProfileTraceBatch = 1 << 16;
+
+/// Tiles of streamed launches, their estimated transfer time and the part of
+/// it that overlapped kernels.
+struct ProfileStreamTy {
+  uint64_t Tiles = 0;
+  uint64_t CopyTicks = 0;
+  uint64_t HiddenTicks = 0;
+};
+
+struct RegionProfileTy {
+  std::string Name;
+  uint64_t Launches = 0;
+  uint64_t Ticks[PROFILE_NUM_PHASES] = {0, 0, 0, 0};
+  // Bytes moved per argument.
+  std::vector<int64_t> BytesTo;
+  std::vector<int64_t> BytesFrom;
+  ProfileStreamTy Stream;
+  // Bytes to the device left out by write tracking.
+  int64_t Unchanged = 0;
+};
+
+/// Allocations the device memory pool served from its cache, and those it
+/// passed on to the RTL.
+struct ProfilePoolTy {
+  uint64_t Hits = 0;
+  uint64_t Misses = 0;
+};
+
+struct ProfileEventTy {
+  const RegionProfileTy *Region;
+  ProfilePhaseTy Phase;
+  uint32_t Thread;
+  uint64_t Start;
+  uint64_t End;
+};
+
+class ProfilerTy {
+  std::mutex Mtx;
+  std::unordered_map<void *, RegionProfileTy> Regions;
+  std::vector<ProfileEventTy> Events;
+  std::map<int32_t, ProfilePoolTy> Pools;
+  FILE *TraceFile;
+  size_t TraceEvents;
+  uint64_t StartTicks;
+  std::chrono::steady_clock::time_point StartTime;
+  std::atomic<uint32_t> NumThreads;
+
+  double secondsPerTick() const {
+    double Seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - StartTime).count();
+    uint64_t Ticks = ProfileClockTy::now() - StartTicks;
+    return Ticks ? Seconds / Ticks : 0.0;
+  }
+
+  void printSummary(double TickTime) {
+    fprintf(stderr, "Libomptarget profile: %zu regions\n", Regions.size());
+    fprintf(stderr, "%-40s %9s %12s %12s %12s %12s %14s %14s\n", "Region",
+        "Launches", "Begin(ms)", "Kernel(ms)", "End(ms)", "Update(ms)",
+        "To(B)", "From(B)");
+    std::vector<const RegionProfileTy *> Sorted;
+    for (auto &R : Regions)
+      Sorted.push_back(&R.second);
+    std::sort(Sorted.begin(), Sorted.end(),
+        [](const RegionProfileTy *A, const RegionProfileTy *B) {
+          return A->Ticks[PROFILE_KERNEL] > B->Ticks[PROFILE_KERNEL];
+        });
+    for (const RegionProfileTy *R : Sorted) {
+      int64_t To = 0, From = 0;
+      for (int64_t B : R->BytesTo)
+        To += B;
+      for (int64_t B : R->BytesFrom)
+        From += B;
+      fprintf(stderr, "%-40.40s %9" PRIu64 " %12.3f %12.3f %12.3f %12.3f %14"
+          PRId64 " %14" PRId64 "\n", R->Name.c_str(), R->Launches,
+          R->Ticks[PROFILE_DATA_BEGIN] * TickTime * 1e3,
+          R->Ticks[PROFILE_KERNEL] * TickTime * 1e3,
+          R->Ticks[PROFILE_DATA_END] * TickTime * 1e3,
+          R->Ticks[PROFILE_UPDATE] * TickTime * 1e3, To, From);
+      for (size_t i = 0; i < R->BytesTo.size(); ++i)
+        if (R->BytesTo[i] || R->BytesFrom[i])
+          fprintf(stderr, "%-40s %9s %12s %12s %12s %12s %14" PRId64 " %14"
+              PRId64 "\n", ("  arg " + std::to_string(i)).c_str(), "", "", "",
+              "", "", R->BytesTo[i], R->BytesFrom[i]);
+      const ProfileStreamTy &S = R->Stream;
+      if (S.Tiles)
+        fprintf(stderr, "%-40s %9" PRIu64 " tiles, %.1f%% of %.3f ms of "
+            "transfers overlapped\n", "  streamed", S.Tiles,
+            S.CopyTicks ? 100.0 * S.HiddenTicks / S.CopyTicks : 0.0,
+            S.CopyTicks * TickTime * 1e3);
+      if (R->Unchanged)
+        fprintf(stderr, "%-40s %9s %12s %12s %12s %12s %14" PRId64
+            " bytes not sent again\n", "  unchanged", "", "", "", "", "",
+            R->Unchanged);
+    }
+    for (auto &P : Pools)
+      fprintf(stderr, "Device %d pool: %" PRIu64 " hits, %" PRIu64
+          " misses\n", P.first, P.second.Hits, P.second.Misses);
+  }
+
+  // Write out the buffered events, with ticks converted at the rate measured
+  // so far.
+  void flushTrace(double TickTime) {
+    for (const ProfileEventTy &E : Events) {
+      // Region names are symbol names and need no escaping.
+      fprintf(TraceFile, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":"
+          "\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%u}",
+          TraceEvents++ ? "," : "", E.Region->Name.c_str(),
+          ProfilePhaseNames[E.Phase], (E.Start - StartTicks) * TickTime * 1e6,
+          (E.End - E.Start) * TickTime * 1e6, E.Thread);
+    }
+    Events.clear();
+  }
+
+public:
+  ProfilerTy() : TraceFile(NULL), TraceEvents(0), StartTicks(0),
+      NumThreads(0) {}
+
+  ~ProfilerTy() {
+    if (!ProfileEnabled)
+      return;
+    std::lock_guard<std::mutex> LG(Mtx);
+    double TickTime = secondsPerTick();
+    printSummary(TickTime);
+    if (TraceFile) {
+      flushTrace(TickTime);
+      fprintf(TraceFile, "\n],\"displayTimeUnit\":\"ms\"}\n");
+      fclose(TraceFile);
+    }
+  }
+
+  void init(const char *Trace) {
+    StartTicks = ProfileClockTy::now();
+    StartTime = std::chrono::steady_clock::now();
+    if (Trace) {
+      TraceFile = fopen(Trace, "w");
+      if (TraceFile) {
+        Events.reserve(ProfileTraceBatch);
+        fprintf(TraceFile, "{\"traceEvents\":[");
+      } else {
+        fprintf(stderr, "Libomptarget profile: cannot write trace to %s\n",
+            Trace);
+      }
+    }
+    ProfileEnabled = true;
+  }
+
+  uint32_t newThread() { return NumThreads++; }
+
+  void pool(int32_t DeviceID, uint64_t Hits, uint64_t Misses) {
+    if (!ProfileEnabled)
+      return;
+    std::lock_guard<std::mutex> LG(Mtx);
+    ProfilePoolTy &P = Pools[DeviceID];
+    P.Hits += Hits;
+    P.Misses += Misses;
+  }
+
+  // Charge one offload to its region; Events are kept only for a trace.
+  void commit(void *Key, const char *Name, const uint64_t *Marks,
+      const std::vector<int64_t> &BytesTo,
+      const std::vector<int64_t> &BytesFrom, const ProfileStreamTy &Stream,
+      int64_t Unchanged, uint32_t Thread) {
+    std::lock_guard<std::mutex> LG(Mtx);
+    RegionProfileTy &R = Regions[Key];
+    if (R.Name.empty()) {
+      if (Name) {
+        R.Name = Name;
+      } else {
+        char Buf[32];
+        snprintf(Buf, sizeof(Buf), "0x%" PRIxPTR, (uintptr_t)Key);
+        R.Name = Buf;
+      }
+    }
+    ++R.Launches;
+    if (R.BytesTo.size() < BytesTo.size()) {
+      R.BytesTo.resize(BytesTo.size());
+      R.BytesFrom.resize(BytesTo.size());
+    }
+    for (size_t i = 0; i < BytesTo.size(); ++i) {
+      R.BytesTo[i] += BytesTo[i];
+      R.BytesFrom[i] += BytesFrom[i];
+    }
+    R.Stream.Tiles += Stream.Tiles;
+    R.Stream.CopyTicks += Stream.CopyTicks;
+    R.Stream.HiddenTicks += Stream.HiddenTicks;
+    R.Unchanged += Unchanged;
+    for (int P = 0; P < PROFILE_NUM_PHASES; ++P) {
+      if (!Marks[P] || !Marks[P + 1])
+        continue;
+      R.Ticks[P] += Marks[P + 1] - Marks[P];
+      if (TraceFile)
+        Events.push_back({&R, (ProfilePhaseTy)P, Thread, Marks[P],
+            Marks[P + 1]});
+    }
+    if (Events.size() >= ProfileTraceBatch)
+      flushTrace(secondsPerTick());
+  }
+};
+
+static ProfilerTy Profiler;
+
+// Keys of the standalone data constructs.
+static char ProfileDataBeginKey, ProfileDataEndKey, ProfileUpdateKey;
+
+/// The offload being profiled on this thread, if any.
+class ProfileScopeTy;
+static thread_local ProfileScopeTy *CurrentProfile = NULL;
+static thread_local int64_t ProfileThread = -1;
+
+/// Times the phases of one offload on the calling thread and charges them,
+/// with the bytes moved per argument, to its region when it goes away.
+class ProfileScopeTy {
+  void *Key;
+  const char *Name;
+  ProfilePhaseTy Phase;
+  // Start of each phase, and end of the last one.
+  uint64_t Marks[PROFILE_NUM_PHASES + 1];
+  std::vector<int64_t> BytesTo;
+  std::vector<int64_t> BytesFrom;
+  ProfileStreamTy Stream;
+  int64_t Unchanged;
+  ProfileScopeTy *Outer;
+
+public:
+  // Argument index of the arrays passed to target_data_* relative to the
+  // arguments of the offload.
+  int32_t ArgOffset;
+
+  ProfileScopeTy(void *Key, int32_t ArgNum, ProfilePhaseTy First)
+      : Key(Key), Name(NULL), Phase(PROFILE_NONE), Unchanged(0), Outer(NULL),
+        ArgOffset(0) {
+    if (!ProfileEnabled)
+      return;
+    memset(Marks, 0, sizeof(Marks));
+    BytesTo.resize(ArgNum);
+    BytesFrom.resize(ArgNum);
+    Outer = CurrentProfile;
+    CurrentProfile = this;
+    phase(First);
+  }
+
+  ~ProfileScopeTy() {
+    if (Phase == PROFILE_NONE)
+      return;
+    Marks[Phase + 1] = ProfileClockTy::now();
+    CurrentProfile = Outer;
+    if (ProfileThread < 0)
+      ProfileThread = Profiler.newThread();
+    Profiler.commit(Key, Name, Marks, BytesTo, BytesFrom, Stream, Unchanged,
+        ProfileThread);
+  }
+
+  bool active() const { return Phase != PROFILE_NONE; }
+
+  void setName(const char *N) { Name = N; }
+
+  // End the current phase and start P.
+  void phase(ProfilePhaseTy P) {
+    if (!ProfileEnabled)
+      return;
+    uint64_t Now = ProfileClockTy::now();
+    if (Phase != PROFILE_NONE)
+      Marks[Phase + 1] = Now;
+    Marks[P] = Now;
+    Phase = P;
+  }
+
+  void addBytes(int32_t Arg, int64_t Size, bool ToDevice) {
+    Arg += ArgOffset;
+    if (Arg < 0 || Arg >= (int32_t)BytesTo.size())
+      return;
+    (ToDevice ? BytesTo : BytesFrom)[Arg] += Size;
+  }
+
+  void addStream(uint64_t Tiles, uint64_t CopyTicks, uint64_t HiddenTicks) {
+    Stream.Tiles += Tiles;
+    Stream.CopyTicks += CopyTicks;
+    Stream.HiddenTicks += HiddenTicks;
+  }
+
+  void addUnchanged(int64_t Size) { Unchanged += Size; }
+};
+
+/// Charge Size bytes moved for argument Arg to the offload being profiled.
+static inline void profileBytes(int32_t Arg, int64_t Size, bool ToDevice) {
+  if (CurrentProfile)
+    CurrentProfile->addBytes(Arg, Size, ToDevice);
+}
+
+/// Charge Size bytes left out of a copy to the device, being unchanged.
+static inline void profileUnchanged(int64_t Size) {
+  if (CurrentProfile && Size)
+    CurrentProfile->addUnchanged(Size);
+}
@@ -12,12 +12,14 @@ enum data_cluster_type {
 
 struct DataClusterTy {
   void *BasePtr;
-  std::list<HostDataToTargetTy*> Members;
+  uint32_t Id;
+  // each entry once, however often the kernel is launched
+  std::unordered_set<HostDataToTargetTy*> Members;
   data_cluster_type Type = CLUSTER_MAPTYPE_MIX;
   uint64_t Size = 0;
   double Priority = 0.0;
 
-  DataClusterTy(void *Base) : BasePtr(Base) {}
+  DataClusterTy(void *Base, uint32_t Id) : BasePtr(Base), Id(Id) {}
 };
 
 /// Data attributes for each data reference used in an OpenMP target region.
@@ -80,29 +82,288 @@ inline uint64_t getReuseDist(int64_t MapType) {
   return (MapType & OMP_TGT_MAPTYPE_DIST) >> 40;
 }
 
-bool isInDevCluster(HostDataToTargetTy *E) {
-  for (auto *C : E->Clusters) {
-    if (C->Type == CLUSTER_MAPTYPE_DEV)
-      return true;
+/// lld: replacement policy
+///
+/// A policy orders the arguments of a region for placement, sends an argument
+/// that fits to the device or to UM, picks which mapped objects may make room
+/// for one that does not and which of them go first, and keeps the metadata it
+/// relies on up to date on every access. LLD_GPU_MODE selects the placement
+/// strategy (per cluster or per object) with a default policy, LLD_POLICY
+/// overrides the policy.
+class ReplacementPolicyTy {
+public:
+  virtual ~ReplacementPolicyTy() {}
+
+  virtual const char *name() const = 0;
+
+  /// Whether argument A is placed before argument B. A strict weak ordering;
+  /// arguments it does not tell apart keep their order in the region.
+  virtual bool placeBefore(int64_t AType, int64_t ASize, int64_t BType,
+      int64_t BSize, uint64_t LTC) const {
+    return getGlobalReuse(AType) < getGlobalReuse(BType);
+  }
+
+  /// Where an argument goes when there is room for it on the device.
+  virtual mem_map_type place(int64_t MapType, int64_t Size,
+      uint64_t LTC) const {
+    double Density = (double)getLocalReuse(MapType) / 8.0 * LTC / Size;
+    return Density < 0.5 ? MEM_MAPTYPE_UVM : MEM_MAPTYPE_SDEV;
+  }
+
+  /// Whether mapped object E may be released to make room for an argument.
+  virtual bool mayEvict(const HostDataToTargetTy &E, int64_t MapType,
+      int64_t Size, uint64_t LTC) const = 0;
+
+  /// Whether A is released before B.
+  virtual bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const = 0;
+
+  /// Whether a partial mapping takes the room of whole objects instead of
+  /// that of other partial mappings only.
+  virtual bool partialFromWhole() const { return false; }
+
+  /// Update the metadata of E on an access, with the data map lock held.
+  virtual void touch(HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const {
+    E.Locality = (double)getLocalReuse(MapType) * LTC / Size;
+    E.TimeStamp = GlobalTimeStamp;
+    E.ReuseDist = getReuseDist(MapType);
+  }
+};
+
+/// Global rank of the compiler (OBJ and CLUSTER): an object only gives way to
+/// a better ranked one.
+class RankPolicyTy : public ReplacementPolicyTy {
+public:
+  const char *name() const override { return "RANK"; }
+
+  bool mayEvict(const HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    return E.Reuse > getGlobalReuse(MapType);
+  }
+
+  bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const override {
+    return A.Reuse > B.Reuse;
+  }
+};
+
+/// Accesses per byte in the region (LOCAL): anything may give way, poorest
+/// locality first.
+class LocalPolicyTy : public ReplacementPolicyTy {
+public:
+  const char *name() const override { return "LOCAL"; }
+
+  bool placeBefore(int64_t AType, int64_t ASize, int64_t BType, int64_t BSize,
+      uint64_t LTC) const override {
+    double AL = (double)getLocalReuse(AType) * LTC / ASize;
+    double BL = (double)getLocalReuse(BType) * LTC / BSize;
+    return AL > BL;
+  }
+
+  bool mayEvict(const HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    return true;
+  }
+
+  bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const override {
+    return A.Locality < B.Locality;
+  }
+
+  bool partialFromWhole() const override { return true; }
+};
+
+/// Next use predicted by the reuse distance of the compiler (RD), which
+/// approximates Belady: the object used again last goes first, and nothing
+/// gives way to an argument used again later than itself.
+class NextUsePolicyTy : public ReplacementPolicyTy {
+public:
+  const char *name() const override { return "RD"; }
+
+  bool placeBefore(int64_t AType, int64_t ASize, int64_t BType, int64_t BSize,
+      uint64_t LTC) const override {
+    uint64_t ARD = getReuseDist(AType);
+    uint64_t BRD = getReuseDist(BType);
+    if (ARD != BRD)
+      return ARD < BRD;
+#ifdef SEC_LOCAL
+    double AL = (double)getLocalReuse(AType) * LTC / ASize;
+    double BL = (double)getLocalReuse(BType) * LTC / BSize;
+    return AL > BL;
+#else
+    return getGlobalReuse(AType) < getGlobalReuse(BType);
+#endif
+  }
+
+  bool mayEvict(const HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    uint64_t RReuseTime = E.ReuseDist + E.TimeStamp;
+    uint64_t PredictReuseTime = GlobalTimeStamp + getReuseDist(MapType);
+    if (RReuseTime != PredictReuseTime)
+      return RReuseTime > PredictReuseTime;
+#ifdef SEC_LOCAL
+    return E.Locality < (double)getLocalReuse(MapType) * LTC / Size;
+#else
+    return E.Reuse > getGlobalReuse(MapType);
+#endif
+  }
+
+  bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const override {
+    uint64_t AR = A.ReuseDist + A.TimeStamp;
+    uint64_t BR = B.ReuseDist + B.TimeStamp;
+    return (AR == BR) ? (A.Reuse > B.Reuse) : (AR > BR);
+  }
+};
+
+/// Least recently used (LRU), without compiler hints: arguments are placed in
+/// program order and the object accessed longest ago goes first. Objects of
+/// the current region never give way.
+class LRUPolicyTy : public ReplacementPolicyTy {
+public:
+  const char *name() const override { return "LRU"; }
+
+  bool placeBefore(int64_t AType, int64_t ASize, int64_t BType, int64_t BSize,
+      uint64_t LTC) const override {
+    return false;
   }
-  return false;
+
+  bool mayEvict(const HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    return E.TimeStamp < GlobalTimeStamp;
+  }
+
+  bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const override {
+    return A.TimeStamp < B.TimeStamp;
+  }
+};
+
+/// Cost model (COST), per byte and in units of one access served through UM.
+/// A region gains its density minus the cost of moving an argument in from
+/// device placement; releasing an object loses the least of its density and
+/// the cost of moving it back in, doubled when it is written back first.
+/// Moves pay a fixed latency, so small objects are costly to move.
+class CostPolicyTy : public ReplacementPolicyTy {
+  // moving a byte, as in the density threshold of placeDataObj
+  static constexpr double ByteCost = 0.5;
+  // latency of a move, in bytes
+  static constexpr double LatencyBytes = 64 * 1024;
+
+  static double density(int64_t MapType, int64_t Size, uint64_t LTC) {
+    return (double)getLocalReuse(MapType) / 8.0 * LTC / Size;
+  }
+
+  static double moveCost(int64_t MapType, int64_t Size) {
+    double Cost = ByteCost * (1.0 + LatencyBytes / Size);
+    return (MapType & OMP_TGT_MAPTYPE_FROM) ? 2 * Cost : Cost;
+  }
+
+  static double loss(const HostDataToTargetTy &E) {
+    int64_t Size = E.HstPtrEnd - E.HstPtrBegin;
+    return std::min(E.Locality / 8.0, moveCost(E.MapType, Size));
+  }
+
+public:
+  const char *name() const override { return "COST"; }
+
+  bool placeBefore(int64_t AType, int64_t ASize, int64_t BType, int64_t BSize,
+      uint64_t LTC) const override {
+    return density(AType, ASize, LTC) - moveCost(AType, ASize) >
+        density(BType, BSize, LTC) - moveCost(BType, BSize);
+  }
+
+  mem_map_type place(int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    return density(MapType, Size, LTC) < moveCost(MapType, Size) ?
+        MEM_MAPTYPE_UVM : MEM_MAPTYPE_SDEV;
+  }
+
+  bool mayEvict(const HostDataToTargetTy &E, int64_t MapType, int64_t Size,
+      uint64_t LTC) const override {
+    return loss(E) < density(MapType, Size, LTC) - moveCost(MapType, Size);
+  }
+
+  bool evictBefore(const HostDataToTargetTy &A,
+      const HostDataToTargetTy &B) const override {
+    return loss(A) < loss(B);
+  }
+};
+
+static RankPolicyTy RankPolicy;
+static LocalPolicyTy LocalPolicy;
+static NextUsePolicyTy NextUsePolicy;
+static LRUPolicyTy LRUPolicy;
+static CostPolicyTy CostPolicy;
+
+// lld: policy of a device, LLD_POLICY or else the one of LLD_GPU_MODE
+ReplacementPolicyTy &getPolicy(const DeviceTy &Device) {
+  switch (Device.RPolicy ? Device.RPolicy : Device.GMode) {
+  case -2:
+    return LocalPolicy;
+  case -3:
+    return NextUsePolicy;
+  case -4:
+    return LRUPolicy;
+  case -5:
+    return CostPolicy;
+  default:
+    return RankPolicy;
+  }
+}
+
+bool isInDevCluster(HostDataToTargetTy *E) {
+  return E->DevClusters > 0;
 }
 
 bool isInCluster(HostDataToTargetTy *E, DataClusterTy *CC) {
-  for (auto *C : E->Clusters) {
-    if (C == CC)
-      return true;
+  size_t Word = CC->Id / 64;
+  return Word < E->ClusterBits.size() &&
+      (E->ClusterBits[Word] >> (CC->Id % 64) & 1);
+}
+
+// lld: cluster membership is kept once per entry and cluster; the count of
+// device clusters of an entry follows the type of its clusters
+void addToCluster(HostDataToTargetTy *E, DataClusterTy *C) {
+  if (isInCluster(E, C))
+    return;
+  size_t Word = C->Id / 64;
+  if (Word >= E->ClusterBits.size())
+    E->ClusterBits.resize(Word + 1);
+  E->ClusterBits[Word] |= (uint64_t)1 << (C->Id % 64);
+  C->Members.insert(E);
+  if (C->Type == CLUSTER_MAPTYPE_DEV)
+    ++E->DevClusters;
+}
+
+void setClusterType(DataClusterTy *C, data_cluster_type Type) {
+  bool WasDev = C->Type == CLUSTER_MAPTYPE_DEV;
+  bool IsDev = Type == CLUSTER_MAPTYPE_DEV;
+  if (WasDev != IsDev)
+    for (auto *E : C->Members)
+      E->DevClusters += IsDev ? 1 : -1;
+  C->Type = Type;
+}
+
+void DeviceTy::removeFromClusters(HostDataToTargetTy &HT) {
+  for (size_t Word = 0; Word < HT.ClusterBits.size(); ++Word) {
+    for (uint64_t Bits = HT.ClusterBits[Word]; Bits; Bits &= Bits - 1) {
+      size_t Id = Word * 64 + __builtin_ctzll(Bits);
+      DataClusters[Id].Members.erase(&HT);
+    }
   }
-  return false;
+  HT.ClusterBits.clear();
+  HT.DevClusters = 0;
 }
 
 // dump all target data
-void dumpTargetData(HostDataToTargetListTy *DataList) {
+void dumpTargetData(HostDataToTargetMapTy *DataList) {
   LLD_DP("Target data:\n");
   int i = 0;
   for (auto &HT : *DataList) {
     LLD_DP("Entry %2d: Base=" DPxMOD ", Valid=%d, Deleted=%d, Reuse=%ld, Time=%lu, ReuseDist=%lu, Locality=%.1f, Size=%" PRId64
-        ", DevSize=%" PRId64 " Type=0x%" PRIx64 "\n", i, DPxPTR(HT.HstPtrBegin), HT.IsValid, HT.IsDeleted, HT.Reuse, HT.TimeStamp, HT.ReuseDist, HT.Locality,
+        ", DevSize=%" PRId64 " Type=0x%" PRIx64 "\n", i, DPxPTR(HT.HstPtrBegin), HT.IsValid, HT.IsDeleted, HT.Reuse, HT.TimeStamp.load(), HT.ReuseDist, HT.Locality,
         HT.HstPtrEnd - HT.HstPtrBegin, HT.DevSize, HT.MapType);
     i++;
   }
@@ -116,18 +377,16 @@ int64_t placeDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx, i
     MapType |= OMP_TGT_MAPTYPE_UVM;
     MapType |= OMP_TGT_MAPTYPE_HOST;
   } else {
-    unsigned LocalReuse = getLocalReuse(MapType);
-    double LocalReuseFloat = (double)LocalReuse / 8.0;
-    double Density = LocalReuseFloat * LTC / Size;
-    if (Density < 0.5) {
-      LLD_DP("  Arg %d (" DPxMOD ") is intended for UM (%f)\n", idx, DPxPTR(Base), Density);
+    ReplacementPolicyTy &Policy = getPolicy(Device);
+    if (Policy.place(MapType, Size, LTC) == MEM_MAPTYPE_UVM) {
+      LLD_DP("  Arg %d (" DPxMOD ") is intended for UM (%s)\n", idx, DPxPTR(Base), Policy.name());
 #ifdef NO_ON_DEMAND
       MapType |= OMP_TGT_MAPTYPE_SDEV;
 #else
       MapType |= OMP_TGT_MAPTYPE_UVM;
 #endif
     } else {
-      LLD_DP("  Arg %d (" DPxMOD ") is intended for device (%f)\n", idx, DPxPTR(Base), Density);
+      LLD_DP("  Arg %d (" DPxMOD ") is intended for device (%s)\n", idx, DPxPTR(Base), Policy.name());
       MapType |= OMP_TGT_MAPTYPE_SDEV;
     }
   }
@@ -142,6 +401,11 @@ int64_t placeDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx, i
 // release space
 int64_t releaseDataObj(DeviceTy &Device, HostDataToTargetTy *E) {
   int64_t Size = E->HstPtrEnd - E->HstPtrBegin;
+  // an unmapped entry is indexed by what it holds, which changes here
+  bool Recycled = E->RecycledKey >= 0;
+  Device.unrecycleEntry(*E);
+  ++Device.MapGeneration;
+  ++Device.evictions;
   mem_map_type PreMap = getMemMapType(E->MapType);
   assert(PreMap != MEM_MAPTYPE_UNDECIDE);
   if (PreMap == MEM_MAPTYPE_DEV) {
@@ -153,7 +417,7 @@ int64_t releaseDataObj(DeviceTy &Device, HostDataToTargetTy *E) {
       E->IsValid = false;
     }
     Device.deviceSize -= Size;
-    Device.RTL->data_delete(Device.RTLDeviceID, (void *)E->TgtPtrBegin);
+    Device.data_delete((void *)E->TgtPtrBegin);
     E->IsDeleted = true;
   } else if (PreMap == MEM_MAPTYPE_UVM) {
     LLD_DP("  Replace " DPxMOD " from UM, size=%ld\n", DPxPTR(E->HstPtrBegin), Size);
@@ -180,87 +444,228 @@ int64_t releaseDataObj(DeviceTy &Device, HostDataToTargetTy *E) {
     setMemMapType(E->MapType, MEM_MAPTYPE_HOST);
   } else
     assert(0);
+  if (E->Prefetched) {
+    ++Device.prefetchUseless;
+    E->Prefetched = false;
+  }
+  if (Recycled)
+    Device.recycleEntry(*E);
+  else
+    Device.queuePrefetch(*E);
   return Size;
 }
 
-inline bool comparePriority(int64_t MapType, int64_t Size, uint64_t LTC, HostDataToTargetTy *R) {
-  if (GMode >= -1) {
-    int64_t Reuse = getGlobalReuse(MapType);
-    return (R->Reuse > Reuse);
-  } else if (GMode == -3) {
-    uint64_t ReuseDist = getReuseDist(MapType);
-    uint64_t RReuseTime = R->ReuseDist + R->TimeStamp;
-    uint64_t PredictReuseTime = GlobalTimeStamp + ReuseDist;
-    //if (RReuseTime < GlobalTimeStamp) // incorrect prediction for R
-    //  return true;
-    //else if (RReuseTime > PredictReuseTime)
-    if (RReuseTime > PredictReuseTime)
-      return true;
-    else if (RReuseTime == PredictReuseTime) {
-#ifdef SEC_LOCAL
-      double LL = (double)getLocalReuse(MapType) * LTC / Size;
-      return (R->Locality < LL);
-#else
-      int64_t Reuse = getGlobalReuse(MapType);
-      return (R->Reuse > Reuse);
-#endif
-    } else
-      return false;
-  } else
-    return true;
+// lld: release candidates, the first choice of the policy first, until Size
+// bytes are available. Only the released candidates are ordered: the list is
+// made a heap and popped rather than sorted.
+int64_t releaseVictims(DeviceTy &Device, std::vector<HostDataToTargetTy*> &Victims, int64_t AvailSize, int64_t Size) {
+  ReplacementPolicyTy &Policy = getPolicy(Device);
+  auto Later = [&Policy](HostDataToTargetTy *A, HostDataToTargetTy *B) {
+    return Policy.evictBefore(*B, *A);
+  };
+  std::make_heap(Victims.begin(), Victims.end(), Later);
+  auto End = Victims.end();
+  while (AvailSize < Size && End != Victims.begin()) {
+    std::pop_heap(Victims.begin(), End, Later);
+    --End;
+    AvailSize += releaseDataObj(Device, *End);
+  }
+  return AvailSize;
 }
 
-// lld: compare reuse
-bool compareCandidates(HostDataToTargetTy *A, HostDataToTargetTy *B) {
-  if (GMode == -2) {
-    return (A->Locality < B->Locality);
-  } else if (GMode == -3) {
-    uint64_t AR = A->ReuseDist + A->TimeStamp;
-    uint64_t BR = B->ReuseDist + B->TimeStamp;
-#ifdef SEC_LOCAL
-    return (AR == BR) ? (A->Reuse > B->Reuse) : (AR > BR);
-#else
-    return (AR == BR) ? (A->Reuse > B->Reuse) : (AR > BR);
-    //return (AR == BR) ? (A->Locality < B->Locality) : (AR > BR);
-#endif
-  } else
-    return (A->Reuse > B->Reuse);
+// lld: recycling of unmapped entries (LLD_RECYCLE)
+
+// Bytes an entry takes from the device budget.
+static int64_t getHeldSize(const HostDataToTargetTy &HT) {
+  if (HT.IsDeleted)
+    return 0;
+  switch (getMemMapType(HT.MapType)) {
+  case MEM_MAPTYPE_DEV:
+    return HT.TgtPtrBegin != HT.HstPtrBegin ? HT.HstPtrEnd - HT.HstPtrBegin : 0;
+  case MEM_MAPTYPE_SDEV:
+  case MEM_MAPTYPE_UVM:
+    return HT.HstPtrEnd - HT.HstPtrBegin;
+  case MEM_MAPTYPE_PART:
+    return HT.DevSize;
+  default:
+    return 0;
+  }
 }
 
-// lld: compare rank
-bool rankArgs(std::pair<int32_t, int64_t> A, std::pair<int32_t, int64_t> B, DeviceTy &Device, int64_t *arg_sizes) {
-  if (GMode == -2) {
-    double AL = (double)getLocalReuse(A.second) * Device.loopTripCnt / arg_sizes[A.first];
-    double BL = (double)getLocalReuse(B.second) * Device.loopTripCnt / arg_sizes[B.first];
-    return (AL > BL);
-  } else if (GMode == -1) {
-    int64_t AG = getGlobalReuse(A.second);
-    int64_t BG = getGlobalReuse(B.second);
-    return (AG < BG);
-  } else if (GMode == -3) {
-    int64_t ARD = getReuseDist(A.second);
-    int64_t BRD = getReuseDist(B.second);
-#ifdef SEC_LOCAL
-    double AL = (double)getLocalReuse(A.second) * Device.loopTripCnt / arg_sizes[A.first];
-    double BL = (double)getLocalReuse(B.second) * Device.loopTripCnt / arg_sizes[B.first];
-    return (ARD == BRD) ? (AL > BL) : (ARD < BRD);
-#else
-    int64_t AG = getGlobalReuse(A.second);
-    int64_t BG = getGlobalReuse(B.second);
-    return (ARD == BRD) ? (AG < BG) : (ARD < BRD);
-#endif
-  } else
-    return true;
+void DeviceTy::recycleEntry(HostDataToTargetTy &HT) {
+  assert(!HT.IsValid && HT.RefCount == 0 && HT.RecycledKey < 0);
+  HT.RecycledKey = getHeldSize(HT);
+  RecycledEntries.insert(std::make_pair(HT.RecycledKey, HT.HstPtrBegin));
+}
+
+void DeviceTy::unrecycleEntry(HostDataToTargetTy &HT) {
+  if (HT.RecycledKey < 0)
+    return;
+  auto Range = RecycledEntries.equal_range(HT.RecycledKey);
+  for (auto It = Range.first; It != Range.second; ++It) {
+    if (It->second == HT.HstPtrBegin) {
+      RecycledEntries.erase(It);
+      break;
+    }
+  }
+  HT.RecycledKey = -1;
+}
+
+int64_t DeviceTy::releaseEntry(HostDataToTargetMapTy::iterator It) {
+  HostDataToTargetTy &HT = *It;
+  assert(!HT.IsValid);
+  int64_t Held = getHeldSize(HT);
+  unrecycleEntry(HT);
+  if (Held > 0 && getMemMapType(HT.MapType) == MEM_MAPTYPE_DEV) {
+    LLD_DP("  Release " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HT.HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Held);
+    deviceSize -= Held;
+    data_delete((void *)HT.TgtPtrBegin);
+  } else if (Held > 0) {
+    LLD_DP("  Release " DPxMOD " from UM, size=%ld\n", DPxPTR(HT.HstPtrBegin), Held);
+    RTL->data_opt(RTLDeviceID, Held, (void *)HT.HstPtrBegin, 0); // pin to host
+    if (getMemMapType(HT.MapType) == MEM_MAPTYPE_UVM)
+      umSize -= Held;
+    else
+      deviceSize -= Held;
+  }
+  if (HT.Prefetched)
+    ++prefetchUseless;
+  untrackWrites(HT);
+  removeFromClusters(HT);
+  HostDataToTargetMap.erase(It);
+  ++MapGeneration;
+  return Held;
+}
+
+// Release the smallest unmapped entry that frees Bytes on its own, else the
+// largest ones until Bytes are free. Device memory goes back to MemPool, where
+// the allocation that needed it finds a block of its size class.
+int64_t DeviceTy::releaseRecycled(int64_t Bytes) {
+  int64_t Released = 0;
+  auto It = RecycledEntries.lower_bound(Bytes);
+  while (Released < Bytes && !RecycledEntries.empty()) {
+    if (It == RecycledEntries.end())
+      It = std::prev(RecycledEntries.end());
+    if (It->first == 0)
+      break;
+    auto Entry = HostDataToTargetMap.find(It->second);
+    assert(Entry != HostDataToTargetMap.end());
+    Released += releaseEntry(Entry);
+    It = RecycledEntries.end();
+  }
+  if (Released > 0)
+    LLD_DP("  Released %ld bytes of unmapped entries (%lu left)\n", Released, RecycledEntries.size());
+  return Released;
+}
+
+// Entries holding the least go first, those holding nothing only carry the
+// placement of the data.
+int64_t DeviceTy::trimRecycled() {
+  size_t Limit = RecycleMem > 1 ? (size_t)RecycleMem : DefaultRecycleLimit;
+  int64_t Released = 0;
+  while (RecycledEntries.size() > Limit) {
+    auto Entry = HostDataToTargetMap.find(RecycledEntries.begin()->second);
+    assert(Entry != HostDataToTargetMap.end());
+    Released += releaseEntry(Entry);
+  }
+  return Released;
+}
+
+// lld: lookahead prefetch (LLD_PREFETCH)
+//
+// An access with a reuse distance predicts the next one at TimeStamp +
+// ReuseDist. Mapped entries left on the host, by placement or eviction, are
+// queued at that time; when a region is launched, those due within
+// PrefetchDist time stamps are moved to the soft device while it runs, as
+// far as they fit in what the placement engine left free. Nothing is evicted
+// for a prefetch. Only managed memory is prefetched: the plugin migrates it
+// asynchronously and keeps it coherent, while a copy to device memory would
+// have to wait for the host to be done with the data.
+
+void DeviceTy::queuePrefetch(HostDataToTargetTy &HT) {
+  if (PrefetchDist <= 0 || HT.ReuseDist == 0 || !HT.IsValid ||
+      getMemMapType(HT.MapType) != MEM_MAPTYPE_HOST)
+    return;
+  PrefetchQueue.insert(
+      std::make_pair(HT.TimeStamp + HT.ReuseDist, HT.HstPtrBegin));
+}
+
+void DeviceTy::usePrefetched(HostDataToTargetTy &HT) {
+  if (HT.Prefetched) {
+    LLD_DP("  Prefetch hit " DPxMOD "\n", DPxPTR(HT.HstPtrBegin));
+    ++prefetchHits;
+  } else if (HT.PrefetchMissed &&
+      getMemMapType(HT.MapType) == MEM_MAPTYPE_HOST) {
+    LLD_DP("  Prefetch late " DPxMOD "\n", DPxPTR(HT.HstPtrBegin));
+    ++prefetchLate;
+  }
+  HT.Prefetched = false;
+  HT.PrefetchMissed = false;
+}
+
+// Queue entries are dropped once their time has passed or the entry they
+// name was accessed, moved or erased since; an entry due within the window
+// that does not fit stays queued, as room may be left at the next launch.
+void DeviceTy::prefetchAhead() {
+  if (PrefetchDist <= 0 || GMode > 0)
+    return;
+  DataMapMtx.lock();
+  uint64_t Now = GlobalTimeStamp;
+  bool Moved = false;
+  auto It = PrefetchQueue.begin();
+  while (It != PrefetchQueue.end() && It->first <= Now + PrefetchDist) {
+    auto Entry = HostDataToTargetMap.find(It->second);
+    if (Entry == HostDataToTargetMap.end() || !Entry->IsValid ||
+        !Entry->Decided || Entry->ChangeMap ||
+        getMemMapType(Entry->MapType) != MEM_MAPTYPE_HOST ||
+        Entry->TimeStamp + Entry->ReuseDist != It->first) {
+      It = PrefetchQueue.erase(It);
+      continue;
+    }
+    HostDataToTargetTy &HT = *Entry;
+    if (It->first <= Now) { // not accessed when predicted
+      HT.PrefetchMissed = false;
+      It = PrefetchQueue.erase(It);
+      continue;
+    }
+    // arguments of the running region stay where it uses them
+    if (HT.TimeStamp == Now) {
+      ++It;
+      continue;
+    }
+    int64_t Size = HT.HstPtrEnd - HT.HstPtrBegin;
+    if (Size > availDevSize()) {
+      HT.PrefetchMissed = true;
+      ++It;
+      continue;
+    }
+    LLD_DP("  Prefetch " DPxMOD " to soft device for %lu, size=%ld\n",
+        DPxPTR(HT.HstPtrBegin), It->first, Size);
+    trimMemPool(Size);
+    RTL->data_opt(RTLDeviceID, Size, (void *)HT.HstPtrBegin, 4); // pin to device
+    RTL->data_opt(RTLDeviceID, Size, (void *)HT.HstPtrBegin, 1); // prefetch
+    deviceSize += Size;
+    setMemMapType(HT.MapType, MEM_MAPTYPE_SDEV);
+    HT.Prefetched = true;
+    HT.PrefetchMissed = false;
+    ++prefetches;
+    Moved = true;
+    It = PrefetchQueue.erase(It);
+  }
+  if (Moved)
+    ++MapGeneration;
+  DataMapMtx.unlock();
 }
 
 int64_t replaceDataObjPart(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx, int64_t &MapType, int64_t Size, int64_t AvailSize, void *Base, uint64_t LTC, bool data_region) {
+  ReplacementPolicyTy &Policy = getPolicy(Device);
   std::vector<HostDataToTargetTy*> ReplaceList;
   for (auto &HT : Device.HostDataToTargetMap) {
     // find objects with poorer locality
     mem_map_type PreMap = getMemMapType(HT.MapType);
-    if ((GMode == -2 && PreMap < MEM_MAPTYPE_PART) ||
-        (GMode == -3 && (PreMap == MEM_MAPTYPE_PART && Entry != &HT && comparePriority(MapType, Size, LTC, &HT))) ||
-        (GMode >= -1 && (PreMap == MEM_MAPTYPE_PART && comparePriority(MapType, Size, LTC, &HT)))) {
+    bool Candidate = Policy.partialFromWhole() ? PreMap < MEM_MAPTYPE_PART :
+        PreMap == MEM_MAPTYPE_PART;
+    if (Candidate && Entry != &HT && Policy.mayEvict(HT, MapType, Size, LTC)) {
       int64_t HTSize = HT.DevSize;
       if (!HT.IsDeleted && HTSize >= 4096) { // Do not replace small objects
         AvailSize += HTSize;
@@ -312,6 +717,7 @@ int64_t replaceDataObjPart(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t
 // replace a data object
 int64_t replaceDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx, int64_t &MapType, int64_t Size, int64_t AvailSize, void *Base, uint64_t LTC, bool data_region) {
   int64_t OriAvailSize = AvailSize;
+  ReplacementPolicyTy &Policy = getPolicy(Device);
   std::vector<HostDataToTargetTy*> ReplaceList;
   for (auto &HT : Device.HostDataToTargetMap) {
     // if it is not replaceable
@@ -322,9 +728,7 @@ int64_t replaceDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx,
       continue;
     // find objects with poorer locality
     mem_map_type PreMap = getMemMapType(HT.MapType);
-    if ((GMode == -2 && PreMap < MEM_MAPTYPE_PART) ||
-        (GMode == -3 && (PreMap < MEM_MAPTYPE_PART && comparePriority(MapType, Size, LTC, &HT))) || 
-        (GMode >= -1 && (PreMap < MEM_MAPTYPE_PART && comparePriority(MapType, Size, LTC, &HT))) ||
+    if ((PreMap < MEM_MAPTYPE_PART && Policy.mayEvict(HT, MapType, Size, LTC)) ||
         (PreMap == MEM_MAPTYPE_PART && Entry != &HT)) { // implicitly assume at most 1 is mapped to part
       int64_t HTSize;
       if (PreMap == MEM_MAPTYPE_PART)
@@ -340,9 +744,6 @@ int64_t replaceDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx,
     }
   }
 
-  // sort replace list based on reuse
-  std::sort(ReplaceList.begin(), ReplaceList.end(), compareCandidates);
-
   if (AvailSize < Size) {
     LLD_DP("  Not enough space for replacement (%ld < %ld, %lu obj)\n", AvailSize, Size, ReplaceList.size());
     mem_map_type PreMap = MEM_MAPTYPE_UNDECIDE;
@@ -355,25 +756,21 @@ int64_t replaceDataObj(DeviceTy &Device, HostDataToTargetTy *Entry, int32_t idx,
     return 0;
   }
 
-  // release space
-  AvailSize = OriAvailSize;
-  for (auto *E : ReplaceList) {
-    AvailSize += releaseDataObj(Device, E);
-    if (AvailSize >= Size)
-      break;
-  }
+  releaseVictims(Device, ReplaceList, OriAvailSize, Size);
   // place data
   return placeDataObj(Device, Entry, idx, MapType, Size, Base, LTC, data_region);
 }
 
 DataClusterTy *DeviceTy::lookupCluster(void *Base) {
-  DataClusterListTy::iterator it;
-  for (it = DataClusters.begin();
-      it != DataClusters.end(); ++it) {
-    if (it->BasePtr == Base)
-      return &(*it);
-  }
-  return NULL;
+  auto It = ClusterIndex.find(Base);
+  return It != ClusterIndex.end() ? It->second : NULL;
+}
+
+DataClusterTy *DeviceTy::addCluster(void *Base) {
+  DataClusters.push_back(DataClusterTy(Base, DataClusters.size()));
+  DataClusterTy *C = &DataClusters.back();
+  ClusterIndex[Base] = C;
+  return C;
 }
 
 void dumpClusters(DataClusterListTy *CList) {
@@ -396,7 +793,7 @@ void replaceDataCluster(DeviceTy &Device, int64_t Size, int64_t AvailSize, std::
   int64_t OriAvailSize = AvailSize;
   if (AvailSize >= Size) {
     LLD_DP("  Cluster " DPxMOD " uses device mapping\n", DPxPTR(Device.CurrentCluster->BasePtr));
-    Device.CurrentCluster->Type = CLUSTER_MAPTYPE_DEV;
+    setClusterType(Device.CurrentCluster, CLUSTER_MAPTYPE_DEV);
     for (auto I : argList) {
       int32_t idx = I.first;
       LookupResult lr = LRs[idx];
@@ -439,7 +836,7 @@ void replaceDataCluster(DeviceTy &Device, int64_t Size, int64_t AvailSize, std::
 
   if (AvailSize < Size) {
     LLD_DP("  Cluster " DPxMOD " uses mixed mapping\n", DPxPTR(Device.CurrentCluster->BasePtr));
-    Device.CurrentCluster->Type = CLUSTER_MAPTYPE_MIX;
+    setClusterType(Device.CurrentCluster, CLUSTER_MAPTYPE_MIX);
     int64_t used_dev_size = 0;
     // argument index for partial mapping
     int32_t partial_idx = -1;
@@ -452,8 +849,8 @@ void replaceDataCluster(DeviceTy &Device, int64_t Size, int64_t AvailSize, std::
         HT->Irreplaceable = false;
         continue;
       }
-      AvailSize = total_dev_size - used_dev_size - Device.deviceSize - Device.umSize;
-      assert(AvailSize > -1024); // reserve space for non UM variables
+      AvailSize = Device.availDevSize(used_dev_size);
+      assert(AvailSize >= Device.MemBudget - Device.MemCapacity); // non UM variables stay within the reserve
       if (HT && getMemMapType(HT->MapType) == MEM_MAPTYPE_PART)
         AvailSize += HT->DevSize;
       if (argSizes[idx] <= AvailSize)
@@ -461,29 +858,22 @@ void replaceDataCluster(DeviceTy &Device, int64_t Size, int64_t AvailSize, std::
       else {
         int64_t allocateSize = replaceDataObj(Device, HT, idx, argTypes[idx], argSizes[idx], AvailSize, argBases[idx], LTC, false);
         used_dev_size += allocateSize;
-        if (PartialMap && allocateSize == 0 && partial_idx == -1) {
+        if (Device.PartialMap && allocateSize == 0 && partial_idx == -1) {
           partial_idx = idx;
           partial_HT = HT;
         }
       }
     }
-    if (PartialMap && partial_idx >= 0) {
-      AvailSize = total_dev_size - used_dev_size - Device.deviceSize - Device.umSize;
+    if (Device.PartialMap && partial_idx >= 0) {
+      AvailSize = Device.availDevSize(used_dev_size);
       if (partial_HT && getMemMapType(partial_HT->MapType) == MEM_MAPTYPE_PART)
         AvailSize += partial_HT->DevSize;
       replaceDataObjPart(Device, partial_HT, partial_idx, argTypes[partial_idx], argSizes[partial_idx], AvailSize, argBases[partial_idx], LTC, false);
     }
   } else {
     LLD_DP("  Cluster " DPxMOD " uses device mapping\n", DPxPTR(Device.CurrentCluster->BasePtr));
-    Device.CurrentCluster->Type = CLUSTER_MAPTYPE_DEV;
-    AvailSize = OriAvailSize;
-    // sort replace list based on reuse
-    std::sort(ReplaceList.begin(), ReplaceList.end(), compareCandidates);
-    for (auto *E : ReplaceList) {
-      AvailSize += releaseDataObj(Device, E);
-      if (AvailSize >= Size)
-        break;
-    }
+    setClusterType(Device.CurrentCluster, CLUSTER_MAPTYPE_DEV);
+    releaseVictims(Device, ReplaceList, OriAvailSize, Size);
     for (auto I : argList) {
       int32_t idx = I.first;
       LookupResult lr = LRs[idx];
@@ -515,10 +905,42 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
   bool SoftDev = MapType & OMP_TGT_MAPTYPE_SDEV;
   mem_map_type CurMap = getMemMapType(MapType);
 
+  // Fast path for sections whose placement is already settled: only the
+  // reference count and the access time change, and both are atomic, so the
+  // shared lock is enough. Accesses carrying compiler reuse hints refresh the
+  // rest of the replacement metadata and take the exclusive path below.
+  if (GMode > 0 || !(MapType & (OMP_TGT_MAPTYPE_RANK |
+      OMP_TGT_MAPTYPE_LOCAL_REUSE | OMP_TGT_MAPTYPE_DIST))) {
+    DataMapMtx.lock_shared();
+    LookupResult lr = lookupMapping(HstPtrBegin, Size);
+    if ((lr.Flags.IsContained ||
+        ((lr.Flags.ExtendsBefore || lr.Flags.ExtendsAfter) && IsImplicit)) &&
+        lr.Entry->Decided && !lr.Entry->ChangeMap) {
+      auto &HT = *lr.Entry;
+      IsNew = false;
+      if (UpdateRefCount)
+        ++HT.RefCount;
+      HT.TimeStamp = GlobalTimeStamp;
+      uintptr_t tp = HT.TgtPtrBegin + ((uintptr_t)HstPtrBegin - HT.HstPtrBegin);
+      DP("Mapping exists%s with HstPtrBegin=" DPxMOD ", TgtPtrBegin=" DPxMOD
+          ", Size=%ld,%s RefCount=%s\n", (IsImplicit ? " (implicit)" : ""),
+          DPxPTR(HstPtrBegin), DPxPTR(tp), Size,
+          (UpdateRefCount ? " updated" : ""),
+          (CONSIDERED_INF(HT.RefCount)) ? "INF" :
+              std::to_string(HT.RefCount).c_str());
+      DataMapMtx.unlock_shared();
+      return (void *)tp;
+    }
+    DataMapMtx.unlock_shared();
+  }
+
   void *rc = NULL;
   DataMapMtx.lock();
+  // Anything below may add, move or re-place a mapping.
+  ++MapGeneration;
   LookupResult lr = lookupMapping(HstPtrBegin, Size);
-  auto *DMEP = &(*lr.Entry);
+  HostDataToTargetTy *DMEP = (lr.Entry != HostDataToTargetMap.end() ?
+      &(*lr.Entry) : NULL);
 
   // Check if the pointer is contained.
   if (lr.Flags.IsContained ||
@@ -566,7 +988,15 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         HT.MapType = MapType;
         IsNew = true;
       } else {
-        HT.TgtPtrBegin = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+        HT.TgtPtrBegin = (uintptr_t)data_alloc(Size, HstPtrBegin);
+        if (!HT.TgtPtrBegin) {
+          // Stays undecided; the caller fails the mapping.
+          DP("Device allocation of %ld bytes failed\n", Size);
+          if (UpdateRefCount)
+            --HT.RefCount;
+          DataMapMtx.unlock();
+          return NULL;
+        }
         deviceSize += Size;
         HT.Decided = true;
         HT.MapType = MapType;
@@ -583,7 +1013,7 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
           assert(HT.TgtPtrBegin != HT.HstPtrBegin);
           LLD_DP("  Remap " DPxMOD " from device (" DPxMOD ") to UM, size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
           deviceSize -= Size;
-          RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+          data_delete((void *)HT.TgtPtrBegin);
           HT.TgtPtrBegin = (uintptr_t)HstPtrBegin;
           umSize += Size;
         } else if (PreMap == MEM_MAPTYPE_UVM) {
@@ -607,7 +1037,7 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         if (PreMap == MEM_MAPTYPE_DEV) {
           assert(HT.TgtPtrBegin != HT.HstPtrBegin);
           LLD_DP("  Remap " DPxMOD " from device (" DPxMOD ") to soft device, size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
-          RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+          data_delete((void *)HT.TgtPtrBegin);
           HT.TgtPtrBegin = (uintptr_t)HstPtrBegin;
           RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 4); // pin to device
           RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 1); // prefetch
@@ -634,7 +1064,7 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         if (PreMap == MEM_MAPTYPE_DEV) {
           assert(HT.TgtPtrBegin != HT.HstPtrBegin);
           LLD_DP("  Remap " DPxMOD " from device (" DPxMOD ") to part, size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
-          RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+          data_delete((void *)HT.TgtPtrBegin);
           HT.TgtPtrBegin = (uintptr_t)HstPtrBegin;
           RTL->data_opt(RTLDeviceID, PartDevSize, HstPtrBegin, 4); // pin to device
           RTL->data_opt(RTLDeviceID, PartDevSize, HstPtrBegin, 1); // prefetch
@@ -672,7 +1102,7 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         if (PreMap == MEM_MAPTYPE_DEV) {
           assert(HT.TgtPtrBegin != HT.HstPtrBegin);
           deviceSize -= Size;
-          RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+          data_delete((void *)HT.TgtPtrBegin);
           LLD_DP("  Remap " DPxMOD " from device (" DPxMOD ") to host, size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
           HT.TgtPtrBegin = (uintptr_t)HstPtrBegin;
           RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 0);
@@ -695,40 +1125,43 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
           deviceSize -= HT.DevSize;
         }
       } else {
+        if (PreMap != MEM_MAPTYPE_DEV) {
+          // The previous placement is kept until the device copy is made, so
+          // a failed allocation or copy leaves the entry as it was.
+          if (PreMap == MEM_MAPTYPE_UVM)
+            RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 1); // prefetch to device
+          void *TgtPtr = data_alloc(Size, HstPtrBegin);
+          if (!TgtPtr ||
+              RTL->data_submit(RTLDeviceID, TgtPtr, HstPtrBegin, Size) !=
+                  OFFLOAD_SUCCESS) {
+            DP("Remapping " DPxMOD " to the device failed\n",
+                DPxPTR(HstPtrBegin));
+            if (TgtPtr)
+              data_delete(TgtPtr);
+            if (UpdateRefCount)
+              --HT.RefCount;
+            DataMapMtx.unlock();
+            return NULL;
+          }
+          HT.TgtPtrBegin = (uintptr_t)TgtPtr;
+        }
         if (PreMap == MEM_MAPTYPE_DEV) {
           assert(HT.TgtPtrBegin != HT.HstPtrBegin);
           // do nothing
         } else if (PreMap == MEM_MAPTYPE_UVM) {
-          RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 1); // prefetch to device
-          HT.TgtPtrBegin = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
-          int rt = RTL->data_submit(RTLDeviceID, (void*)HT.TgtPtrBegin, HstPtrBegin, Size);
-          if (rt != OFFLOAD_SUCCESS)
-            LLD_DP("Copying data to device failed.\n");
           LLD_DP("  Remap " DPxMOD " from UM to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
           deviceSize += Size;
           umSize -= Size;
         } else if (PreMap == MEM_MAPTYPE_HOST) {
-          HT.TgtPtrBegin = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
-          int rt = RTL->data_submit(RTLDeviceID, (void*)HT.TgtPtrBegin, HstPtrBegin, Size);
-          if (rt != OFFLOAD_SUCCESS)
-            LLD_DP("Copying data to device failed.\n");
           LLD_DP("  Remap " DPxMOD " from host to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
           deviceSize += Size;
         } else if (PreMap == MEM_MAPTYPE_SDEV) {
           RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 0); // pin to host
           RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 5); // prefetch to host
-          HT.TgtPtrBegin = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
-          int rt = RTL->data_submit(RTLDeviceID, (void*)HT.TgtPtrBegin, HstPtrBegin, Size);
-          if (rt != OFFLOAD_SUCCESS)
-            LLD_DP("Copying data to device failed.\n");
           LLD_DP("  Remap " DPxMOD " from soft device to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
         } else if (PreMap == MEM_MAPTYPE_PART) {
           RTL->data_opt(RTLDeviceID, HT.DevSize, HstPtrBegin, 0); // pin to host
           RTL->data_opt(RTLDeviceID, HT.DevSize, HstPtrBegin, 5); // prefetch to host
-          HT.TgtPtrBegin = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
-          int rt = RTL->data_submit(RTLDeviceID, (void*)HT.TgtPtrBegin, HstPtrBegin, Size);
-          if (rt != OFFLOAD_SUCCESS)
-            LLD_DP("Copying data to device failed.\n");
           LLD_DP("  Remap " DPxMOD " from part to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
         }
       }
@@ -757,15 +1190,37 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
 
     HstPtrBegin = (void*)HT.HstPtrBegin;
     Size = HT.HstPtrEnd - HT.HstPtrBegin;
+    // An unmapped entry still holds its place; all but device memory, which
+    // is reused or freed below, is given back before it is placed again.
+    unrecycleEntry(HT);
+    if (!HT.IsDeleted) {
+      mem_map_type PreMap = getMemMapType(HT.MapType);
+      if (PreMap == MEM_MAPTYPE_SDEV)
+        deviceSize -= Size;
+      else if (PreMap == MEM_MAPTYPE_UVM)
+        umSize -= Size;
+      else if (PreMap == MEM_MAPTYPE_PART)
+        deviceSize -= HT.DevSize;
+    }
+    // Other unmapped entries make room before the budget is exceeded; the
+    // device memory of this one is either reused or freed.
+    int64_t Need = Size - getHeldSize(HT);
+    if (!PinHost && Need > availDevSize())
+      releaseRecycled(Need - availDevSize());
     uintptr_t tp;
     if (UVM && PinHost) { // delay decision
+      if (HT.TgtPtrBegin != HT.HstPtrBegin && !HT.IsDeleted) {
+        deviceSize -= Size;
+        data_delete((void *)HT.TgtPtrBegin);
+        LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
+      }
       tp = (uintptr_t)HstPtrBegin;
       HT.Decided = false;
       IsNew = false;
     } else if (UVM) {
-      if (HT.TgtPtrBegin != HT.HstPtrBegin) {
+      if (HT.TgtPtrBegin != HT.HstPtrBegin && !HT.IsDeleted) {
         deviceSize -= Size;
-        RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+        data_delete((void *)HT.TgtPtrBegin);
         LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
       }
       LLD_DP("  Remap " DPxMOD " to UM, size=%ld\n", DPxPTR(HstPtrBegin), Size);
@@ -773,9 +1228,9 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
       umSize += Size;
       //RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 2);
     } else if (SoftDev) {
-      if (HT.TgtPtrBegin != HT.HstPtrBegin) {
+      if (HT.TgtPtrBegin != HT.HstPtrBegin && !HT.IsDeleted) {
         deviceSize -= Size;
-        RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+        data_delete((void *)HT.TgtPtrBegin);
         LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
       }
       LLD_DP("  Remap " DPxMOD " to soft device, size=%ld\n", DPxPTR(HstPtrBegin), Size);
@@ -784,9 +1239,9 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
       RTL->data_opt(RTLDeviceID, Size, HstPtrBegin, 1); // prefetch
       deviceSize += Size;
     } else if (CurMap == MEM_MAPTYPE_PART) {
-      if (HT.TgtPtrBegin != HT.HstPtrBegin) {
+      if (HT.TgtPtrBegin != HT.HstPtrBegin && !HT.IsDeleted) {
         deviceSize -= Size;
-        RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+        data_delete((void *)HT.TgtPtrBegin);
         LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
       }
       LLD_DP("  Remap " DPxMOD " to part, size=%ld (%ld)\n", DPxPTR(HstPtrBegin), Size, PartDevSize);
@@ -796,9 +1251,9 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
       deviceSize += PartDevSize;
       RTL->data_opt(RTLDeviceID, Size-PartDevSize, (void*)(tp+PartDevSize), 0); // pin to host
     } else if (PinHost) {
-      if (HT.TgtPtrBegin != HT.HstPtrBegin) {
+      if (HT.TgtPtrBegin != HT.HstPtrBegin && !HT.IsDeleted) {
         deviceSize -= Size;
-        RTL->data_delete(RTLDeviceID, (void *)HT.TgtPtrBegin);
+        data_delete((void *)HT.TgtPtrBegin);
         LLD_DP("  Unmap " DPxMOD " from device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(HT.TgtPtrBegin), Size);
       }
       tp = (uintptr_t)HstPtrBegin;
@@ -809,11 +1264,21 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         tp = HT.TgtPtrBegin;
       } else {
         LLD_DP("  Remap " DPxMOD " to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(tp), Size);
-        tp = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+        tp = (uintptr_t)data_alloc(Size, HstPtrBegin);
+        if (!tp) {
+          // What the entry held is given back above, so it goes away.
+          DP("Device allocation of %ld bytes failed\n", Size);
+          HT.IsDeleted = true;
+          HT.RefCount = 0;
+          releaseEntry(lr.Entry);
+          DataMapMtx.unlock();
+          return NULL;
+        }
         deviceSize += Size;
       }
     }
     HT.IsValid = true;
+    HT.IsDeleted = false;
     HT.TgtPtrBegin = tp;
     HT.MapType = MapType;
     HT.ChangeMap = false;
@@ -822,9 +1287,19 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
     // FIXME: reallocate space if necessary
     // Explicit extension of mapped data - not allowed.
     LLD_DP("Explicit extension of mapping is not allowed.\n");
+  } else if (Size && HostDataToTargetMap.find((uintptr_t)HstPtrBegin) !=
+             HostDataToTargetMap.end()) {
+    // An entry the lookup did not report, e.g. an empty one, starts here and
+    // the index keeps one entry per address: fail before placing anything.
+    DP("A mapping already starts at " DPxMOD "\n", DPxPTR(HstPtrBegin));
+    DataMapMtx.unlock();
+    return NULL;
   } else if (Size) {
     // If it is not contained and Size > 0 we should create a new entry for it.
     IsNew = true;
+    // lld: unmapped entries make room before the budget is exceeded
+    if (!PinHost && Size > availDevSize())
+      releaseRecycled(Size - availDevSize());
     //uintptr_t tp = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
     // lld: uvm
     uintptr_t tp;
@@ -862,15 +1337,22 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
         deviceSize += DevSize;
         RTL->data_opt(RTLDeviceID, Size-DevSize, (void*)(tp+DevSize), 0); // pin to host
       } else {
-        tp = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+        tp = (uintptr_t)data_alloc(Size, HstPtrBegin);
         deviceSize += Size;
         LLD_DP("  Map " DPxMOD " to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(tp), Size);
       }
     } else {
-      tp = (uintptr_t)RTL->data_alloc(RTLDeviceID, Size, HstPtrBegin);
+      tp = (uintptr_t)data_alloc(Size, HstPtrBegin);
       deviceSize += Size;
       LLD_DP("  Map " DPxMOD " to device (" DPxMOD "), size=%ld\n", DPxPTR(HstPtrBegin), DPxPTR(tp), Size);
     }
+    if (!tp) {
+      // Nothing is recorded; the caller fails the mapping.
+      DP("Device allocation of %ld bytes failed\n", Size);
+      deviceSize -= Size;
+      DataMapMtx.unlock();
+      return NULL;
+    }
     DP("Creating new map entry: HstBase=" DPxMOD ", HstBegin=" DPxMOD ", "
         "HstEnd=" DPxMOD ", TgtBegin=" DPxMOD "\n", DPxPTR(HstPtrBase),
         DPxPTR(HstPtrBegin), DPxPTR((uintptr_t)HstPtrBegin + Size), DPxPTR(tp));
@@ -882,32 +1364,35 @@ void *DeviceTy::getOrAllocTgtPtr(void *HstPtrBegin, void *HstPtrBase,
     DataEntry.MapType = MapType;
     // lld: replacement info
     DataEntry.Reuse = getGlobalReuse(MapType);
-    HostDataToTargetMap.push_front(DataEntry);
-    DMEP = &(*HostDataToTargetMap.begin());
+    // No entry starts here, as checked above under the same lock.
+    DMEP = &(*HostDataToTargetMap.insert(DataEntry));
     // lld: insert to cluster
-    if (CurrentCluster && IsNewCluster) {
-      CurrentCluster->Members.push_front(DMEP);
-      DMEP->Clusters.push_front(CurrentCluster);
-    }
+    if (CurrentCluster && IsNewCluster)
+      addToCluster(DMEP, CurrentCluster);
     rc = (void *)tp;
   }
 
-  DataMapMtx.unlock();
+  // Nothing was mapped (zero-sized section that is not mapped yet).
+  if (!DMEP) {
+    DataMapMtx.unlock();
+    return rc;
+  }
 #ifdef LLD_VERBOSE
   if (DMEP->ReuseDist > 0 && CurrentCluster) {
     if (DMEP->ReuseDist + DMEP->TimeStamp == GlobalTimeStamp) {
       LLD_DP("  Reuse distance hit\n");
     } else {
-      LLD_DP("  Reuse distance miss: %lu + %lu != %lu\n", DMEP->TimeStamp, DMEP->ReuseDist, GlobalTimeStamp);
+      LLD_DP("  Reuse distance miss: %lu + %lu != %lu\n",
+          DMEP->TimeStamp.load(), DMEP->ReuseDist, GlobalTimeStamp.load());
     }
   }
 #endif
   // lld: update replacement info
-  DMEP->Locality = (double)getLocalReuse(MapType) * loopTripCnt / Size;
-  DMEP->TimeStamp = GlobalTimeStamp;
-  DMEP->ReuseDist = getReuseDist(MapType);
+  getPolicy(*this).touch(*DMEP, MapType, Size, loopTripCnt);
   if (CurMap == MEM_MAPTYPE_PART)
     DMEP->DevSize = PartDevSize;
+  queuePrefetch(*DMEP);
+  DataMapMtx.unlock();
   return rc;
 }
 
@@ -926,9 +1411,9 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
   uint64_t ltc = Device.loopTripCnt;
   bool data_region = (host_ptr == NULL ? true : false);
   if (data_region)
-    LLD_DP("DATA\t\t\t\t(#iter: %lu    device: %ld    UM: %ld) at %lu\n", ltc, Device.deviceSize, Device.umSize, GlobalTimeStamp)
+    LLD_DP("DATA\t\t\t\t(#iter: %lu    device: %ld    UM: %ld) at %lu\n", ltc, Device.deviceSize.load(), Device.umSize.load(), GlobalTimeStamp.load())
   else
-    LLD_DP("COMPUTE (" DPxMOD ")\t(#iter: %lu    device: %ld    UM: %ld) at %lu\n", DPxPTR(host_ptr), ltc, Device.deviceSize, Device.umSize, GlobalTimeStamp)
+    LLD_DP("COMPUTE (" DPxMOD ")\t(#iter: %lu    device: %ld    UM: %ld) at %lu\n", DPxPTR(host_ptr), ltc, Device.deviceSize.load(), Device.umSize.load(), GlobalTimeStamp.load())
 
   double CP = 0.0;
   std::vector<std::pair<int32_t, int64_t>> argList;
@@ -942,29 +1427,31 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
     if (!(arg_types[i] & OMP_TGT_MAPTYPE_RANK))
       continue;
     argList.push_back(std::make_pair(i, arg_types[i]));
-    if (GMode == 1) // UM mode
+    if (Device.GMode == 1) // UM mode
       new_arg_types[i] |= OMP_TGT_MAPTYPE_UVM;
-    else if (GMode == 2) { // DEV mode
-    } else if (GMode == 3) // HOST mode
+    else if (Device.GMode == 2) { // DEV mode
+    } else if (Device.GMode == 3) // HOST mode
       new_arg_types[i] |= OMP_TGT_MAPTYPE_HOST;
-    else if (GMode == 4) // HYB mode
+    else if (Device.GMode == 4) // HYB mode
       new_arg_types[i] |= OMP_TGT_MAPTYPE_HYB;
-    else if (GMode == 5) // SDEV mode
+    else if (Device.GMode == 5) // SDEV mode
       new_arg_types[i] |= OMP_TGT_MAPTYPE_SDEV;
     // cluster priority
     CP += getGlobalReuse(arg_types[i]);
   }
-  if (GMode > 0 || argList.size() == 0)
+  if (Device.GMode > 0 || argList.size() == 0)
     return std::make_pair(new_arg_types, new_arg_sizes);
 
+  // Placement decisions read and rewrite entries all over the mapping table.
+  Device.DataMapMtx.lock();
+
   // look up cluster
   if (!data_region) {
     Device.CurrentCluster = Device.lookupCluster(host_ptr);
     if (Device.CurrentCluster) {
       Device.IsNewCluster = false;
     } else {
-      Device.DataClusters.push_front(DataClusterTy(host_ptr));
-      Device.CurrentCluster = &*(Device.DataClusters.begin());
+      Device.CurrentCluster = Device.addCluster(host_ptr);
       Device.IsNewCluster = true;
     }
   } else
@@ -973,6 +1460,7 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
     Device.CurrentCluster->Priority = CP / argList.size();
 
   // restore size and maptype
+  int64_t RegionSize = 0;
   LookupResult *LRs = (LookupResult*)malloc(sizeof(LookupResult)*arg_num);
   for (auto I : argList) {
     int32_t idx = I.first;
@@ -982,30 +1470,41 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
         (lr.Flags.InvalidContained || lr.Flags.InvalidExtendsB || lr.Flags.InvalidExtendsA))
       DataSize = lr.Entry->HstPtrEnd - lr.Entry->HstPtrBegin;
     new_arg_sizes[idx] = DataSize;
+    RegionSize += DataSize;
     if (lr.Entry != Device.HostDataToTargetMap.end() &&
         (!lr.Entry->Decided || !lr.Entry->IsValid)) {
       // restore recorded maptype
       new_arg_types[idx] &= ~0x3ff;
       new_arg_types[idx] |= lr.Entry->MapType & 0x3ff;
     }
+    // lld: unmapped entries of this region are about to be remapped and must
+    // not be released to make room for it; prefetched ones are used now
+    if (lr.Entry != Device.HostDataToTargetMap.end()) {
+      Device.unrecycleEntry(*lr.Entry);
+      Device.usePrefetched(*lr.Entry);
+    }
     // set irreplaceable
-    //if (GMode < 0 && GMode != -2)
+    //if (Device.GMode < 0 && Device.GMode != -2)
     //  if (lr.Entry != Device.HostDataToTargetMap.end() && lr.Entry->IsValid && (getMemMapType(lr.Entry->MapType) <= MEM_MAPTYPE_UVM))
     //    lr.Entry->Irreplaceable = true;
     // lld: insert to cluster
     if (lr.Entry != Device.HostDataToTargetMap.end() &&
-        Device.CurrentCluster) {
-      lr.Entry->Clusters.push_front(Device.CurrentCluster);
-      Device.CurrentCluster->Members.push_front(&*(lr.Entry));
-    }
+        Device.CurrentCluster)
+      addToCluster(&*(lr.Entry), Device.CurrentCluster);
     LRs[idx] = lr;
   }
-  std::sort(argList.begin(), argList.end(), std::bind(rankArgs, std::placeholders::_1, std::placeholders::_2, Device, new_arg_sizes));
+  // lld: cached pool blocks must not push this region out of device memory
+  Device.trimMemPool(RegionSize);
+  ReplacementPolicyTy &Policy = getPolicy(Device);
+  std::stable_sort(argList.begin(), argList.end(),
+      [&](std::pair<int32_t, int64_t> A, std::pair<int32_t, int64_t> B) {
+        return Policy.placeBefore(A.second, new_arg_sizes[A.first],
+            B.second, new_arg_sizes[B.first], ltc);
+      });
 
-  if (GMode == 0) { // cluster
+  if (Device.GMode == 0) { // cluster
     uint64_t CSize = 0;
     uint64_t RSize = 0;
-    LookupResult *LRs = (LookupResult*)malloc(sizeof(LookupResult)*arg_num);
     for (auto I : argList) {
       int32_t idx = I.first;
       int64_t DataSize = new_arg_sizes[idx];
@@ -1027,7 +1526,10 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
         Device.CurrentCluster->Size = CSize;
       else
         assert(Device.CurrentCluster->Size == CSize && "The size of cluster should be consistent.");
-      replaceDataCluster(Device, RSize, total_dev_size - Device.deviceSize - Device.umSize, argList, LRs, new_arg_types, new_arg_sizes, args_base, ltc);
+      // lld: unmapped entries are released before anything is replaced
+      if ((int64_t)RSize > Device.availDevSize())
+        Device.releaseRecycled(RSize - Device.availDevSize());
+      replaceDataCluster(Device, RSize, Device.availDevSize(), argList, LRs, new_arg_types, new_arg_sizes, args_base, ltc);
     } else if (RSize > 0) {
       for (auto I : argList) {
         int32_t idx = I.first;
@@ -1041,7 +1543,7 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
         new_arg_types[idx] |= OMP_TGT_MAPTYPE_HOST;
       }
     }
-  } else { // global, local, or reuse distance based
+  } else { // per object, see getPolicy()
     // argument index for partial mapping
     int32_t partial_idx = -1;
     HostDataToTargetTy *partial_HT;
@@ -1058,11 +1560,14 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
         HT->Irreplaceable = true;
       if (HT && HT->IsValid && (getMemMapType(HT->MapType) <= MEM_MAPTYPE_UVM))
         continue;
-      int64_t AvailSize = total_dev_size - used_dev_size - Device.deviceSize - Device.umSize;
-      assert(AvailSize > -1024); // reserve space for non UM variables
+      int64_t AvailSize = Device.availDevSize(used_dev_size);
+      assert(AvailSize >= Device.MemBudget - Device.MemCapacity); // non UM variables stay within the reserve
       if (HT && getMemMapType(HT->MapType) == MEM_MAPTYPE_PART)
         AvailSize += HT->DevSize;
-      //if (GMode <= -2 && data_region) // in reuse distance and local management, do not map in target data region
+      // lld: unmapped entries are released before anything is replaced
+      if (!data_region && DataSize > AvailSize)
+        AvailSize += Device.releaseRecycled(DataSize - AvailSize);
+      //if (Device.GMode <= -2 && data_region) // in reuse distance and local management, do not map in target data region
       if (data_region)
         placeDataObj(Device, HT, idx, new_arg_types[idx], DataSize, args_base[idx], ltc, data_region);
       else if (DataSize <= AvailSize)
@@ -1070,20 +1575,28 @@ std::pair<int64_t*, int64_t*> target_uvm_data_mapping_opt(DeviceTy &Device, void
       else {
         int64_t allocateSize = replaceDataObj(Device, HT, idx, new_arg_types[idx], DataSize, AvailSize, args_base[idx], ltc, data_region);
         used_dev_size += allocateSize;
-        if (PartialMap && allocateSize == 0 && partial_idx == -1) {
+        if (Device.PartialMap && allocateSize == 0 && partial_idx == -1) {
           partial_idx = idx;
           partial_HT = HT;
         }
       }
     }
-    if (PartialMap && partial_idx >= 0) {
-      int64_t AvailSize = total_dev_size - used_dev_size - Device.deviceSize - Device.umSize;
+    if (Device.PartialMap && partial_idx >= 0) {
+      int64_t AvailSize = Device.availDevSize(used_dev_size);
       if (partial_HT && getMemMapType(partial_HT->MapType) == MEM_MAPTYPE_PART)
         AvailSize += partial_HT->DevSize;
       replaceDataObjPart(Device, partial_HT, partial_idx, new_arg_types[partial_idx], new_arg_sizes[partial_idx], AvailSize, args_base[partial_idx], ltc, data_region);
     }
     cleanReplaceMetadata(Device);
   }
+  // lld: index again the unmapped entries of this region, see above
+  for (auto I : argList) {
+    HostDataToTargetMapTy::iterator Entry = LRs[I.first].Entry;
+    if (Entry != Device.HostDataToTargetMap.end() && !Entry->IsValid &&
+        Entry->RefCount == 0 && Entry->RecycledKey < 0)
+      Device.recycleEntry(*Entry);
+  }
   free(LRs);
+  Device.DataMapMtx.unlock();
   return std::make_pair(new_arg_types, new_arg_sizes);
 }
@@ -0,0 +1,299 @@
+// lld: out-of-core streaming of target regions
+//
+// A region whose arrays do not fit on the device can run tile by tile. The
+// compiler marks with OMP_TGT_MAPTYPE_STREAM the arrays indexed by the
+// iteration of the region's loop and the first-private literal holding the
+// extent N of that index; OMP_TGT_MAPTYPE_HALO gives how many elements around
+// its own an iteration reads. An iteration writes only its own element of the
+// streamed arrays, and N divides the size of each of them.
+//
+// [0, N) is split into tiles that fill a window of device memory. Each
+// streamed array gets two buffers of a tile and its halos: while the kernel
+// runs on one, the results of the previous tile are copied back and the next
+// tile is copied in through the other. The kernel is launched once per tile
+// with the literal set to the length of the tile with its halos, clamped to
+// [0, N), and the streamed arguments pointing to the buffers, so that its
+// iteration j is the iteration w0 + j of the region, w0 being the first
+// element in the buffer. Only the elements of the tile itself are copied back.
+//
+// Marked regions are streamed when they do not fit in what is left of the
+// device budget, through what is left of it; LLD_STREAM=<MB> streams them
+// through windows of that size whatever fits, LLD_STREAM=0 never.
+
+struct StreamArrayTy {
+  int32_t Arg;
+  int32_t Param; // position among the kernel arguments
+  int64_t ElemSize;
+  void *Buf[2];
+};
+
+struct StreamPlanTy {
+  // Map types of the region with the streamed arrays turned into literals, so
+  // that target_data_begin and target_data_end leave them alone.
+  std::vector<int64_t> ArgTypes;
+  std::vector<StreamArrayTy> Arrays;
+  int32_t ExtentParam = -1;
+  int64_t Extent = 0;
+  int64_t Halo = 0;
+  int64_t Tile = 0;
+};
+
+static inline int64_t getStreamHalo(int64_t Type) {
+  return (Type & OMP_TGT_MAPTYPE_HALO) >> 36;
+}
+
+/// Decide whether a region is streamed and how. Return false to map and
+/// launch it as usual.
+static bool planStream(DeviceTy &Device, int32_t arg_num, void **args_base,
+    void **args, int64_t *arg_sizes, int64_t *arg_types, StreamPlanTy &Plan) {
+  // Device memory of UM and HOST modes is never the limit.
+  if (Device.StreamWindow == 0 || Device.GMode == 1 || Device.GMode == 3)
+    return false;
+
+  int64_t StreamBytes = 0, OtherBytes = 0, IterBytes = 0;
+  int32_t Param = 0, ExtentArg = -1;
+  for (int32_t i = 0; i < arg_num; ++i) {
+    int64_t Type = arg_types[i];
+    int32_t Pos = (Type & OMP_TGT_MAPTYPE_TARGET_PARAM) ? Param++ : -1;
+    if (!(Type & OMP_TGT_MAPTYPE_STREAM)) {
+      if (!(Type & (OMP_TGT_MAPTYPE_LITERAL | OMP_TGT_MAPTYPE_PRIVATE)))
+        OtherBytes += arg_sizes[i];
+      continue;
+    }
+    if (Pos < 0 || member_of(Type) >= 0 ||
+        (Type & (OMP_TGT_MAPTYPE_PTR_AND_OBJ | OMP_TGT_MAPTYPE_PRIVATE))) {
+      DP("Argument %d cannot be streamed, region not streamed\n", i);
+      return false;
+    }
+    Plan.Halo = std::max(Plan.Halo, getStreamHalo(Type));
+    if (Type & OMP_TGT_MAPTYPE_LITERAL) {
+      if (ExtentArg >= 0) {
+        DP("Two extents given, region not streamed\n");
+        return false;
+      }
+      ExtentArg = i;
+      Plan.ExtentParam = Pos;
+      // Literals narrower than a pointer fill its low bytes.
+      intptr_t Value = (intptr_t)args_base[i];
+      Plan.Extent = arg_sizes[i] == 4 ? (int32_t)Value : (int64_t)Value;
+    } else {
+      Plan.Arrays.push_back({i, Pos, 0, {NULL, NULL}});
+      StreamBytes += arg_sizes[i];
+    }
+  }
+  if (ExtentArg < 0 && Plan.Arrays.empty())
+    return false;
+  if (ExtentArg < 0 || Plan.Arrays.empty() || Plan.Extent <= 0) {
+    DP("No streamed arrays or no extent, region not streamed\n");
+    return false;
+  }
+
+  for (StreamArrayTy &A : Plan.Arrays) {
+    if (arg_sizes[A.Arg] % Plan.Extent) {
+      DP("Size of argument %d is not a multiple of the extent %" PRId64
+          ", region not streamed\n", A.Arg, Plan.Extent);
+      return false;
+    }
+    A.ElemSize = arg_sizes[A.Arg] / Plan.Extent;
+    IterBytes += A.ElemSize;
+    for (int32_t i = 0; i < arg_num; ++i)
+      if (member_of(arg_types[i]) == A.Arg) {
+        DP("Argument %d has members, region not streamed\n", A.Arg);
+        return false;
+      }
+  }
+
+  int64_t Avail;
+  Device.DataMapMtx.lock_shared();
+  // What is on the device already is what the region must use.
+  for (StreamArrayTy &A : Plan.Arrays) {
+    LookupResult lr = Device.lookupMapping(args[A.Arg], arg_sizes[A.Arg]);
+    if (lr.Flags.IsContained || lr.Flags.ExtendsBefore ||
+        lr.Flags.ExtendsAfter) {
+      Device.DataMapMtx.unlock_shared();
+      DP("Argument %d is mapped, region not streamed\n", A.Arg);
+      return false;
+    }
+  }
+  Avail = Device.availDevSize();
+  Device.DataMapMtx.unlock_shared();
+
+  if (Device.StreamWindow < 0 && StreamBytes + OtherBytes <= Avail)
+    return false;
+  int64_t Window = Device.StreamWindow > 0 ? Device.StreamWindow :
+      Avail - OtherBytes;
+  Plan.Tile = std::min(Window / (2 * IterBytes) - 2 * Plan.Halo, Plan.Extent);
+  // A tile shorter than the halo would copy in what the previous one has yet
+  // to copy back.
+  if (Plan.Tile < std::max(Plan.Halo, (int64_t)1)) {
+    DP("Window of %" PRId64 " bytes too small to stream %" PRId64 " bytes "
+        "per iteration with a halo of %" PRId64 "\n", Window, IterBytes,
+        Plan.Halo);
+    return false;
+  }
+
+  Plan.ArgTypes.assign(arg_types, arg_types + arg_num);
+  for (StreamArrayTy &A : Plan.Arrays)
+    Plan.ArgTypes[A.Arg] = OMP_TGT_MAPTYPE_TARGET_PARAM |
+        OMP_TGT_MAPTYPE_LITERAL;
+  DP("Streaming %" PRId64 " iterations of %" PRId64 " bytes in tiles of %"
+      PRId64 ", halo %" PRId64 "\n", Plan.Extent, IterBytes, Plan.Tile,
+      Plan.Halo);
+  return true;
+}
+
+/// Run the kernel TgtEntryPtr over the tiles of Plan, its streamed arrays
+/// double-buffered through device memory. TgtArgs and TgtOffsets are those
+/// of the launch; AsyncInfo holds what was enqueued for the other arguments.
+static int target_stream(DeviceTy &Device, StreamPlanTy &Plan,
+    void *TgtEntryPtr, std::vector<void *> &TgtArgs,
+    std::vector<ptrdiff_t> &TgtOffsets, void **args_base, void **args,
+    int64_t *arg_types, int32_t team_num, int32_t thread_limit, uint64_t ltc,
+    int IsTeamConstruct, __tgt_async_info *AsyncInfo, ProfileScopeTy &Prof) {
+  const int64_t N = Plan.Extent, H = Plan.Halo, T = Plan.Tile;
+  const int64_t NumTiles = (N + T - 1) / T;
+  int rc = Device.synchronize(AsyncInfo);
+
+  int64_t WindowBytes = 0;
+  for (StreamArrayTy &A : Plan.Arrays)
+    WindowBytes += 2 * (T + 2 * H) * A.ElemSize;
+  Device.DataMapMtx.lock();
+  Device.trimMemPool(WindowBytes);
+  Device.deviceSize += WindowBytes;
+  Device.DataMapMtx.unlock();
+  for (StreamArrayTy &A : Plan.Arrays)
+    for (int b = 0; b < 2; ++b) {
+      A.Buf[b] = Device.data_alloc((T + 2 * H) * A.ElemSize, args[A.Arg]);
+      if (!A.Buf[b]) {
+        DP("Allocation of the window of argument %d failed\n", A.Arg);
+        rc = OFFLOAD_FAIL;
+      }
+    }
+
+  // Iterations [S, E) of tile K, [W0, W1) with its halos.
+  auto bounds = [&](int64_t K, int64_t &S, int64_t &E, int64_t &W0,
+      int64_t &W1) {
+    S = K * T;
+    E = std::min(S + T, N);
+    W0 = std::max(S - H, (int64_t)0);
+    W1 = std::min(E + H, N);
+  };
+  int64_t Bytes = 0;
+  auto copyIn = [&](int64_t K, __tgt_async_info *Queue) {
+    int64_t S, E, W0, W1;
+    bounds(K, S, E, W0, W1);
+    for (StreamArrayTy &A : Plan.Arrays) {
+      if (!(arg_types[A.Arg] & OMP_TGT_MAPTYPE_TO))
+        continue;
+      int64_t Size = (W1 - W0) * A.ElemSize;
+      profileBytes(A.Arg, Size, true);
+      Bytes += Size;
+      if (Device.data_submit(A.Buf[K % 2], (char *)args[A.Arg] +
+              W0 * A.ElemSize, Size, Queue) != OFFLOAD_SUCCESS)
+        rc = OFFLOAD_FAIL;
+    }
+  };
+  auto copyOut = [&](int64_t K, __tgt_async_info *Queue) {
+    int64_t S, E, W0, W1;
+    bounds(K, S, E, W0, W1);
+    for (StreamArrayTy &A : Plan.Arrays) {
+      if (!(arg_types[A.Arg] & OMP_TGT_MAPTYPE_FROM))
+        continue;
+      int64_t Size = (E - S) * A.ElemSize;
+      profileBytes(A.Arg, Size, false);
+      Bytes += Size;
+      if (Device.data_retrieve((char *)args[A.Arg] + S * A.ElemSize,
+              (char *)A.Buf[K % 2] + (S - W0) * A.ElemSize, Size,
+              Queue) != OFFLOAD_SUCCESS)
+        rc = OFFLOAD_FAIL;
+    }
+  };
+
+  // Kernels go to one queue, copies to another. The transfers of the first
+  // and last tiles overlap nothing; they give the transfer rate from which
+  // the time of the others is estimated.
+  __tgt_async_info Compute = {NULL}, Copy = {NULL};
+  uint64_t ExposedTicks = 0, SerialTicks = 0;
+  int64_t SerialBytes = 0;
+  uint64_t Start = ProfileClockTy::now();
+  if (rc == OFFLOAD_SUCCESS) {
+    copyIn(0, &Copy);
+    SerialBytes = Bytes;
+    if (Device.synchronize(&Copy) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+  }
+  SerialTicks = ProfileClockTy::now() - Start;
+
+  for (int64_t K = 0; K < NumTiles && rc == OFFLOAD_SUCCESS; ++K) {
+    int64_t S, E, W0, W1;
+    bounds(K, S, E, W0, W1);
+    for (StreamArrayTy &A : Plan.Arrays) {
+      TgtArgs[A.Param] = A.Buf[K % 2];
+      TgtOffsets[A.Param] = (intptr_t)args_base[A.Arg] - (intptr_t)args[A.Arg];
+    }
+    TgtArgs[Plan.ExtentParam] = (void *)(intptr_t)(W1 - W0);
+    // The loop skips as many iterations of the tile as of the region.
+    uint64_t TileLtc = ltc ? std::max((int64_t)ltc - N + W1 - W0,
+        (int64_t)1) : 0;
+
+    // The copies, which use the other buffer, are enqueued before the launch
+    // as RTLs may run the kernel on the calling thread. Without asynchronous
+    // copies the RTL runs them right away; they are then exposed between T1
+    // and T2.
+    uint64_t T1 = ProfileClockTy::now();
+    if (K > 0)
+      copyOut(K - 1, &Copy);
+    if (K + 1 < NumTiles)
+      copyIn(K + 1, &Copy);
+    uint64_t T2 = ProfileClockTy::now();
+    int rk;
+    if (IsTeamConstruct)
+      rk = Device.run_team_region(TgtEntryPtr, &TgtArgs[0], &TgtOffsets[0],
+          TgtArgs.size(), team_num, thread_limit, TileLtc, &Compute);
+    else
+      rk = Device.run_region(TgtEntryPtr, &TgtArgs[0], &TgtOffsets[0],
+          TgtArgs.size(), &Compute);
+    if (rk != OFFLOAD_SUCCESS ||
+        Device.synchronize(&Compute) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+    uint64_t T3 = ProfileClockTy::now();
+    if (Device.synchronize(&Copy) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+    uint64_t T4 = ProfileClockTy::now();
+    ExposedTicks += (T2 - T1) + (T4 - T3);
+  }
+
+  if (rc == OFFLOAD_SUCCESS) {
+    uint64_t T0 = ProfileClockTy::now();
+    int64_t Before = Bytes;
+    copyOut(NumTiles - 1, &Copy);
+    if (Device.synchronize(&Copy) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+    SerialTicks += ProfileClockTy::now() - T0;
+    SerialBytes += Bytes - Before;
+  }
+  Device.synchronize(&Compute);
+  Device.synchronize(&Copy);
+
+  for (StreamArrayTy &A : Plan.Arrays)
+    for (int b = 0; b < 2; ++b)
+      if (A.Buf[b] && Device.data_delete(A.Buf[b]) != OFFLOAD_SUCCESS)
+        rc = OFFLOAD_FAIL;
+  Device.DataMapMtx.lock();
+  Device.deviceSize -= WindowBytes;
+  Device.DataMapMtx.unlock();
+  if (rc != OFFLOAD_SUCCESS)
+    return rc;
+
+  // Transfer time estimated at the rate of the first and last tiles, and
+  // the part of it the kernels hid.
+  uint64_t CopyTicks = SerialBytes ?
+      (uint64_t)((double)SerialTicks * Bytes / SerialBytes) : 0;
+  uint64_t HiddenTicks = SerialTicks + ExposedTicks < CopyTicks ?
+      CopyTicks - SerialTicks - ExposedTicks : 0;
+  DP("Streamed %" PRId64 " tiles of %" PRId64 " iterations, %" PRId64
+      " bytes moved, %.1f%% of the transfer time overlapped\n", NumTiles, T,
+      Bytes, CopyTicks ? 100.0 * HiddenTicks / CopyTicks : 0.0);
+  Prof.addStream(NumTiles, CopyTicks, HiddenTicks);
+  return rc;
+}
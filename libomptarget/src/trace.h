@@ -0,0 +1,148 @@
+// lld: offload trace recording and replay
+//
+// With LLD_RECORD=<file>, every target data begin, end and update construct
+// and every target region is appended to a binary trace with its arguments,
+// their map types, reuse bits included, and the loop trip count pushed for it.
+// __tgt_replay_trace() feeds such a trace through the placement engine of
+// replacement.h on a simulated device that only counts what would be moved,
+// so that the policies of LLD_GPU_MODE can be compared for a given device
+// capacity without the device; tools/lld-replay is the driver. The replay is
+// only built with OMPTARGET_REPLAY, into libomptarget-replay.so, which exports
+// nothing else; libomptarget.so itself only records.
+
+#include <cstdio>
+
+#include "lld_replay.h"
+
+class TraceRecorderTy {
+  std::mutex Mtx;
+  FILE *F;
+
+public:
+  TraceRecorderTy() : F(NULL) {}
+
+  ~TraceRecorderTy() {
+    std::lock_guard<std::mutex> LG(Mtx);
+    if (F)
+      fclose(F);
+    F = NULL;
+  }
+
+  void open(const char *Path) {
+    F = fopen(Path, "wb");
+    if (!F) {
+      fprintf(stderr, "Libomptarget: cannot record a trace to %s\n", Path);
+      return;
+    }
+    fwrite(TraceMagic, sizeof(TraceMagic), 1, F);
+    fwrite(&TraceVersion, sizeof(TraceVersion), 1, F);
+  }
+
+  void record(TraceEventKindTy Kind, int64_t DeviceId, void *HostPtr,
+      uint64_t TripCount, int32_t ArgNum, void **ArgsBase, void **Args,
+      int64_t *ArgSizes, int64_t *ArgTypes) {
+    if (!F)
+      return;
+    TraceEventTy E = {(uint32_t)Kind, (int32_t)DeviceId, ArgNum, 0,
+                      (uint64_t)(uintptr_t)HostPtr, TripCount};
+    std::vector<TraceArgTy> A(ArgNum);
+    for (int32_t i = 0; i < ArgNum; ++i)
+      A[i] = {(uint64_t)(uintptr_t)ArgsBase[i], (uint64_t)(uintptr_t)Args[i],
+              ArgSizes[i], ArgTypes[i]};
+    std::lock_guard<std::mutex> LG(Mtx);
+    if (!F)
+      return;
+    fwrite(&E, sizeof(E), 1, F);
+    fwrite(A.data(), sizeof(TraceArgTy), ArgNum, F);
+  }
+};
+
+static TraceRecorderTy TraceRecorder;
+
+#ifdef OMPTARGET_REPLAY
+class TraceReaderTy {
+  FILE *F;
+  bool Truncated;
+
+public:
+  TraceReaderTy() : F(NULL), Truncated(false) {}
+  ~TraceReaderTy() {
+    if (F)
+      fclose(F);
+  }
+
+  bool open(const char *Path) {
+    F = fopen(Path, "rb");
+    if (!F)
+      return false;
+    char Magic[sizeof(TraceMagic)];
+    uint32_t Version;
+    return fread(Magic, sizeof(Magic), 1, F) == 1 &&
+        !memcmp(Magic, TraceMagic, sizeof(Magic)) &&
+        fread(&Version, sizeof(Version), 1, F) == 1 && Version == TraceVersion;
+  }
+
+  // Read the next event; false at the end of the trace or if it is cut short.
+  bool next(TraceEventTy &E, std::vector<TraceArgTy> &A) {
+    if (fread(&E, sizeof(E), 1, F) != 1)
+      return false;
+    A.resize(E.ArgNum > 0 ? E.ArgNum : 0);
+    if (fread(A.data(), sizeof(TraceArgTy), A.size(), F) != A.size()) {
+      Truncated = true;
+      return false;
+    }
+    return true;
+  }
+
+  bool truncated() const { return Truncated; }
+};
+
+/// Simulated RTL of a replay. Device memory is handed out from a range no host
+/// pointer can fall in and data movement is only counted in ReplayStats.
+static __tgt_replay_stats *ReplayStats = NULL;
+static std::map<uintptr_t, int64_t> ReplayAllocs;
+static uintptr_t ReplayNextPtr;
+static int64_t ReplayLiveBytes;
+
+static const uintptr_t ReplayDeviceBase = 0x1000000000000000UL;
+
+static int32_t replay_init_device(int32_t) { return OFFLOAD_SUCCESS; }
+
+static void replay_data_opt(int32_t, int64_t Size, void *, int32_t Type) {
+  if (Type == 1) // prefetch to device
+    ReplayStats->BytesToDevice += Size;
+  else if (Type == 5) // prefetch to host
+    ReplayStats->BytesFromDevice += Size;
+}
+
+static void *replay_data_alloc(int32_t, int64_t Size, void *) {
+  if (Size <= 0)
+    return NULL;
+  uintptr_t Ptr = ReplayNextPtr;
+  ReplayNextPtr += (Size + 255) & ~(int64_t)255;
+  ReplayAllocs[Ptr] = Size;
+  ReplayLiveBytes += Size;
+  if (ReplayLiveBytes > ReplayStats->PeakDeviceBytes)
+    ReplayStats->PeakDeviceBytes = ReplayLiveBytes;
+  return (void *)Ptr;
+}
+
+static int32_t replay_data_delete(int32_t, void *TgtPtr) {
+  auto It = ReplayAllocs.find((uintptr_t)TgtPtr);
+  if (It == ReplayAllocs.end())
+    return OFFLOAD_FAIL;
+  ReplayLiveBytes -= It->second;
+  ReplayAllocs.erase(It);
+  return OFFLOAD_SUCCESS;
+}
+
+static int32_t replay_data_submit(int32_t, void *, void *, int64_t Size) {
+  ReplayStats->BytesToDevice += Size;
+  return OFFLOAD_SUCCESS;
+}
+
+static int32_t replay_data_retrieve(int32_t, void *, void *, int64_t Size) {
+  ReplayStats->BytesFromDevice += Size;
+  return OFFLOAD_SUCCESS;
+}
+#endif // OMPTARGET_REPLAY
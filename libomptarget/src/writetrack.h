@@ -0,0 +1,308 @@
+// lld: host-side write tracking
+//
+// With LLD_WRITE_TRACK=<KB>, the entries of at least that size held in device
+// memory remember which of their pages the device holds unchanged. A page
+// copied to the device is write-protected; the first host write to it faults
+// into a SIGSEGV handler that marks it changed and lifts the protection.
+// Copies to the device, from map(always, to:) or target update to(), then
+// send only the changed pages, coalesced into runs, and the parts of the
+// entry outside its whole pages, which are not tracked.
+//
+// The pages of a range are marked changed again when the device side may
+// differ: when data is copied from the device into them, when a region maps
+// them, whatever the map type, and when the device memory of the entry is
+// released. Only copies between regions, e.g. target update to() of data the
+// host changed in part, are saved. Tracking ends when the entry is unmapped.
+//
+// Tracking is off unless LLD_WRITE_TRACK is set, as it changes the process
+// (see README.txt): the handler is installed for SIGSEGV process-wide, and
+// system calls writing into a protected page, such as read(2), fail with
+// EFAULT rather than fault, so data read that way must not be mapped while
+// tracked.
+
+#include <csignal>
+#include <sys/mman.h>
+
+#define WRITE_TRACK_SLOTS 1024
+
+/// Tracked pages of an entry: the whole pages [Begin, End) of its host range,
+/// with a bit of Bits set while the device holds the page unchanged. The
+/// signal handler reads Begin, End and Bits without locking; the rest is
+/// guarded by WriteTrackMtx. A retired slot keeps its range until it is
+/// reused, for faults taken while it was retired.
+struct WriteTrackTy {
+  std::atomic<uintptr_t> Begin{0};
+  std::atomic<uintptr_t> End{0};
+  std::atomic<std::atomic<uint64_t> *> Bits{nullptr};
+  size_t Words = 0;
+  int32_t DeviceID = -1; // -1 if retired
+  uintptr_t TgtPtrBegin = 0; // device copy the bits refer to
+};
+
+static WriteTrackTy WriteTracks[WRITE_TRACK_SLOTS];
+// Slots used so far, and where to look for a free one.
+static std::atomic<int32_t> WriteTracksUsed(0);
+static int32_t WriteTrackNext = 0;
+static std::mutex WriteTrackMtx;
+static uintptr_t WriteTrackPage = 0;
+static struct sigaction WriteTrackPrevAction;
+static std::once_flag WriteTrackHandlerFlag;
+
+static void writeTrackHandler(int Sig, siginfo_t *Info, void *Context) {
+  uintptr_t Addr = (uintptr_t)Info->si_addr;
+  if (Info->si_code == SEGV_ACCERR) {
+    int32_t Used = WriteTracksUsed.load();
+    for (int32_t i = 0; i < Used; ++i) {
+      WriteTrackTy &T = WriteTracks[i];
+      uintptr_t Begin = T.Begin.load();
+      if (Addr < Begin || Addr >= T.End.load())
+        continue;
+      // The slot is being reused: retry the access once it is done.
+      if (T.Begin.load() != Begin)
+        return;
+      uintptr_t Page = (Addr - Begin) / WriteTrackPage;
+      T.Bits.load()[Page / 64].fetch_and(~(1UL << (Page % 64)));
+      if (!mprotect((void *)(Begin + Page * WriteTrackPage), WriteTrackPage,
+              PROT_READ | PROT_WRITE))
+        return;
+    }
+  }
+  // Not a tracked page: pass the fault on as if there were no handler.
+  if (WriteTrackPrevAction.sa_flags & SA_SIGINFO)
+    WriteTrackPrevAction.sa_sigaction(Sig, Info, Context);
+  else if (WriteTrackPrevAction.sa_handler != SIG_DFL &&
+           WriteTrackPrevAction.sa_handler != SIG_IGN)
+    WriteTrackPrevAction.sa_handler(Sig);
+  else
+    signal(Sig, SIG_DFL); // the access faults again, fatally
+}
+
+static void installWriteTrackHandler() {
+  WriteTrackPage = sysconf(_SC_PAGESIZE);
+  struct sigaction Action;
+  memset(&Action, 0, sizeof(Action));
+  Action.sa_sigaction = writeTrackHandler;
+  Action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&Action.sa_mask);
+  if (sigaction(SIGSEGV, &Action, &WriteTrackPrevAction))
+    DP("Cannot install the write tracking handler\n");
+}
+
+static inline bool isPageCurrent(const WriteTrackTy &T, size_t Page) {
+  return T.Bits.load()[Page / 64].load() & (1UL << (Page % 64));
+}
+
+// Forget what the device holds of the pages of T overlapping [Lo, Hi) and
+// make them writable; WriteTrackMtx is held.
+static void invalidatePages(WriteTrackTy &T, uintptr_t Lo, uintptr_t Hi) {
+  uintptr_t Begin = T.Begin.load(), End = T.End.load();
+  Lo = std::max(Lo, Begin);
+  Hi = std::min(Hi, End);
+  if (Lo >= Hi)
+    return;
+  size_t First = (Lo - Begin) / WriteTrackPage;
+  size_t Last = (Hi - Begin - 1) / WriteTrackPage;
+  std::atomic<uint64_t> *Bits = T.Bits.load();
+  for (size_t P = First; P <= Last; ++P)
+    Bits[P / 64].fetch_and(~(1UL << (P % 64)));
+  mprotect((void *)(Begin + First * WriteTrackPage),
+      (Last - First + 1) * WriteTrackPage, PROT_READ | PROT_WRITE);
+}
+
+// Take a free slot for the whole pages [Begin, End) of an entry, or return
+// -1 if all of them are taken; WriteTrackMtx is held.
+static int32_t takeWriteTrack(int32_t DeviceID, uintptr_t Begin,
+    uintptr_t End) {
+  int32_t Slot = -1;
+  if (WriteTracksUsed < WRITE_TRACK_SLOTS) {
+    Slot = WriteTracksUsed;
+  } else {
+    for (int32_t k = 0; k < WRITE_TRACK_SLOTS && Slot < 0; ++k) {
+      int32_t i = (WriteTrackNext + k) % WRITE_TRACK_SLOTS;
+      if (WriteTracks[i].DeviceID < 0)
+        Slot = i;
+    }
+    if (Slot < 0)
+      return -1;
+    WriteTrackNext = (Slot + 1) % WRITE_TRACK_SLOTS;
+  }
+
+  WriteTrackTy &T = WriteTracks[Slot];
+  size_t Words = ((End - Begin) / WriteTrackPage + 63) / 64;
+  T.End = 0;
+  T.Begin = Begin;
+  if (Words > T.Words) {
+    // A bitmap that is replaced is not freed: the handler may still be
+    // reading it.
+    T.Bits = new std::atomic<uint64_t>[Words];
+    T.Words = Words;
+  }
+  std::atomic<uint64_t> *Bits = T.Bits.load();
+  for (size_t w = 0; w < Words; ++w)
+    Bits[w] = 0;
+  T.DeviceID = DeviceID;
+  T.TgtPtrBegin = 0;
+  T.End = End;
+  if (Slot == WriteTracksUsed)
+    ++WriteTracksUsed;
+  return Slot;
+}
+
+bool DeviceTy::trackWrites(void *HstPtrBegin, void *TgtPtrBegin, int64_t Size,
+    std::vector<std::pair<int64_t, int64_t>> &Runs) {
+  if (WriteTrackMin <= 0 || Size <= 0 || HstPtrBegin == TgtPtrBegin)
+    return false;
+  std::call_once(WriteTrackHandlerFlag, installWriteTrackHandler);
+
+  // The caller holds a reference to the entry, so it stays in the table once
+  // found; only the lookup needs the table lock.
+  DataMapMtx.lock_shared();
+  LookupResult lr = lookupMapping(HstPtrBegin, Size);
+  if (!lr.Flags.IsContained) {
+    DataMapMtx.unlock_shared();
+    return false;
+  }
+  HostDataToTargetTy &HT = *lr.Entry;
+  uintptr_t EntryBegin = HT.HstPtrBegin, EntryEnd = HT.HstPtrEnd;
+  uintptr_t EntryTgt = HT.TgtPtrBegin;
+  DataMapMtx.unlock_shared();
+
+  uintptr_t Hst = (uintptr_t)HstPtrBegin;
+  if ((int64_t)(EntryEnd - EntryBegin) < WriteTrackMin ||
+      EntryTgt == EntryBegin ||
+      (uintptr_t)TgtPtrBegin != EntryTgt + (Hst - EntryBegin))
+    return false;
+  uintptr_t PageBegin = (EntryBegin + WriteTrackPage - 1) &
+      ~(WriteTrackPage - 1);
+  uintptr_t PageEnd = EntryEnd & ~(WriteTrackPage - 1);
+  if (PageBegin >= PageEnd)
+    return false;
+
+  std::lock_guard<std::mutex> TLG(WriteTrackMtx);
+  if (HT.WriteTrack < 0) {
+    HT.WriteTrack = takeWriteTrack(DeviceID, PageBegin, PageEnd);
+    if (HT.WriteTrack < 0) {
+      LLD_DP("  No write tracking slot left for " DPxMOD "\n",
+          DPxPTR(EntryBegin));
+      return false;
+    }
+  }
+  WriteTrackTy &T = WriteTracks[HT.WriteTrack];
+  if (T.TgtPtrBegin != EntryTgt) {
+    // A new device copy holds nothing yet.
+    invalidatePages(T, PageBegin, PageEnd);
+    T.TgtPtrBegin = EntryTgt;
+  }
+
+  // Pages wholly copied become current and are protected before the copy,
+  // so that a write racing with it is seen.
+  uintptr_t Hi = Hst + Size;
+  uintptr_t RunBegin = 0, ProtBegin = 0, ProtEnd = 0;
+  bool InRun = false;
+  std::atomic<uint64_t> *Bits = T.Bits.load();
+  for (uintptr_t A = Hst; A < Hi;) {
+    uintptr_t Next = Hi;
+    bool Changed = true;
+    if (A < PageBegin) {
+      Next = std::min(PageBegin, Hi);
+    } else if (A < PageEnd) {
+      size_t P = (A - PageBegin) / WriteTrackPage;
+      uintptr_t PageStart = PageBegin + P * WriteTrackPage;
+      Next = std::min(PageStart + WriteTrackPage, Hi);
+      Changed = !isPageCurrent(T, P);
+      if (Changed && A == PageStart && Next == PageStart + WriteTrackPage) {
+        Bits[P / 64].fetch_or(1UL << (P % 64));
+        if (ProtEnd != A) {
+          if (ProtEnd > ProtBegin)
+            mprotect((void *)ProtBegin, ProtEnd - ProtBegin, PROT_READ);
+          ProtBegin = A;
+        }
+        ProtEnd = Next;
+      }
+    }
+    if (Changed && !InRun) {
+      RunBegin = A;
+      InRun = true;
+    } else if (!Changed && InRun) {
+      Runs.push_back(std::make_pair(RunBegin - Hst, A - RunBegin));
+      InRun = false;
+    }
+    A = Next;
+  }
+  if (InRun)
+    Runs.push_back(std::make_pair(RunBegin - Hst, Hi - RunBegin));
+  if (ProtEnd > ProtBegin)
+    mprotect((void *)ProtBegin, ProtEnd - ProtBegin, PROT_READ);
+  return true;
+}
+
+void DeviceTy::invalidateWrites(void *HstPtrBegin, int64_t Size) {
+  std::lock_guard<std::mutex> LG(WriteTrackMtx);
+  int32_t Used = WriteTracksUsed;
+  for (int32_t i = 0; i < Used; ++i)
+    if (WriteTracks[i].DeviceID == DeviceID)
+      invalidatePages(WriteTracks[i], (uintptr_t)HstPtrBegin,
+          (uintptr_t)HstPtrBegin + Size);
+}
+
+void DeviceTy::dropWrites(void *TgtPtrBegin) {
+  std::lock_guard<std::mutex> LG(WriteTrackMtx);
+  int32_t Used = WriteTracksUsed;
+  for (int32_t i = 0; i < Used; ++i) {
+    WriteTrackTy &T = WriteTracks[i];
+    if (T.DeviceID == DeviceID && T.TgtPtrBegin == (uintptr_t)TgtPtrBegin) {
+      invalidatePages(T, T.Begin, T.End);
+      T.TgtPtrBegin = 0;
+    }
+  }
+}
+
+void DeviceTy::untrackWrites(HostDataToTargetTy &HT) {
+  std::lock_guard<std::mutex> LG(WriteTrackMtx);
+  if (HT.WriteTrack < 0)
+    return;
+  WriteTrackTy &T = WriteTracks[HT.WriteTrack];
+  invalidatePages(T, T.Begin, T.End);
+  T.DeviceID = -1;
+  T.TgtPtrBegin = 0;
+  HT.WriteTrack = -1;
+}
+
+/// Copy [HstPtrBegin, HstPtrBegin + Size) of argument Arg to TgtPtrBegin,
+/// through Batch if there is one and it takes the copy, leaving out what the
+/// device holds unchanged if the entry is tracked.
+static int submitTracked(DeviceTy &Device, int32_t Arg, void *TgtPtrBegin,
+    void *HstPtrBegin, int64_t Size, SubmitBatchTy *Batch,
+    __tgt_async_info *AsyncInfo) {
+  std::vector<std::pair<int64_t, int64_t>> Runs;
+  if (!Device.trackWrites(HstPtrBegin, TgtPtrBegin, Size, Runs))
+    Runs.assign(1, std::make_pair((int64_t)0, Size));
+  int rc = OFFLOAD_SUCCESS;
+  int64_t Sent = 0;
+  for (auto &R : Runs) {
+    void *Tgt = (char *)TgtPtrBegin + R.first;
+    void *Hst = (char *)HstPtrBegin + R.first;
+    Sent += R.second;
+    if (Batch && Batch->add(Device, Tgt, Hst, R.second))
+      continue;
+    if (Device.data_submit(Tgt, Hst, R.second, AsyncInfo) != OFFLOAD_SUCCESS)
+      rc = OFFLOAD_FAIL;
+  }
+  if (Sent < Size)
+    LLD_DP("  Send %ld of %ld bytes in %zu runs, the rest is unchanged\n",
+        Sent, Size, Runs.size());
+  profileBytes(Arg, Sent, true);
+  profileUnchanged(Size - Sent);
+  return rc;
+}
+
+/// A region may write whatever it maps, map(to:) included: the device copy
+/// then differs from the host.
+static void invalidateRegionWrites(DeviceTy &Device, int32_t arg_num,
+    void **args, int64_t *arg_sizes, int64_t *arg_types) {
+  if (!Device.WriteTrackMin)
+    return;
+  for (int32_t i = 0; i < arg_num; ++i)
+    if (!(arg_types[i] & (OMP_TGT_MAPTYPE_LITERAL | OMP_TGT_MAPTYPE_PRIVATE)))
+      Device.invalidateWrites(args[i], arg_sizes[i]);
+}
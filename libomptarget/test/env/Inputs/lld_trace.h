@@ -0,0 +1,46 @@
+// Writing traces in the format of LLD_RECORD for the replay tests.
+
+#ifndef LLD_TRACE_H
+#define LLD_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lld_replay.h"
+
+#define MB (1L << 20)
+
+// An array as the trace sees it.
+struct Obj {
+  uint64_t Base;
+  int64_t Size;
+};
+
+// to|from with the reuse bits of the compiler: rank in 0xff000, accesses per
+// iteration (x8) in 0xfff00000 and reuse distance in 0x3f0000000000.
+static int64_t reuseType(int64_t Rank, int64_t Local, int64_t Dist) {
+  return 0x3 | (Rank << 12) | (Local << 20) | (Dist << 40);
+}
+
+static FILE *openTrace(const char *Path) {
+  FILE *F = fopen(Path, "wb");
+  fwrite(TraceMagic, sizeof(TraceMagic), 1, F);
+  fwrite(&TraceVersion, sizeof(TraceVersion), 1, F);
+  return F;
+}
+
+// Append an event mapping Objs[Use[i]] with Type[i]; target regions (HostPtr
+// set) run 1M iterations.
+static void event(FILE *F, uint32_t Kind, uint64_t HostPtr,
+                  const struct Obj *Objs, int N, const int *Use,
+                  const int64_t *Type) {
+  struct TraceEventTy E = {Kind, 0, N, 0, HostPtr, HostPtr ? 1L << 20 : 0};
+  fwrite(&E, sizeof(E), 1, F);
+  for (int i = 0; i < N; ++i) {
+    const struct Obj *O = &Objs[Use[i]];
+    struct TraceArgTy A = {O->Base, O->Base, O->Size, Type[i]};
+    fwrite(&A, sizeof(A), 1, F);
+  }
+}
+
+#endif // LLD_TRACE_H
@@ -0,0 +1,26 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=FAKE
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 LLD_DEV_SIZE_1=512 LLD_DEV_RESERVE=0 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=ENV
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=FAKE
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 LLD_DEV_SIZE_1=512 LLD_DEV_RESERVE=0 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=ENV
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=FAKE
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 LLD_DEV_SIZE_1=512 LLD_DEV_RESERVE=0 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=ENV
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=FAKE
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_DEBUG=1 LIBOMPTARGET_DEVICE_MEMORY=1024 LLD_DEV_SIZE_1=512 LLD_DEV_RESERVE=0 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=ENV
+// REQUIRES: libomptarget-debug
+
+int main(void) {
+  int A = 0;
+#pragma omp target device(0) map(tofrom: A)
+  { A += 1; }
+#pragma omp target device(1) map(tofrom: A)
+  { A += 1; }
+  return A != 2;
+}
+
+// The capacity comes from the plugin, an eighth of it is left in reserve.
+// FAKE: Device 0 memory: capacity 1073741824, budget 939524096
+// FAKE: Device 1 memory: capacity 1073741824, budget 939524096
+
+// LLD_DEV_SIZE_1 overrides the capacity of device 1 only.
+// ENV: Device 0 memory: capacity 1073741824, budget 1073741824
+// ENV: Device 1 memory: capacity 536870912, budget 536870912
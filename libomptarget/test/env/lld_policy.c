@@ -0,0 +1,63 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -lomptarget-replay && %libomptarget-run-aarch64-unknown-linux-gnu %t.trace | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64-ibm-linux-gnu %t.trace | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64le-ibm-linux-gnu %t.trace | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -lomptarget-replay && %libomptarget-run-x86_64-pc-linux-gnu %t.trace | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#include "Inputs/lld_trace.h"
+
+#define NARR 8
+
+// Two small arrays used densely by every region and six larger ones used
+// sparsely in turn, all inside one data region.
+static void writeTrace(const char *Path) {
+  FILE *F = openTrace(Path);
+
+  struct Obj Objs[NARR];
+  int All[NARR];
+  int64_t Data[NARR];
+  for (int i = 0; i < NARR; ++i) {
+    Objs[i].Base = 0x10000000UL * (i + 1);
+    Objs[i].Size = (2 + i % 3) * MB;
+    All[i] = i;
+    Data[i] = reuseType(1, 0, 0);
+  }
+  event(F, TRACE_DATA_BEGIN, 0, Objs, NARR, All, Data);
+  for (int r = 0; r < 30; ++r) {
+    int K = r % 6;
+    int Use[4] = {0, 1, 2 + K, 2 + (K + 3) % 6};
+    int N = (r % 2) ? 4 : 3;
+    int64_t Type[4];
+    for (int i = 0; i < N; ++i)
+      Type[i] = Use[i] < 2 ? reuseType(i + 1, 16, 1) : reuseType(i + 1, 1, 6);
+    event(F, TRACE_TARGET, 0x400000 + K * 16, Objs, N, Use, Type);
+  }
+  event(F, TRACE_DATA_END, 0, Objs, NARR, All, Data);
+  fclose(F);
+}
+
+int main(int argc, char **argv) {
+  writeTrace(argv[1]);
+
+  // Replay with LLD_GPU_MODE=LRU and LLD_GPU_MODE=COST on 10 MB.
+  struct __tgt_replay_stats LRU, Cost;
+  int rc = __tgt_replay_trace(argv[1], -4, 10 * MB, 0, 0, 0, &LRU);
+  rc |= __tgt_replay_trace(argv[1], -5, 10 * MB, 0, 0, 0, &Cost);
+  printf("rc = %d\n", rc);
+  printf("LRU evicts: %s\n", LRU.Evictions > 0 ? "yes" : "no");
+  printf("COST evicts: %s\n", Cost.Evictions > 0 ? "yes" : "no");
+  printf("COST moves less: %s\n",
+         Cost.BytesToDevice + Cost.BytesFromDevice <
+                 LRU.BytesToDevice + LRU.BytesFromDevice
+             ? "yes"
+             : "no");
+  return 0;
+}
+
+// LRU keeps swapping the sparse arrays in over the dense ones; the cost model
+// keeps the dense arrays and leaves the sparse ones in UM.
+// CHECK: rc = 0
+// CHECK: LRU evicts: yes
+// CHECK: COST evicts: no
+// CHECK: COST moves less: yes
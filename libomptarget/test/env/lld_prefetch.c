@@ -0,0 +1,66 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -lomptarget-replay && %libomptarget-run-aarch64-unknown-linux-gnu %t.trace | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64-ibm-linux-gnu %t.trace | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64le-ibm-linux-gnu %t.trace | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -lomptarget-replay && %libomptarget-run-x86_64-pc-linux-gnu %t.trace | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#include "Inputs/lld_trace.h"
+
+enum { X, Y, T1, T2, S, NARR };
+static const struct Obj Objs[NARR] = {{0x10000000, 6 * MB},
+                                      {0x20000000, 6 * MB},
+                                      {0x30000000, 1 * MB},
+                                      {0x40000000, 6 * MB},
+                                      {0x50000000, 1 * MB}};
+
+// Three regions per step inside a data region holding X and Y: X with a
+// small temporary, Y with a large one, then a small one alone. Each of X and
+// Y is used again three time stamps later, the temporaries never.
+static void writeTrace(const char *Path) {
+  FILE *F = openTrace(Path);
+
+  int Data[2] = {X, Y};
+  int64_t DataType[2] = {reuseType(1, 0, 0), reuseType(1, 0, 0)};
+  event(F, TRACE_DATA_BEGIN, 0, Objs, 2, Data, DataType);
+  for (int r = 0; r < 10; ++r) {
+    int R1[2] = {X, T1}, R2[2] = {Y, T2}, R3[1] = {S};
+    int64_t Type[2] = {reuseType(1, 8, 3), reuseType(1, 8, 0)};
+    event(F, TRACE_TARGET, 0x400000, Objs, 2, R1, Type);
+    event(F, TRACE_TARGET, 0x400010, Objs, 2, R2, Type);
+    event(F, TRACE_TARGET, 0x400020, Objs, 1, R3, Type + 1);
+  }
+  event(F, TRACE_DATA_END, 0, Objs, 2, Data, DataType);
+  fclose(F);
+}
+
+int main(int argc, char **argv) {
+  writeTrace(argv[1]);
+
+  // Replay with LLD_GPU_MODE=RD without and with LLD_PREFETCH=2, on 16 MB and
+  // on 14 MB.
+  struct __tgt_replay_stats Off, On, Small;
+  int rc = __tgt_replay_trace(argv[1], -3, 16 * MB, 0, 0, 0, &Off);
+  rc |= __tgt_replay_trace(argv[1], -3, 16 * MB, 0, 0, 2, &On);
+  rc |= __tgt_replay_trace(argv[1], -3, 14 * MB, 0, 0, 2, &Small);
+  printf("rc = %d\n", rc);
+  printf("off: %ld prefetches\n", (long)Off.Prefetches);
+  printf("on: %ld prefetches, %ld hits, %ld late, %ld useless\n",
+         (long)On.Prefetches, (long)On.PrefetchHits, (long)On.PrefetchLate,
+         (long)On.PrefetchUseless);
+  printf("on: more resident: %s\n",
+         On.ResidentBytes > Off.ResidentBytes ? "yes" : "no");
+  printf("small: %ld prefetches, %ld late\n", (long)Small.Prefetches,
+         (long)Small.PrefetchLate);
+  return 0;
+}
+
+// The large temporary leaves no room for Y, which is placed on the host. Once
+// the temporary is gone, Y is moved in while the small region runs; X, pushed
+// out by the temporary next time, likewise. The last prefetch is issued
+// before the data region ends. With less memory Y never fits ahead of time.
+// CHECK: rc = 0
+// CHECK: off: 0 prefetches
+// CHECK: on: 10 prefetches, 9 hits, 0 late, 1 useless
+// CHECK: on: more resident: yes
+// CHECK: small: 0 prefetches, 9 late
@@ -0,0 +1,29 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_PROFILE=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_PROFILE=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_PROFILE=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_PROFILE=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#define N 1024
+
+int main(void) {
+  double A[N], B[N];
+  for (int i = 0; i < N; ++i)
+    A[i] = i;
+
+  for (int r = 0; r < 3; ++r) {
+#pragma omp target map(to: A) map(from: B)
+    for (int i = 0; i < N; ++i)
+      B[i] = A[i];
+  }
+
+  printf("B[N-1] = %g\n", B[N - 1]);
+  return 0;
+}
+
+// CHECK: B[N-1] = 1023
+// CHECK: Libomptarget profile: 1 regions
+// CHECK: __omp_offloading_{{.*}}main{{.*}} 3 {{.*}} 24576 24576
+// CHECK: arg 0 {{.*}} 24576 0
+// CHECK: arg 1 {{.*}} 0 24576
@@ -0,0 +1,45 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -lomptarget-replay && env LLD_RECORD=%t.trace %libomptarget-run-aarch64-unknown-linux-gnu && %libomptarget-run-aarch64-unknown-linux-gnu %t.trace | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -lomptarget-replay && env LLD_RECORD=%t.trace %libomptarget-run-powerpc64-ibm-linux-gnu && %libomptarget-run-powerpc64-ibm-linux-gnu %t.trace | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -lomptarget-replay && env LLD_RECORD=%t.trace %libomptarget-run-powerpc64le-ibm-linux-gnu && %libomptarget-run-powerpc64le-ibm-linux-gnu %t.trace | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -lomptarget-replay && env LLD_RECORD=%t.trace %libomptarget-run-x86_64-pc-linux-gnu && %libomptarget-run-x86_64-pc-linux-gnu %t.trace | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lld_replay.h"
+
+#define N 1024
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    // Replay the recorded trace with device mapping (LLD_GPU_MODE=DEV).
+    struct __tgt_replay_stats S;
+    int rc = __tgt_replay_trace(argv[1], 2, 1L << 30, 0, 0, 0, &S);
+    printf("rc = %d, events = %ld\n", rc, (long)S.Events);
+    printf("to = %ld, from = %ld\n", (long)S.BytesToDevice,
+           (long)S.BytesFromDevice);
+    printf("resident = %ld of %ld\n", (long)S.ResidentBytes,
+           (long)S.AccessedBytes);
+    return 0;
+  }
+
+  double A[N], B[N];
+  for (int i = 0; i < N; ++i)
+    A[i] = i;
+
+#pragma omp target data map(to: A)
+  {
+    for (int r = 0; r < 3; ++r) {
+#pragma omp target map(from: B)
+      for (int i = 0; i < N; ++i)
+        B[i] = A[i];
+    }
+  }
+  return 0;
+}
+
+// A is copied once and stays on the device; B is copied back after each of
+// the three regions.
+// CHECK: rc = 0, events = 5
+// CHECK: to = 8192, from = 24576
+// CHECK: resident = 24576 of 49152
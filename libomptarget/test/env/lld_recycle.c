@@ -0,0 +1,57 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -lomptarget-replay && %libomptarget-run-aarch64-unknown-linux-gnu %t.trace | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64-ibm-linux-gnu %t.trace | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -lomptarget-replay && %libomptarget-run-powerpc64le-ibm-linux-gnu %t.trace | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -lomptarget-replay && %libomptarget-run-x86_64-pc-linux-gnu %t.trace | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#include "Inputs/lld_trace.h"
+
+#define NARR 8
+
+// Target regions without an enclosing data region, each mapping two of eight
+// 4 MB arrays in turn, so that every array is unmapped and mapped again.
+static void writeTrace(const char *Path) {
+  FILE *F = openTrace(Path);
+
+  struct Obj Objs[NARR];
+  for (int i = 0; i < NARR; ++i) {
+    Objs[i].Base = 0x10000000UL * (i + 1);
+    Objs[i].Size = 4 * MB;
+  }
+  int64_t Type[2] = {reuseType(1, 16, 8), reuseType(2, 16, 8)};
+  for (int r = 0; r < 40; ++r) {
+    int Use[2] = {r % NARR, (r + 1) % NARR};
+    event(F, TRACE_TARGET, 0x400000 + (r % NARR) * 16, Objs, 2, Use, Type);
+  }
+  fclose(F);
+}
+
+int main(int argc, char **argv) {
+  writeTrace(argv[1]);
+
+  // Replay with LLD_RECYCLE=1 on 20 MB, of which the unmapped arrays alone
+  // would take 32 MB.
+  static const int32_t Modes[] = {-1, -5, 2};
+  static const char *Names[] = {"OBJ", "COST", "DEV"};
+  for (int m = 0; m < 3; ++m) {
+    struct __tgt_replay_stats S;
+    int rc = __tgt_replay_trace(argv[1], Modes[m], 20 * MB, 0, 1, 0, &S);
+    printf("%s: rc = %d, fits: %s\n", Names[m], rc,
+           S.PeakDeviceBytes <= 20 * MB ? "yes" : "no");
+  }
+
+  // LLD_RECYCLE=2 keeps at most two unmapped arrays.
+  struct __tgt_replay_stats All, Two;
+  __tgt_replay_trace(argv[1], 2, 20 * MB, 0, 1, 0, &All);
+  __tgt_replay_trace(argv[1], 2, 20 * MB, 0, 2, 0, &Two);
+  printf("limit keeps less: %s\n",
+         Two.PeakDeviceBytes < All.PeakDeviceBytes ? "yes" : "no");
+  return 0;
+}
+
+// Unmapped arrays give their space back when a region needs it.
+// CHECK: OBJ: rc = 0, fits: yes
+// CHECK: COST: rc = 0, fits: yes
+// CHECK: DEV: rc = 0, fits: yes
+// CHECK: limit keeps less: yes
@@ -0,0 +1,57 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_GPU_MODE=DEV LLD_WRITE_TRACK=1 LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_GPU_MODE=DEV LLD_WRITE_TRACK=1 LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_GPU_MODE=DEV LLD_WRITE_TRACK=1 LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_GPU_MODE=DEV LLD_WRITE_TRACK=1 LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define PAGES 400
+#define ITERS 10
+
+int main(void) {
+  long Page = sysconf(_SC_PAGESIZE);
+  long N = PAGES * Page / sizeof(double);
+  double *T = aligned_alloc(Page, N * sizeof(double));
+  for (long i = 0; i < N; ++i)
+    T[i] = 1;
+
+  int Wrong = 0;
+#pragma omp target data map(to: T[0:N])
+  {
+    for (int It = 1; It <= ITERS; ++It) {
+      // 1% of the pages change.
+      for (long P = 0; P < PAGES; P += 100)
+        T[P * Page / sizeof(double)] += 1;
+#pragma omp target update to(T[0:N])
+    }
+
+    // A region may write its map(to:) copy, so the next update sends the
+    // whole array again.
+#pragma omp target map(to: T[0:N])
+    for (long i = 0; i < N; ++i)
+      T[i] = 0;
+    for (long P = 0; P < PAGES; P += 100)
+      T[P * Page / sizeof(double)] += 1;
+#pragma omp target update to(T[0:N])
+
+    double Sum = 0;
+#pragma omp target map(to: T[0:N]) map(from: Sum)
+    {
+      Sum = 0;
+      for (long i = 0; i < N; ++i)
+        Sum += T[i];
+    }
+    Wrong = Sum != N + (ITERS + 1) * (PAGES / 100);
+  }
+
+  // The whole array twice, then the changed pages of each update in between.
+  printf("wrong %d, expect %ld bytes\n", Wrong,
+         (long)(2 * N * sizeof(double) + ITERS * (PAGES / 100) * Page));
+  fflush(stdout);
+  return 0;
+}
+
+// CHECK: wrong 0, expect [[BYTES:[0-9]+]] bytes
+// CHECK: sim device 0: h2d {{[0-9]+}} transfers [[BYTES]] bytes
@@ -0,0 +1,68 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LIBOMPTARGET_NUMA_DEVICES=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LIBOMPTARGET_NUMA_DEVICES=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LIBOMPTARGET_NUMA_DEVICES=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LIBOMPTARGET_NUMA_DEVICES=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+#include <string.h>
+
+// Above the size from which the plugin binds blocks to the node.
+#define N (1 << 17)
+
+/// Nodes with cpus, numbered without gaps, as the plugin finds them.
+static int countNodes(void) {
+  int Nodes = 0;
+  for (int Node = 0; ; ++Node) {
+    char Path[64], List[256];
+    snprintf(Path, sizeof(Path), "/sys/devices/system/node/node%d/cpulist",
+             Node);
+    FILE *F = fopen(Path, "r");
+    if (!F)
+      break;
+    if (fgets(List, sizeof(List), F) && List[0] != '\n')
+      ++Nodes;
+    fclose(F);
+  }
+  return Nodes;
+}
+
+int main(void) {
+  int Nodes = countNodes();
+  int Devices = omp_get_num_devices();
+  // Without NUMA information the plugin keeps its usual devices.
+  printf("devices %s\n", !Nodes || Devices == Nodes ? "match" : "differ");
+
+  static double H[N];
+  int Wrong = 0;
+  for (int D = 0; D < Devices; ++D) {
+    double *P = omp_target_alloc(N * sizeof(double), D);
+    if (!P) {
+      ++Wrong;
+      continue;
+    }
+#pragma omp target is_device_ptr(P) device(D)
+    for (int i = 0; i < N; ++i)
+      P[i] = D + i;
+    omp_target_memcpy(H, P, N * sizeof(double), 0, 0, omp_get_initial_device(),
+                      D);
+    for (int i = 0; i < N; ++i)
+      Wrong += H[i] != D + i;
+    omp_target_free(P, D);
+  }
+
+  // Managed memory of the default device.
+  double *M = omp_target_alloc(N * sizeof(double), -100);
+  if (M) {
+    memset(M, 0, N * sizeof(double));
+    omp_target_free(M, omp_get_default_device());
+  } else {
+    ++Wrong;
+  }
+
+  printf("wrong %d\n", Wrong);
+  return Wrong;
+}
+
+// CHECK: devices match
+// CHECK: wrong 0
@@ -0,0 +1,55 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_MEMORY=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_MEMORY=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_MEMORY=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_MEMORY=1 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+
+// 4 MB, more than the 1 MB of the device.
+#define N (1 << 19)
+
+double A[N];
+
+int main(void) {
+  for (int i = 0; i < N; ++i)
+    A[i] = 1;
+
+  // Neither construct can map A: the data region maps nothing and the region
+  // falls back to the host.
+  int OnDevice = -1;
+#pragma omp target data map(tofrom: A)
+  {
+#pragma omp target map(tofrom: A) map(from: OnDevice)
+    {
+      OnDevice = !omp_is_initial_device();
+      for (int i = 0; i < N; ++i)
+        A[i] += 1;
+    }
+  }
+
+  printf("on device %d, A[0] = %g\n", OnDevice, A[0]);
+
+  // Likewise from the task of a nowait region.
+  OnDevice = -1;
+#pragma omp parallel num_threads(2)
+#pragma omp single
+  {
+#pragma omp target nowait map(tofrom: A) map(from: OnDevice)
+    {
+      OnDevice = !omp_is_initial_device();
+      for (int i = 0; i < N; ++i)
+        A[i] += 1;
+    }
+#pragma omp taskwait
+  }
+
+  printf("nowait on device %d, A[0] = %g\n", OnDevice, A[0]);
+  fflush(stdout);
+  return 0;
+}
+
+// CHECK: on device 0, A[0] = 2
+// CHECK: nowait on device 0, A[0] = 3
+// CHECK: sim device 0: allocs {{[0-9]+}} failed 3
+// CHECK: sim device 0: launches 0
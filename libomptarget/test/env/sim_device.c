@@ -0,0 +1,32 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_BANDWIDTH=1024 LIBOMPTARGET_SIM_LATENCY=5 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_BANDWIDTH=1024 LIBOMPTARGET_SIM_LATENCY=5 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_BANDWIDTH=1024 LIBOMPTARGET_SIM_LATENCY=5 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_GPU_MODE=DEV LIBOMPTARGET_SIM_DEVICES=1 LIBOMPTARGET_SIM_BANDWIDTH=1024 LIBOMPTARGET_SIM_LATENCY=5 LIBOMPTARGET_SIM_REPORT=- %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu
+
+#define N (1 << 19)
+
+double A[N], B[N];
+
+int main(void) {
+  for (int i = 0; i < N; ++i)
+    A[i] = i;
+
+#pragma omp target data map(to: A) map(from: B)
+  {
+    for (int r = 0; r < 3; ++r) {
+#pragma omp target map(to: A) map(tofrom: B)
+      for (int i = 0; i < N; ++i)
+        B[i] = A[i] + r;
+    }
+#pragma omp target update from(B)
+  }
+
+  return B[1] != 3;
+}
+
+// A is copied in once, B out at the update and at the end of the data region,
+// 4 MB each; a copy costs 5 us plus 4 MB at 1 GB/s.
+// CHECK: sim device 0: allocs 2 failed 0 managed 0 frees 2 peak 8388608
+// CHECK: sim device 0: h2d 1 transfers 4194304 bytes, d2h 2 transfers 8388608 bytes, d2d 0 transfers 0 bytes
+// CHECK: sim device 0: pages to device 0, to host 0
+// CHECK: sim device 0: launches 3, time 11733750 ns
@@ -0,0 +1,49 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+
+#define N 1024
+#define NUM_THREADS 8
+#define NUM_LAUNCHES 200
+
+int main(void) {
+  double A[N];
+  int Counts[NUM_THREADS];
+  int Errors = 0;
+
+  for (int i = 0; i < N; ++i)
+    A[i] = i;
+
+  // Every host thread hits the same mapping, so lookups and reference count
+  // updates on the device race with each other.
+#pragma omp target enter data map(to: A)
+
+#pragma omp parallel num_threads(NUM_THREADS)
+  {
+    int Tid = omp_get_thread_num();
+    int Count = 0;
+    for (int l = 0; l < NUM_LAUNCHES; ++l) {
+      double Sum = 0;
+#pragma omp target map(to: A) map(tofrom: Sum)
+      for (int i = 0; i < N; ++i)
+        Sum += A[i];
+      if (Sum == (double)N * (N - 1) / 2)
+        ++Count;
+    }
+    Counts[Tid] = Count;
+  }
+
+#pragma omp target exit data map(release: A)
+
+  for (int t = 0; t < NUM_THREADS; ++t)
+    if (Counts[t] != NUM_LAUNCHES)
+      ++Errors;
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
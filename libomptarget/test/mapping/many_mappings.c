@@ -0,0 +1,52 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_BLOCKS 10000
+#define BLOCK_SIZE 16
+
+int main(void) {
+  double *Blocks[NUM_BLOCKS];
+  int Errors = 0;
+
+  // Keep many disjoint sections mapped at the same time.
+  for (int b = 0; b < NUM_BLOCKS; ++b) {
+    Blocks[b] = (double *)malloc(BLOCK_SIZE * sizeof(double));
+    for (int i = 0; i < BLOCK_SIZE; ++i)
+      Blocks[b][i] = b;
+    double *B = Blocks[b];
+#pragma omp target enter data map(to: B[0:BLOCK_SIZE])
+  }
+
+  // Every launch has to find its sections among all the live mappings,
+  // including sub-sections that start in the middle of a mapped block.
+  for (int b = 0; b < NUM_BLOCKS; b += 97) {
+    double *B = Blocks[b];
+#pragma omp target map(tofrom: B[4:8])
+    for (int i = 4; i < 12; ++i)
+      B[i] += 1.0;
+  }
+
+  for (int b = NUM_BLOCKS - 1; b >= 0; --b) {
+    double *B = Blocks[b];
+#pragma omp target exit data map(from: B[0:BLOCK_SIZE])
+  }
+
+  for (int b = 0; b < NUM_BLOCKS; ++b) {
+    for (int i = 0; i < BLOCK_SIZE; ++i) {
+      double Expected = b + ((b % 97 == 0 && i >= 4 && i < 12) ? 1.0 : 0.0);
+      if (Blocks[b][i] != Expected)
+        ++Errors;
+    }
+    free(Blocks[b]);
+  }
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+
+  return Errors != 0;
+}
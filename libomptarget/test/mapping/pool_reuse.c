@@ -0,0 +1,39 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_POOL_SIZE=1 %libomptarget-run-aarch64-unknown-linux-gnu | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_POOL_SIZE=1 %libomptarget-run-powerpc64-ibm-linux-gnu | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_POOL_SIZE=1 %libomptarget-run-powerpc64le-ibm-linux-gnu | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_POOL_SIZE=1 %libomptarget-run-x86_64-pc-linux-gnu | %fcheck-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_SIZE (1 << 18)
+
+int main(void) {
+  int *A = (int *)malloc(MAX_SIZE * sizeof(int));
+  int Priv[64];
+  int Errors = 0;
+
+  // Map and release a mix of sizes, some larger than the 1MB pool, so that
+  // device blocks are reused, dropped from the pool and allocated again.
+  for (int r = 0; r < 40; ++r) {
+    int N = (r % 4 == 3) ? MAX_SIZE : 100 + 37 * r;
+    for (int i = 0; i < N; ++i)
+      A[i] = i;
+    for (int i = 0; i < 64; ++i)
+      Priv[i] = r;
+
+#pragma omp target map(tofrom: A[0:N]) firstprivate(Priv)
+    for (int i = 0; i < N; ++i)
+      A[i] += Priv[i % 64];
+
+    for (int i = 0; i < N; ++i)
+      if (A[i] != i + r)
+        ++Errors;
+  }
+
+  free(A);
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NUM_NODES 1000
+#define NODE_SIZE 4
+
+struct NodeTy {
+  double *Data;
+  int Id;
+};
+
+int main(void) {
+  struct NodeTy Nodes[NUM_NODES];
+  double *HostData[NUM_NODES];
+  int Errors = 0;
+
+  // Every node holds a pointer with its own shadow entry.
+  for (int n = 0; n < NUM_NODES; ++n) {
+    Nodes[n].Data = (double *)malloc(NODE_SIZE * sizeof(double));
+    Nodes[n].Id = n;
+    HostData[n] = Nodes[n].Data;
+    for (int i = 0; i < NODE_SIZE; ++i)
+      Nodes[n].Data[i] = n;
+  }
+#pragma omp target enter data map(to: Nodes[0:NUM_NODES])
+  for (int n = 0; n < NUM_NODES; ++n) {
+#pragma omp target enter data map(to: Nodes[n].Data[0:NODE_SIZE])
+  }
+
+  // Updating a few nodes must only restore their own pointers: host
+  // pointers after a copy back, device pointers after a copy to the device.
+  for (int n = NUM_NODES - 1; n >= 0; n -= 37) {
+    Nodes[n].Id = -n;
+#pragma omp target update to(Nodes[n:1])
+#pragma omp target map(alloc: Nodes[n:1])
+    {
+      Nodes[n].Data[0] += Nodes[n].Id;
+      Nodes[n].Id = 2 * n;
+    }
+#pragma omp target update from(Nodes[n:1])
+#pragma omp target update from(Nodes[n].Data[0:NODE_SIZE])
+    if (Nodes[n].Data != HostData[n] || Nodes[n].Id != 2 * n ||
+        Nodes[n].Data[0] != 0)
+      ++Errors;
+  }
+
+  for (int n = 0; n < NUM_NODES; ++n) {
+#pragma omp target exit data map(delete: Nodes[n].Data[0:NODE_SIZE])
+  }
+#pragma omp target exit data map(delete: Nodes[0:NUM_NODES])
+  for (int n = 0; n < NUM_NODES; ++n)
+    free(Nodes[n].Data);
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,49 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#define N 1024
+
+int A[N], B[N];
+
+int main(void) {
+  int Errors = 0;
+
+  for (int i = 0; i < N; ++i) {
+    A[i] = i;
+    B[i] = 0;
+  }
+
+  // Repeated launches inside a data region are served from the launch cache;
+  // swapping the buffers must still pick the right device pointers.
+#pragma omp target data map(tofrom: A, B)
+  for (int r = 0; r < 10; ++r) {
+    int *In = (r % 2) ? B : A;
+    int *Out = (r % 2) ? A : B;
+#pragma omp target map(to: In[0:N]) map(from: Out[0:N])
+    for (int i = 0; i < N; ++i)
+      Out[i] = In[i] + 1;
+  }
+
+  for (int i = 0; i < N; ++i)
+    if (A[i] != i + 10)
+      ++Errors;
+
+  // Once the data region is gone, a cached launch must not be replayed.
+  for (int i = 0; i < N; ++i)
+    A[i] = i;
+#pragma omp target map(to: A) map(from: B)
+  for (int i = 0; i < N; ++i)
+    B[i] = A[i] * 2;
+
+  for (int i = 0; i < N; ++i)
+    if (B[i] != 2 * i)
+      ++Errors;
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
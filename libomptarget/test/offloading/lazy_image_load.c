@@ -0,0 +1,32 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#pragma omp declare target
+int G = 5;
+#pragma omp end declare target
+
+int main(void) {
+  int Errors = 0;
+
+  // No region has been launched yet: updating a global must still load the
+  // image that owns it and map the device copy.
+  G = 7;
+#pragma omp target update from(G)
+  if (G != 5)
+    ++Errors;
+
+#pragma omp target
+  G += 1;
+
+#pragma omp target update from(G)
+  if (G != 6)
+    ++Errors;
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,53 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+
+#define N (1 << 20)
+#define SPIN_LIMIT 2000000000L
+
+double A[N];
+
+int main(void) {
+  volatile int Flag = 0;
+  int Overlapped = 0, Wrong = 0;
+  // Devices of the host plugins share the address space of the host, so the
+  // region sees the flag through the pointer.
+  volatile int *FlagPtr = &Flag;
+
+  for (int i = 0; i < N; ++i)
+    A[i] = 1;
+
+#pragma omp parallel num_threads(2) shared(Overlapped, Wrong)
+#pragma omp master
+  {
+    // The region waits for the flag the host sets after the construct, which
+    // it only sees if the construct returned without running the region.
+#pragma omp target nowait depend(out: A) map(tofrom: A) \
+    map(from: Overlapped) is_device_ptr(FlagPtr)
+    {
+      long i;
+      for (i = 0; i < SPIN_LIMIT && !*FlagPtr; ++i)
+        ;
+      Overlapped = i < SPIN_LIMIT;
+      for (int j = 0; j < N; ++j)
+        A[j] = 2;
+    }
+
+    Flag = 1;
+
+    // Released when the region is done.
+#pragma omp task depend(in: A)
+    for (int i = 0; i < N; ++i)
+      Wrong += A[i] != 2;
+
+#pragma omp taskwait
+  }
+
+  // CHECK: Overlapped = 1, Wrong = 0
+  printf("Overlapped = %d, Wrong = %d\n", Overlapped, Wrong);
+  return 0;
+}
@@ -0,0 +1,52 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <stdio.h>
+
+#define N 4096
+
+struct S {
+  int *P;
+  int Len;
+};
+
+int main(void) {
+  int In[N], Out[N], Priv[16], Data[N];
+  struct S Str = {Data, N};
+  int Errors = 0;
+
+  for (int i = 0; i < N; ++i) {
+    In[i] = i;
+    Out[i] = -1;
+    Data[i] = 2 * i;
+  }
+  for (int i = 0; i < 16; ++i)
+    Priv[i] = i;
+
+  // Copies in, the launch and copies out of each region are queued on the
+  // device and waited for once; the results must still all be in place.
+  for (int r = 0; r < 10; ++r) {
+#pragma omp target map(to: In) map(from: Out) firstprivate(Priv)              \
+    map(tofrom: Str, Str.P[0:N])
+    for (int i = 0; i < N; ++i) {
+      Out[i] = In[i] + Priv[i % 16] + r;
+      Str.P[i] += 1;
+    }
+
+    for (int i = 0; i < N; ++i)
+      if (Out[i] != i + i % 16 + r)
+        ++Errors;
+  }
+
+  for (int i = 0; i < N; ++i)
+    if (Data[i] != 2 * i + 10)
+      ++Errors;
+  if (Str.P != Data)
+    ++Errors;
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,44 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && env LLD_STAGING_SIZE=1 %libomptarget-run-aarch64-unknown-linux-gnu | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && env LLD_STAGING_SIZE=1 %libomptarget-run-powerpc64-ibm-linux-gnu | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && env LLD_STAGING_SIZE=1 %libomptarget-run-powerpc64le-ibm-linux-gnu | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && env LLD_STAGING_SIZE=1 %libomptarget-run-x86_64-pc-linux-gnu | %fcheck-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// More than the 1MB staging buffer, with a partial last chunk.
+#define N ((3 << 20) / sizeof(int) + 7)
+
+int main(void) {
+  int Host = omp_get_initial_device();
+  int *A = (int *)malloc(N * sizeof(int));
+  int *B = (int *)malloc(N * sizeof(int));
+  int Errors = 0;
+
+  for (size_t i = 0; i < N; ++i)
+    A[i] = i;
+
+  // Copy the array through every pair of devices and back to the host.
+  int NumDevices = omp_get_num_devices();
+  for (int Src = 0; Src < NumDevices; ++Src) {
+    int Dst = (Src + 1) % NumDevices;
+    int *SrcPtr = (int *)omp_target_alloc(N * sizeof(int), Src);
+    int *DstPtr = (int *)omp_target_alloc(N * sizeof(int), Dst);
+    omp_target_memcpy(SrcPtr, A, N * sizeof(int), 0, 0, Src, Host);
+    omp_target_memcpy(DstPtr, SrcPtr, N * sizeof(int), 0, 0, Dst, Src);
+    omp_target_memcpy(B, DstPtr, N * sizeof(int), 0, 0, Host, Dst);
+    for (size_t i = 0; i < N; ++i)
+      if (B[i] != (int)i)
+        ++Errors;
+    omp_target_free(SrcPtr, Src);
+    omp_target_free(DstPtr, Dst);
+  }
+
+  free(A);
+  free(B);
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
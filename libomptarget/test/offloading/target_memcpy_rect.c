@@ -0,0 +1,52 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu && %libomptarget-run-aarch64-unknown-linux-gnu | %fcheck-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu && %libomptarget-run-powerpc64-ibm-linux-gnu | %fcheck-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu && %libomptarget-run-powerpc64le-ibm-linux-gnu | %fcheck-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu && %libomptarget-run-x86_64-pc-linux-gnu | %fcheck-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 64
+
+int main(void) {
+  int Host = omp_get_initial_device();
+  int Dev = omp_get_default_device();
+  double *A = (double *)malloc(N * N * N * sizeof(double));
+  double *B = (double *)calloc(N * N * N, sizeof(double));
+  double *D = (double *)omp_target_alloc(N * N * N * sizeof(double), Dev);
+  int Errors = 0;
+
+  for (int i = 0; i < N * N * N; ++i)
+    A[i] = i;
+
+  // Exchange the halo faces of a cube: whole planes, rows and single
+  // elements per row.
+  size_t Dims[3] = {N, N, N};
+  size_t Faces[3][3] = {{1, N, N}, {N, 1, N}, {N, N, 1}};
+  for (int f = 0; f < 3; ++f) {
+    size_t Offsets[3] = {0, 0, 0};
+    Offsets[f] = N - 1;
+    omp_target_memcpy_rect(D, A, sizeof(double), 3, Faces[f], Offsets,
+                           Offsets, Dims, Dims, Dev, Host);
+    omp_target_memcpy_rect(B, D, sizeof(double), 3, Faces[f], Offsets,
+                           Offsets, Dims, Dims, Host, Dev);
+  }
+
+  for (int i = 0; i < N; ++i)
+    for (int j = 0; j < N; ++j)
+      for (int k = 0; k < N; ++k) {
+        int x = (i * N + j) * N + k;
+        int OnFace = i == N - 1 || j == N - 1 || k == N - 1;
+        if (B[x] != (OnFace ? A[x] : 0))
+          ++Errors;
+      }
+
+  omp_target_free(D, Dev);
+  free(A);
+  free(B);
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,72 @@
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -ldl && env LIBOMPTARGET_DEVICE_MEMORY=1 LLD_PROFILE=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=STREAM
+// RUN: %libomptarget-compile-aarch64-unknown-linux-gnu -ldl && env LLD_PROFILE=1 %libomptarget-run-aarch64-unknown-linux-gnu 2>&1 | %fcheck-aarch64-unknown-linux-gnu -check-prefix=FIT
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -ldl && env LIBOMPTARGET_DEVICE_MEMORY=1 LLD_PROFILE=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=STREAM
+// RUN: %libomptarget-compile-powerpc64-ibm-linux-gnu -ldl && env LLD_PROFILE=1 %libomptarget-run-powerpc64-ibm-linux-gnu 2>&1 | %fcheck-powerpc64-ibm-linux-gnu -check-prefix=FIT
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -ldl && env LIBOMPTARGET_DEVICE_MEMORY=1 LLD_PROFILE=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=STREAM
+// RUN: %libomptarget-compile-powerpc64le-ibm-linux-gnu -ldl && env LLD_PROFILE=1 %libomptarget-run-powerpc64le-ibm-linux-gnu 2>&1 | %fcheck-powerpc64le-ibm-linux-gnu -check-prefix=FIT
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -ldl && env LIBOMPTARGET_DEVICE_MEMORY=1 LLD_PROFILE=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=STREAM
+// RUN: %libomptarget-compile-x86_64-pc-linux-gnu -ldl && env LLD_PROFILE=1 %libomptarget-run-x86_64-pc-linux-gnu 2>&1 | %fcheck-x86_64-pc-linux-gnu -check-prefix=FIT
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N (1 << 20)
+
+static double *A, *B;
+
+// Stands in for the compiler: A and B are streamed with a halo of one
+// element, the literal is the extent of their index.
+int __tgt_target(int64_t device_id, void *host_ptr, int32_t arg_num,
+                 void **args_base, void **args, int64_t *arg_sizes,
+                 int64_t *arg_types) {
+  int (*Next)(int64_t, void *, int32_t, void **, void **, int64_t *,
+              int64_t *) = dlsym(RTLD_NEXT, "__tgt_target");
+  int64_t Types[arg_num];
+  for (int i = 0; i < arg_num; ++i) {
+    Types[i] = arg_types[i];
+    if (args[i] == A || args[i] == B)
+      Types[i] |= 0x800000000 | (1L << 36);
+    else if (arg_types[i] & 0x100)
+      Types[i] |= 0x800000000;
+  }
+  return Next(device_id, host_ptr, arg_num, args_base, args, arg_sizes, Types);
+}
+
+int main(void) {
+  long n = N;
+  double *a = malloc(N * sizeof(double));
+  double *b = malloc(N * sizeof(double));
+  for (long i = 0; i < n; ++i) {
+    a[i] = i % 7;
+    b[i] = -1;
+  }
+  A = a;
+  B = b;
+
+#pragma omp target map(to: a[0:n]) map(from: b[0:n])
+  for (long i = 1; i < n - 1; ++i)
+    b[i] = a[i - 1] + a[i] + a[i + 1];
+
+  int Errors = 0;
+  for (long i = 1; i < n - 1; ++i)
+    if (b[i] != a[i - 1] + a[i] + a[i + 1])
+      ++Errors;
+  // Before the profile, printed at exit.
+  printf("Errors = %d\n", Errors);
+  fflush(stdout);
+  return 0;
+}
+
+// 16 MB of arrays on 1 MB of device memory go through in tiles, the next one
+// copied while the kernel runs on the current one; a is copied in with the
+// halos of each tile, b copied back once.
+// STREAM: Errors = 0
+// STREAM: {{.*}}main{{.*}} 1 {{.*}} {{[0-9]+}} 8388608
+// STREAM: streamed {{[0-9]+}} tiles, {{[0-9.]+}}% of {{[0-9.]+}} ms of transfers overlapped
+
+// With room on the device the region is mapped as usual.
+// FIT: Errors = 0
+// FIT-NOT: streamed
@@ -0,0 +1,53 @@
+// RUN: %libomptarget-compile-run-and-check-aarch64-unknown-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-powerpc64le-ibm-linux-gnu
+// RUN: %libomptarget-compile-run-and-check-x86_64-pc-linux-gnu
+
+#include <omp.h>
+#include <stdio.h>
+
+#define N 100000
+
+double A[N], B[N];
+
+int main(void) {
+  int Errors = 0;
+  int Teams = 0;
+
+  for (int i = 0; i < N; ++i) {
+    A[i] = 0;
+    B[i] = i;
+  }
+
+  // Without a num_teams clause the league is sized from the trip count;
+  // every iteration must still run exactly once.
+  for (int r = 0; r < 3; ++r) {
+#pragma omp target teams distribute parallel for map(tofrom: A, Teams) \
+    map(to: B)
+    for (int i = 0; i < N; ++i) {
+      A[i] += 2 * B[i];
+      if (i == 0)
+        Teams = omp_get_num_teams();
+    }
+  }
+
+  for (int i = 0; i < N; ++i)
+    if (A[i] != 6.0 * i)
+      ++Errors;
+  if (Teams < 1)
+    ++Errors;
+
+  // An explicit number of teams is honored as well.
+  int Count = 0;
+#pragma omp target teams num_teams(2) map(tofrom: Count)
+  {
+#pragma omp atomic
+    Count += 1;
+  }
+  if (Count < 1 || Count > 2)
+    ++Errors;
+
+  // CHECK: Errors = 0
+  printf("Errors = %d\n", Errors);
+  return 0;
+}
@@ -0,0 +1,67 @@
+//===------ lld-bench-image.cpp - Device image of lld-bench ---------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Kernels of lld-bench, built as a shared object that the generic-elf plugins
+// load as a device image. The entries must stay in the order of BenchEntries
+// in lld-bench.cpp.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+struct EntryTy {
+  void *Addr;
+  const char *Name;
+  size_t Size;
+  int32_t Flags;
+  int32_t Reserved;
+};
+
+// What the compiler emits for a teams construct, from libomp.
+struct IdentTy {
+  int32_t Reserved1;
+  int32_t Flags;
+  int32_t Reserved2;
+  int32_t Reserved3;
+  const char *Source;
+};
+typedef void (*MicroTaskTy)(int32_t *, int32_t *, ...);
+
+extern "C" {
+
+void __kmpc_fork_teams(IdentTy *Loc, int32_t ArgC, MicroTaskTy Task, ...);
+int omp_get_team_num(void);
+int omp_get_num_teams(void);
+
+// Write one byte of each of four mapped arrays.
+void lld_bench_touch4(char *A, char *B, char *C, char *D) {
+  A[0] = B[0] = C[0] = D[0] = 1;
+}
+
+static void fillTeams(int32_t *, int32_t *, char *A, int64_t *Size) {
+  int64_t Team = omp_get_team_num(), Teams = omp_get_num_teams();
+  int64_t Begin = *Size * Team / Teams, End = *Size * (Team + 1) / Teams;
+  memset(A + Begin, 1, End - Begin);
+}
+
+// Fill the Size bytes of A, split evenly over the teams of the league, as a
+// target teams distribute loop does.
+void lld_bench_teams(char *A, int64_t *Size) {
+  static IdentTy Loc = {0, 0x02, 0, 0, ";lld-bench-image;lld_bench_teams;0;0;;"};
+  __kmpc_fork_teams(&Loc, 2, (MicroTaskTy)fillTeams, A, Size);
+}
+
+__attribute__((section(".omp_offloading.entries"), used))
+EntryTy LLDBenchEntries[] = {
+    {(void *)lld_bench_touch4, "lld_bench_touch4", 0, 0, 0},
+    {(void *)lld_bench_teams, "lld_bench_teams", 0, 0, 0}};
+
+} // extern "C"
@@ -0,0 +1,287 @@
+//===------ lld-bench.cpp - Offload overhead microbenchmarks --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Times offloads issued through the compiler interface of libomptarget, with
+// the kernels of lld-bench-image.so as device image, so that the overheads of
+// the runtime can be measured on the generic-elf plugins without an
+// offloading compiler. Settings read from the environment, e.g. LLD_POOL_SIZE,
+// apply as usual: run a benchmark with and without them to compare.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "omptarget.h"
+
+// From libomp, which offloading programs run with.
+extern "C" double omp_get_wtime(void);
+
+// Host side of the entries of lld-bench-image.cpp, in the same order.
+static char TouchKey, TeamsKey;
+static __tgt_offload_entry BenchEntries[] = {
+    {&TouchKey, (char *)"lld_bench_touch4", 0, 0, 0},
+    {&TeamsKey, (char *)"lld_bench_teams", 0, 0, 0}};
+
+struct OptionsTy {
+  int64_t Iterations = 2000;
+  std::vector<int64_t> Args;
+};
+
+// pool [KB]: a region mapping four fresh arrays of KB kilobytes, as a time
+// step of a solver that maps the same sizes every step.
+static int benchPool(const OptionsTy &Opts) {
+  int64_t Size = (Opts.Args.empty() ? 64 : Opts.Args[0]) * 1024;
+  std::vector<char> Arrays[4];
+  void *Args[4];
+  int64_t Sizes[4], Types[4];
+  for (int i = 0; i < 4; ++i) {
+    Arrays[i].resize(Size);
+    Args[i] = Arrays[i].data();
+    Sizes[i] = Size;
+    Types[i] = OMP_TGT_MAPTYPE_TARGET_PARAM;
+  }
+
+  double Start = omp_get_wtime();
+  for (int64_t It = 0; It < Opts.Iterations; ++It)
+    if (__tgt_target(OFFLOAD_DEVICE_DEFAULT, &TouchKey, 4, Args, Args, Sizes,
+            Types) != OFFLOAD_SUCCESS)
+      return 1;
+  double Seconds = omp_get_wtime() - Start;
+  printf("pool: 4 x %" PRId64 " KB arrays, %" PRId64 " regions, %.2f us per "
+      "region\n", Size / 1024, Opts.Iterations,
+      Seconds * 1e6 / Opts.Iterations);
+  return 0;
+}
+
+// launch [N]: regions on four present arrays while N other mappings are live,
+// as in codes entering per-block arrays once and launching many kernels.
+static int benchLaunch(const OptionsTy &Opts) {
+  int64_t Live = Opts.Args.empty() ? 10000 : Opts.Args[0];
+  // Objects of 64 bytes, 128 bytes apart so that no two are adjacent.
+  const int64_t Stride = 128, Size = 64;
+  std::vector<char> Objects((Live + 4) * Stride);
+  std::vector<void *> Args(Live + 4);
+  std::vector<int64_t> Sizes(Live + 4, Size);
+  std::vector<int64_t> Types(Live + 4, OMP_TGT_MAPTYPE_TO);
+  for (int64_t i = 0; i < Live + 4; ++i)
+    Args[i] = &Objects[i * Stride];
+  // The launched arrays are spread over the mapped range.
+  void *LaunchArgs[4];
+  int64_t LaunchTypes[4];
+  for (int i = 0; i < 4; ++i) {
+    LaunchArgs[i] = Args[(Live + 3) * i / 3];
+    LaunchTypes[i] = OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM |
+        OMP_TGT_MAPTYPE_TARGET_PARAM;
+  }
+
+  __tgt_target_data_begin(OFFLOAD_DEVICE_DEFAULT, Live + 4, Args.data(),
+      Args.data(), Sizes.data(), Types.data());
+  double Start = omp_get_wtime();
+  int rc = 0;
+  for (int64_t It = 0; It < Opts.Iterations && !rc; ++It)
+    rc = __tgt_target(OFFLOAD_DEVICE_DEFAULT, &TouchKey, 4, LaunchArgs,
+        LaunchArgs, Sizes.data(), LaunchTypes);
+  double Seconds = omp_get_wtime() - Start;
+  __tgt_target_data_end(OFFLOAD_DEVICE_DEFAULT, Live + 4, Args.data(),
+      Args.data(), Sizes.data(), Types.data());
+  if (rc)
+    return 1;
+  printf("launch: %" PRId64 " live mappings, %" PRId64 " regions, %.2f us "
+      "per region\n", Live + 4, Opts.Iterations,
+      Seconds * 1e6 / Opts.Iterations);
+  return 0;
+}
+
+// threads [T] [N]: T host threads launching regions at once, each on four
+// present arrays of its own, while N other mappings are live, as in codes
+// offloading from every thread of a parallel region. Each thread launches
+// the given number of iterations.
+static int benchThreads(const OptionsTy &Opts) {
+  int64_t Threads = Opts.Args.size() > 0 ? Opts.Args[0] : 4;
+  int64_t Live = Opts.Args.size() > 1 ? Opts.Args[1] : 1000;
+  if (Threads < 1)
+    return 1;
+  const int64_t Stride = 128, Size = 64;
+  int64_t Total = Live + 4 * Threads;
+  std::vector<char> Objects(Total * Stride);
+  std::vector<void *> Args(Total);
+  std::vector<int64_t> Sizes(Total, Size);
+  std::vector<int64_t> Types(Total, OMP_TGT_MAPTYPE_TO);
+  for (int64_t i = 0; i < Total; ++i)
+    Args[i] = &Objects[i * Stride];
+  __tgt_target_data_begin(OFFLOAD_DEVICE_DEFAULT, Total, Args.data(),
+      Args.data(), Sizes.data(), Types.data());
+
+  // Thread T launches on Args[Live + 4 * T, Live + 4 * T + 4).
+  std::vector<int> Rcs(Threads, 0);
+  auto launch = [&](int64_t T) {
+    void **LaunchArgs = &Args[Live + 4 * T];
+    int64_t LaunchTypes[4];
+    for (int i = 0; i < 4; ++i)
+      LaunchTypes[i] = OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_FROM |
+          OMP_TGT_MAPTYPE_TARGET_PARAM;
+    for (int64_t It = 0; It < Opts.Iterations && !Rcs[T]; ++It)
+      Rcs[T] = __tgt_target(OFFLOAD_DEVICE_DEFAULT, &TouchKey, 4, LaunchArgs,
+          LaunchArgs, Sizes.data(), LaunchTypes);
+  };
+  double Start = omp_get_wtime();
+  std::vector<std::thread> Workers;
+  for (int64_t T = 1; T < Threads; ++T)
+    Workers.emplace_back(launch, T);
+  launch(0);
+  for (std::thread &W : Workers)
+    W.join();
+  double Seconds = omp_get_wtime() - Start;
+  __tgt_target_data_end(OFFLOAD_DEVICE_DEFAULT, Total, Args.data(),
+      Args.data(), Sizes.data(), Types.data());
+  for (int rc : Rcs)
+    if (rc)
+      return 1;
+  printf("threads: %" PRId64 " threads, %" PRId64 " live mappings, %" PRId64
+      " regions each, %.2f us per region, %.2f M regions/s\n", Threads, Total,
+      Opts.Iterations, Seconds * 1e6 / Opts.Iterations,
+      Threads * Opts.Iterations / Seconds / 1e6);
+  return 0;
+}
+
+// teams [KB]: teams regions filling a present array of KB kilobytes, the
+// league sized by the plugin from the trip count of one iteration per 4 KB.
+// Run with OMP_NUM_TEAMS=1, 2, ... to see how regions scale with the teams.
+static int benchTeams(const OptionsTy &Opts) {
+  int64_t Size = (Opts.Args.empty() ? 16384 : Opts.Args[0]) * 1024;
+  std::vector<char> Array(Size);
+  void *Args[2] = {Array.data(), &Size};
+  int64_t Sizes[2] = {Size, sizeof(Size)};
+  int64_t Types[2] = {OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_TARGET_PARAM,
+                      OMP_TGT_MAPTYPE_TO | OMP_TGT_MAPTYPE_TARGET_PARAM};
+
+  __tgt_target_data_begin(OFFLOAD_DEVICE_DEFAULT, 1, Args, Args, Sizes,
+      Types);
+  double Start = omp_get_wtime();
+  int rc = 0;
+  for (int64_t It = 0; It < Opts.Iterations && !rc; ++It) {
+    __kmpc_push_target_tripcount(OFFLOAD_DEVICE_DEFAULT, (Size + 4095) / 4096);
+    rc = __tgt_target_teams(OFFLOAD_DEVICE_DEFAULT, &TeamsKey, 2, Args, Args,
+        Sizes, Types, 0, 0);
+  }
+  double Seconds = omp_get_wtime() - Start;
+  __tgt_target_data_end(OFFLOAD_DEVICE_DEFAULT, 1, Args, Args, Sizes, Types);
+  if (rc)
+    return 1;
+  printf("teams: %" PRId64 " KB array, %" PRId64 " regions, %.2f us per "
+      "region, %.2f GB/s\n", Size / 1024, Opts.Iterations,
+      Seconds * 1e6 / Opts.Iterations, Size * Opts.Iterations / Seconds / 1e9);
+  return 0;
+}
+
+struct BenchmarkTy {
+  const char *Name;
+  int (*Run)(const OptionsTy &);
+  const char *Help;
+};
+
+static const BenchmarkTy Benchmarks[] = {
+    {"launch", benchLaunch,
+     "[N]   regions on 4 present arrays among N live mappings (default "
+     "10000)"},
+    {"pool", benchPool, "[KB]  regions mapping 4 new arrays (default 64 KB)"},
+    {"threads", benchThreads,
+     "[T] [N]  T threads launching at once among N live mappings (default "
+     "4, 1000)"},
+    {"teams", benchTeams,
+     "[KB]  teams regions filling a present array (default 16384 KB)"}};
+
+static void usage(const char *Prog) {
+  fprintf(stderr, "Usage: %s [options] <benchmark> [args]\n"
+      "  -i <image>  device image (default lld-bench-image.so next to %s)\n"
+      "  -n <n>      iterations (default 2000)\n"
+      "Benchmarks:\n", Prog, Prog);
+  for (const BenchmarkTy &B : Benchmarks)
+    fprintf(stderr, "  %-10s %s\n", B.Name, B.Help);
+}
+
+// The image installed next to the executable.
+static std::string defaultImage() {
+  char Path[4096];
+  ssize_t Len = readlink("/proc/self/exe", Path, sizeof(Path) - 1);
+  if (Len <= 0)
+    return "lld-bench-image.so";
+  std::string Exe(Path, Len);
+  return Exe.substr(0, Exe.rfind('/') + 1) + "lld-bench-image.so";
+}
+
+static bool readImage(const std::string &Path, std::vector<char> &Image) {
+  FILE *F = fopen(Path.c_str(), "rb");
+  if (!F)
+    return false;
+  char Buf[65536];
+  size_t Len;
+  while ((Len = fread(Buf, 1, sizeof(Buf), F)) > 0)
+    Image.insert(Image.end(), Buf, Buf + Len);
+  fclose(F);
+  return !Image.empty();
+}
+
+int main(int argc, char **argv) {
+  OptionsTy Opts;
+  std::string ImagePath = defaultImage();
+  const BenchmarkTy *Bench = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+      ImagePath = argv[++i];
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      Opts.Iterations = strtoll(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else if (!Bench) {
+      for (const BenchmarkTy &B : Benchmarks)
+        if (!strcmp(argv[i], B.Name))
+          Bench = &B;
+      if (!Bench) {
+        fprintf(stderr, "Unknown benchmark '%s'\n", argv[i]);
+        return 1;
+      }
+    } else {
+      Opts.Args.push_back(strtoll(argv[i], NULL, 10));
+    }
+  }
+  if (!Bench || Opts.Iterations <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<char> Image;
+  if (!readImage(ImagePath, Image)) {
+    fprintf(stderr, "Cannot read device image %s\n", ImagePath.c_str());
+    return 1;
+  }
+  __tgt_offload_entry *EntriesEnd =
+      BenchEntries + sizeof(BenchEntries) / sizeof(BenchEntries[0]);
+  __tgt_device_image DeviceImage = {Image.data(), Image.data() + Image.size(),
+                                    BenchEntries, EntriesEnd};
+  __tgt_bin_desc Desc = {1, &DeviceImage, BenchEntries, EntriesEnd};
+  __tgt_register_lib(&Desc);
+  if (omp_get_num_devices() < 1) {
+    fprintf(stderr, "No device for %s\n", ImagePath.c_str());
+    __tgt_unregister_lib(&Desc);
+    return 1;
+  }
+  int rc = Bench->Run(Opts);
+  __tgt_unregister_lib(&Desc);
+  return rc;
+}
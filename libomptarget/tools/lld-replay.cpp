@@ -0,0 +1,134 @@
+//===------ lld-replay.cpp - Replay offload traces under each policy ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is dual licensed under the MIT and the University of Illinois Open
+// Source Licenses. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Replays traces recorded with LLD_RECORD=<file> through the placement engine
+// of libomptarget on a simulated device, once per LLD_GPU_MODE policy, and
+// reports what each policy would have moved.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lld_replay.h"
+#include "omptarget.h"
+
+struct PolicyTy {
+  const char *Name; // as in LLD_GPU_MODE
+  int32_t Mode;
+};
+
+static const PolicyTy Policies[] = {
+    {"CLUSTER", 0}, {"OBJ", -1}, {"LOCAL", -2}, {"RD", -3},  {"LRU", -4},
+    {"COST", -5},   {"UM", 1},   {"DEV", 2},    {"HOST", 3}, {"HYB", 4},
+    {"SDEV", 5}};
+
+static void usage(const char *Prog) {
+  fprintf(stderr,
+      "Usage: %s [options] <trace>...\n"
+      "  -c <MB>        device capacity (default 14336)\n"
+      "  -f <n>         prefetch up to n time stamps ahead (LLD_PREFETCH=<n>)\n"
+      "  -m <policies>  comma separated LLD_GPU_MODE values (default all)\n"
+      "  -p             enable partial mapping (LLD_PARTIAL_MAP=1)\n"
+      "  -r <n>         recycle unmapped data, up to n entries if n > 1\n"
+      "                 (LLD_RECYCLE=<n>)\n",
+      Prog);
+}
+
+static const PolicyTy *findPolicy(const std::string &Name) {
+  for (const PolicyTy &P : Policies)
+    if (Name == P.Name)
+      return &P;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int64_t Capacity = 14 * 1024;
+  int32_t PartialMap = 0, Recycle = 0, Prefetch = 0;
+  std::vector<const PolicyTy *> Selected;
+  std::vector<const char *> Traces;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      Capacity = strtoll(argv[++i], NULL, 10);
+    } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+      Prefetch = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      std::string List = argv[++i];
+      size_t Pos = 0;
+      while (Pos <= List.size()) {
+        size_t End = List.find(',', Pos);
+        if (End == std::string::npos)
+          End = List.size();
+        const PolicyTy *P = findPolicy(List.substr(Pos, End - Pos));
+        if (!P) {
+          fprintf(stderr, "Unknown policy '%s'\n",
+              List.substr(Pos, End - Pos).c_str());
+          return 1;
+        }
+        Selected.push_back(P);
+        Pos = End + 1;
+      }
+    } else if (!strcmp(argv[i], "-p")) {
+      PartialMap = 1;
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      Recycle = atoi(argv[++i]);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      Traces.push_back(argv[i]);
+    }
+  }
+  if (Traces.empty() || Capacity <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (Selected.empty())
+    for (const PolicyTy &P : Policies)
+      Selected.push_back(&P);
+
+  const double MB = 1024.0 * 1024.0;
+  int rc = 0;
+  for (const char *Trace : Traces) {
+    printf("%s: device capacity %" PRId64 " MB\n", Trace, Capacity);
+    printf("%-8s %10s %12s %12s %12s %10s %8s %12s", "Policy", "Events",
+        "To(MB)", "From(MB)", "Moved(MB)", "Evictions", "Hit(%)",
+        "Peak(MB)");
+    if (Prefetch > 0)
+      printf(" %10s %8s %8s %8s", "Prefetch", "Hits", "Late", "Useless");
+    printf("\n");
+    for (const PolicyTy *P : Selected) {
+      __tgt_replay_stats S;
+      if (__tgt_replay_trace(Trace, P->Mode, Capacity * 1024 * 1024,
+              PartialMap, Recycle, Prefetch, &S) != OFFLOAD_SUCCESS) {
+        fprintf(stderr, "%s: unreadable or truncated trace, stopped after %"
+            PRId64 " events\n", Trace, S.Events);
+        rc = 1;
+        if (S.Events == 0)
+          break;
+      }
+      double Hit = S.AccessedBytes ?
+          100.0 * S.ResidentBytes / S.AccessedBytes : 0.0;
+      printf("%-8s %10" PRId64 " %12.1f %12.1f %12.1f %10" PRId64
+          " %8.1f %12.1f", P->Name, S.Events, S.BytesToDevice / MB,
+          S.BytesFromDevice / MB, (S.BytesToDevice + S.BytesFromDevice) / MB,
+          S.Evictions, Hit, S.PeakDeviceBytes / MB);
+      if (Prefetch > 0)
+        printf(" %10" PRId64 " %8" PRId64 " %8" PRId64 " %8" PRId64,
+            S.Prefetches, S.PrefetchHits, S.PrefetchLate, S.PrefetchUseless);
+      printf("\n");
+    }
+  }
+  return rc;
+}
@@ -3142,6 +3142,19 @@ void __kmpc_proxy_task_completed(kmp_int32 gtid, kmp_task_t *ptask) {
             gtid, taskdata));
 }
 
+/*!
+@ingroup TASKING
+@param gtid Global Thread ID of encountering thread
+@return 1 if the thread is executing an explicit task, 0 otherwise
+
+Used by libomptarget to tell a nowait offload that the compiler already wrapped
+in a task from one that it has to defer itself.
+*/
+kmp_int32 __kmpc_omp_in_explicit_task(kmp_int32 gtid) {
+  kmp_taskdata_t *taskdata = __kmp_threads[gtid]->th.th_current_task;
+  return taskdata->td_flags.tasktype == TASK_EXPLICIT;
+}
+
 /*!
 @ingroup TASKING
 @param ptask Task which execution is completed